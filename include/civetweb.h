@@ -72,6 +72,100 @@ struct mg_request_info {
         const char *name;       /* HTTP header name */
         const char *value;      /* HTTP header value */
     } http_headers[64];         /* Maximum 64 headers */
+
+    int method_id;              /* HTTP_METHOD_* of request_method */
+};
+
+
+/* Request methods known to civetweb, see mg_request_info.method_id */
+enum {
+    HTTP_METHOD_OTHER,          /* Any other method, or an HTTP response */
+    HTTP_METHOD_GET,
+    HTTP_METHOD_HEAD,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+    HTTP_METHOD_OPTIONS,
+    HTTP_METHOD_CONNECT,
+    HTTP_METHOD_PROPFIND,
+    HTTP_METHOD_MKCOL,
+    HTTP_METHOD_PATCH,
+    HTTP_METHOD_COPY,
+    HTTP_METHOD_MOVE,
+    HTTP_METHOD_LOCK,
+    HTTP_METHOD_UNLOCK
+};
+
+
+/* Timestamps of the processing phases of a request, see
+   mg_get_request_timings(). All values are microseconds of a monotonic
+   clock, 0 if the phase has not been reached. */
+struct mg_request_timings {
+    long long queued;           /* Connection put into the queue, after
+                                   accept or after an idle keep-alive
+                                   connection received data. 0 for further
+                                   requests handled without queueing. */
+    long long dequeued;         /* Connection taken by a worker thread */
+    long long request_start;    /* Worker starts reading the request */
+    long long headers_read;     /* Request line and headers parsed */
+    long long handler_start;    /* URI resolved, request handling starts */
+    long long handler_end;      /* Request handling returned */
+    long long last_write;       /* Last response data passed to the socket */
+};
+
+
+/* Server statistics, see mg_get_context_stats(). Counters are totals since
+   mg_start(). */
+struct mg_context_stats {
+    int num_threads;            /* Worker threads running */
+    int idle_threads;           /* Worker threads waiting for a connection */
+    int queue_depth;            /* Connections waiting for a worker thread */
+    int queue_size;             /* Length of the connection queue */
+    int queue_max_depth;        /* Highest queue depth seen */
+    long long queue_full;       /* Times the connection queue was full */
+    long long queue_full_usec;  /* Time spent waiting for a free queue slot */
+    long long rejected;         /* Connections rejected with a 503 */
+    long long connections;      /* Connections taken by worker threads,
+                                   including keep-alive wakeups */
+    long long queued_usec;      /* Time connections spent in the queue */
+    long long requests;         /* Requests handled */
+    long long keep_alive_requests; /* Requests on a reused connection */
+    long long status_class[6];  /* Responses by status class: index 1 for
+                                   1xx up to 5 for 5xx, 0 for no response */
+    long long bytes_in;         /* Request headers and bodies received */
+    long long bytes_out;        /* Response body bytes sent, as logged in
+                                   the access log */
+    long long websocket_frames_in;  /* Websocket frames received */
+    long long websocket_frames_out; /* Websocket frames sent */
+    long long ssl_handshakes;   /* Completed SSL handshakes */
+    long long static_cache_hits;      /* Static files served from memory,
+                                         see static_cache_size */
+    long long static_cache_misses;    /* Static files read from disk */
+    long long static_cache_evictions; /* Files dropped to make room */
+    long long log_lines_dropped;      /* Access and error log lines dropped
+                                         as the buffer was full, see
+                                         log_buffer_full */
+};
+
+
+/* Request latency percentiles, see mg_get_latency_stats(). Latencies are
+   measured from accepting the connection (or from the start of the request
+   on a reused connection) until the last response byte was written, with a
+   resolution of about 12%. count and sum_usec cover all requests since the
+   server started, the maximum and the percentiles only those since the
+   caller's last reset. */
+struct mg_latency_stats {
+    const char *group;          /* "handler", "dispatch" or "status" */
+    const char *name;           /* Handler URI, dispatch class ("handler",
+                                   "static", "cgi", "lua", "lsp", "ssi",
+                                   "other") or status class ("2xx", ...) */
+    long long count;            /* Requests recorded */
+    long long sum_usec;         /* Sum of all latencies */
+    long long max_usec;         /* Highest latency */
+    long long p50_usec;
+    long long p90_usec;
+    long long p99_usec;
+    long long p999_usec;
 };
 
 
@@ -198,6 +292,51 @@ CIVETWEB_API struct mg_context *mg_start(const struct mg_callbacks *callbacks,
 CIVETWEB_API void mg_stop(struct mg_context *);
 
 
+/* Reopen the access and error log files.
+
+   Only needed with log_buffer_size, when the files are kept open: call it
+   after the files were renamed for rotation, e.g. on SIGHUP. The files are
+   reopened by the log writer threads, so this returns right away. */
+CIVETWEB_API void mg_reopen_logs(struct mg_context *ctx);
+
+
+/* Get server statistics.
+
+   Counters are kept per worker thread without locking, and summed up when
+   this function is called. It is safe to call it from any thread, e.g.
+   periodically from a monitoring thread.
+
+   Return:
+     1 on success, 0 on error. */
+CIVETWEB_API int mg_get_context_stats(struct mg_context *ctx,
+                                      struct mg_context_stats *stats);
+
+
+/* Get request latency percentiles.
+
+   Latencies are recorded in log-bucketed histograms for every request
+   handler registered with mg_set_request_handler(), for every dispatch
+   class and for every response status class. The callback is called once
+   for every histogram, while an internal lock is held: it must not call
+   other civetweb functions.
+
+   Parameters:
+      ctx: server context.
+      reset: if nonzero, the next call reports the maximum and percentiles
+             of the requests since this one. This does not affect the
+             metrics_uri handler, which keeps a separate window.
+      callback: called for every histogram.
+      cbdata: passed to the callback.
+
+   Return:
+     1 on success, 0 on error. */
+typedef void (*mg_latency_stats_callback)(const struct mg_latency_stats *stats,
+                                          void *cbdata);
+CIVETWEB_API int mg_get_latency_stats(struct mg_context *ctx, int reset,
+                                      mg_latency_stats_callback callback,
+                                      void *cbdata);
+
+
 /* mg_request_handler
 
    Called when a new request comes in.  This callback is URI based
@@ -216,11 +355,17 @@ typedef int (* mg_request_handler)(struct mg_connection *conn, void *cbdata);
 
    Sets or removes a URI mapping for a request handler.
 
-   URI's are ordered and prefixed URI's are supported. For example,
-   consider two URIs: /a/b and /a
+   The handler with the longest matching URI is used, comparing whole
+   path segments. For example, consider two URIs: /a/b and /a
            /a   matches /a
            /a/b matches /a/b
            /a/c matches /a
+           /ab  matches neither
+   URIs may also be patterns, like **.php$. These are tried before
+   a plain URI that ends at the same segment as their literal part.
+
+   Handlers may be set and removed at any time, also from within a handler.
+   Requests in progress finish with the handlers they started with.
 
    Parameters:
       ctx: server context
@@ -305,6 +450,12 @@ CIVETWEB_API int mg_modify_passwords_file(const char *passwords_file_name,
 CIVETWEB_API struct mg_request_info *mg_get_request_info(struct mg_connection *);
 
 
+/* Return the timestamps of the current request. May be used from any
+   callback, e.g. end_request, to find out where the time was spent. */
+CIVETWEB_API const struct mg_request_timings *mg_get_request_timings(
+    const struct mg_connection *);
+
+
 /* Send data to the client.
    Return:
     0   when the connection has been closed
@@ -398,12 +549,53 @@ CIVETWEB_API int mg_read(struct mg_connection *, void *buf, size_t len);
 
 /* Get the value of particular HTTP header.
 
-   This is a helper function. It traverses request_info->http_headers array,
-   and if the header is present in the array, returns its value. If it is
-   not present, NULL is returned. */
+   This is a helper function. It looks the header up in an index of
+   request_info->http_headers built when the request was read, and if the
+   header is present, returns its value. If it is not present, NULL is
+   returned. If a header is sent more than once, the first value is
+   returned. */
 CIVETWEB_API const char *mg_get_header(const struct mg_connection *, const char *name);
 
 
+/* Well-known HTTP headers, see mg_get_header_id() */
+enum {
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CONTENT_RANGE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_EXPECT,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_ACCEPT,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_COOKIE,
+    HTTP_HEADER_ORIGIN,
+    HTTP_HEADER_REFERER,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_SEC_WEBSOCKET_KEY,
+    HTTP_HEADER_SEC_WEBSOCKET_VERSION,
+    HTTP_HEADER_DEPTH,
+    HTTP_HEADER_X_FORWARDED_FOR
+};
+
+
+/* Get the value of a well-known HTTP header.
+
+   Like mg_get_header(), but the header is given as one of the HTTP_HEADER_*
+   constants, and no string comparison is needed.
+
+   Return:
+     header value, or NULL if the header is not present. */
+CIVETWEB_API const char *mg_get_header_id(const struct mg_connection *,
+                                          int header_id);
+
+
 /* Get a value of particular form variable.
 
    Parameters:
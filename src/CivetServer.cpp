@@ -55,13 +55,14 @@ int CivetServer::requestHandler(struct mg_connection *conn, void *cbdata)
     CivetHandler *handler = (CivetHandler *)cbdata;
 
     if (handler) {
-        if (strcmp(request_info->request_method, "GET") == 0) {
+        switch (request_info->method_id) {
+        case HTTP_METHOD_GET:
             return handler->handleGet(me, conn) ? 1 : 0;
-        } else if (strcmp(request_info->request_method, "POST") == 0) {
+        case HTTP_METHOD_POST:
             return handler->handlePost(me, conn) ? 1 : 0;
-        } else if (strcmp(request_info->request_method, "PUT") == 0) {
+        case HTTP_METHOD_PUT:
             return handler->handlePut(me, conn) ? 1 : 0;
-        } else if (strcmp(request_info->request_method, "DELETE") == 0) {
+        case HTTP_METHOD_DELETE:
             return handler->handleDelete(me, conn) ? 1 : 0;
         }
     }
@@ -225,6 +225,8 @@ struct timespec {
 
 static int pthread_mutex_lock(pthread_mutex_t *);
 static int pthread_mutex_unlock(pthread_mutex_t *);
+static int pthread_mutex_trylock(pthread_mutex_t *);
+static int clock_gettime(clockid_t clk_id, struct timespec *tp);
 static void to_unicode(const char *path, wchar_t *wbuf, size_t wbuf_len);
 struct file;
 static char *mg_fgets(char *buf, size_t size, struct file *filep, char **p);
@@ -269,6 +271,7 @@ struct pollfd {
 #else    /* UNIX  specific */
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -313,8 +316,56 @@ typedef unsigned short int in_port_t;
 typedef int SOCKET;
 #define WINCDECL
 
+/* Idle keep-alive connections are parked in an epoll set watched by the
+   master thread, instead of holding a worker blocked in recv(). */
+#if defined(__linux__) && !defined(NO_KEEP_ALIVE_PARKING)
+#define USE_KEEP_ALIVE_PARKING
+#include <sys/epoll.h>
+#endif
+
+/* glibc hides SO_REUSEPORT from <sys/socket.h> when _XOPEN_SOURCE is set */
+#if defined(__linux__) && !defined(SO_REUSEPORT)
+#include <asm/socket.h>
+#endif
+
+/* Listening sockets are non-blocking, and accept4() drains the backlog.
+   Accepted sockets inherit their options from the listener. */
+#if defined(__linux__) && defined(SOCK_CLOEXEC) && !defined(NO_ACCEPT4)
+#define USE_ACCEPT4
+#if !defined(__USE_GNU)
+extern int accept4(int, struct sockaddr *, socklen_t *, int);
+#endif
+#endif
+
+/* Static files go from the page cache to plain sockets without being
+   copied through user space */
+#if defined(__linux__) && !defined(NO_SENDFILE)
+#define USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+/* Results of stat() and open descriptors may be cached, see file_cache_size.
+   On Linux, inotify tells the master thread about changed files. */
+#if !defined(NO_FILE_CACHE)
+#define USE_FILE_CACHE
+#if defined(__linux__)
+#define USE_INOTIFY
+#include <sys/inotify.h>
+#endif
+#endif
+
 #endif /* End of Windows and UNIX specific includes */
 
+/* SSE2 is part of every x86-64 CPU, no runtime detection is needed */
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(NO_SSE2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(USE_ZLIB)
+#include <zlib.h>
+#endif
+
 #ifdef _WIN32
 static CRITICAL_SECTION global_log_file_lock;
 static DWORD pthread_self(void)
@@ -360,6 +411,21 @@ void *pthread_getspecific(pthread_key_t key)
 #endif
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
+/* Without these, the cached clock is disabled and the socket queue is
+   protected by a mutex */
+#if defined(_MSC_VER)
+#define mg_memory_barrier() MemoryBarrier()
+#define mg_atomic_cas(p, old, new) \
+    (InterlockedCompareExchange((volatile LONG *) (p), (LONG) (new), \
+                                (LONG) (old)) == (LONG) (old))
+#elif defined(__GNUC__)
+#define mg_memory_barrier() __sync_synchronize()
+#define mg_atomic_cas(p, old, new) __sync_bool_compare_and_swap(p, old, new)
+#else
+#define NO_CLOCK
+#define NO_ATOMICS
+#endif
+
 #if !defined(DEBUG_TRACE)
 #if defined(DEBUG)
 
@@ -546,11 +612,6 @@ typedef int socklen_t;
 #define PATH_MAX 4096
 #endif
 
-/* Size of the accepted socket queue */
-#if !defined(MGSQLEN)
-#define MGSQLEN 20
-#endif
-
 static const char *http_500_error = "Internal Server Error";
 
 #if defined(NO_SSL_DL)
@@ -595,6 +656,11 @@ struct ssl_func {
 #define SSL_pending (* (int (*)(SSL *)) ssl_sw[18].ptr)
 #define SSL_CTX_set_verify (* (void (*)(SSL_CTX *, int, int)) ssl_sw[19].ptr)
 #define SSL_shutdown (* (int (*)(SSL *)) ssl_sw[20].ptr)
+#define SSL_get_version (* (const char * (*)(const SSL *)) ssl_sw[21].ptr)
+#define SSL_get_current_cipher \
+  (* (const void * (*)(const SSL *)) ssl_sw[22].ptr)
+#define SSL_CIPHER_get_name \
+  (* (const char * (*)(const void *)) ssl_sw[23].ptr)
 
 #define CRYPTO_num_locks (* (int (*)(void)) crypto_sw[0].ptr)
 #define CRYPTO_set_locking_callback \
@@ -630,6 +696,9 @@ static struct ssl_func ssl_sw[] = {
     {"SSL_pending", NULL},
     {"SSL_CTX_set_verify", NULL},
     {"SSL_shutdown",   NULL},
+    {"SSL_get_version", NULL},
+    {"SSL_get_current_cipher", NULL},
+    {"SSL_CIPHER_get_name", NULL},
     {NULL,    NULL}
 };
 
@@ -677,8 +746,9 @@ struct file {
     /* set to 1 if the content is gzipped
        in which case we need a content-encoding: gzip header */
     int gzipped;
+    struct file_cache_entry *cached; /* Non-NULL if opened from the cache */
 };
-#define STRUCT_FILE_INITIALIZER {0, 0, 0, NULL, NULL, 0}
+#define STRUCT_FILE_INITIALIZER {0, 0, 0, NULL, NULL, 0, NULL}
 
 /* Describes listening socket, or socket which was accept()-ed by the master
    thread and queued for future handling by the worker thread. */
@@ -689,6 +759,8 @@ struct socket {
     unsigned is_ssl:1;    /* Is port SSL-ed */
     unsigned ssl_redir:1; /* Is port supposed to redirect everything to SSL
                              port */
+    unsigned is_reused:1; /* Connection has served requests before */
+    int64_t queued;       /* Time the socket was queued, see produce_socket() */
 };
 
 /* NOTE(lsm): this enum shoulds be in sync with the config_options below. */
@@ -710,7 +782,12 @@ enum {
 #if defined(USE_LUA) && defined(USE_WEBSOCKET)
     LUA_WEBSOCKET_EXTENSIONS,
 #endif
-    ACCESS_CONTROL_ALLOW_ORIGIN, ERROR_PAGES,
+    ACCESS_CONTROL_ALLOW_ORIGIN, ERROR_PAGES, CONNECTION_QUEUE_SIZE,
+    NUM_ACCEPTORS, CONNECTION_QUEUE_WATERMARK, MIN_THREADS, MAX_THREADS,
+    THREAD_IDLE_TIMEOUT, ACCESS_LOG_TIMINGS, METRICS_URI,
+    FILE_CACHE_SIZE, FILE_CACHE_TTL, STATIC_CACHE_SIZE,
+    COMPRESSION_CACHE_SIZE, COMPRESSION_MIME_TYPES, LOG_BUFFER_SIZE,
+    LOG_BUFFER_FULL, ACCESS_LOG_FORMAT, ACCESS_LOG_FIELDS,
 
     NUM_OPTIONS
 };
@@ -761,40 +838,462 @@ static struct mg_option config_options[] = {
 #endif
     {"access_control_allow_origin", CONFIG_TYPE_STRING,        "*"},
     {"error_pages",                 CONFIG_TYPE_DIRECTORY,     NULL},
+    {"connection_queue",            CONFIG_TYPE_NUMBER,        "20"},
+    {"num_acceptors",               CONFIG_TYPE_NUMBER,        "1"},
+    {"connection_queue_watermark",  CONFIG_TYPE_NUMBER,        "0"},
+    {"min_threads",                 CONFIG_TYPE_NUMBER,        NULL},
+    {"max_threads",                 CONFIG_TYPE_NUMBER,        NULL},
+    {"thread_idle_timeout_ms",      CONFIG_TYPE_NUMBER,        "60000"},
+    {"access_log_timings",          CONFIG_TYPE_BOOLEAN,       "no"},
+    {"metrics_uri",                 CONFIG_TYPE_STRING,        NULL},
+    {"file_cache_size",             CONFIG_TYPE_NUMBER,        "0"},
+    {"file_cache_ttl_ms",           CONFIG_TYPE_NUMBER,        "60000"},
+    {"static_cache_size",           CONFIG_TYPE_NUMBER,        "0"},
+    {"compression_cache_size",      CONFIG_TYPE_NUMBER,        "0"},
+    {"compression_mime_types",      CONFIG_TYPE_EXT_PATTERN,
+     "text/|application/javascript|application/json|application/xml|"
+     "image/svg+xml"},
+    {"log_buffer_size",             CONFIG_TYPE_NUMBER,        "0"},
+    {"log_buffer_full",             CONFIG_TYPE_STRING,        "block"},
+    {"access_log_format",           CONFIG_TYPE_STRING,        "combined"},
+    {"access_log_fields",           CONFIG_TYPE_STRING,
+     "remote_addr,remote_user,time,method,uri,http_version,status,"
+     "bytes_sent,referer,user_agent"},
 
     {NULL, CONFIG_TYPE_UNKNOWN, NULL}
 };
 
+/* Counters kept per worker thread, see mg_get_context_stats() */
+enum {
+    STAT_CONNECTIONS, STAT_QUEUED_USEC, STAT_REQUESTS,
+    STAT_KEEP_ALIVE_REQUESTS, STAT_STATUS_OTHER, STAT_STATUS_1XX,
+    STAT_STATUS_2XX, STAT_STATUS_3XX, STAT_STATUS_4XX, STAT_STATUS_5XX,
+    STAT_BYTES_IN, STAT_BYTES_OUT, STAT_WEBSOCKET_FRAMES_IN,
+    STAT_WEBSOCKET_FRAMES_OUT, STAT_SSL_HANDSHAKES, STAT_STATIC_CACHE_HITS,
+    STAT_STATIC_CACHE_MISSES, STAT_STATIC_CACHE_EVICTIONS,
+
+    NUM_STATS
+};
+
+/* Request latency histogram. Values below 2^HIST_SUB_BITS usec have a
+   bucket each, larger values are bucketed by their highest HIST_SUB_BITS + 1
+   significant bits, similar to HdrHistogram. */
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct latency_histogram {
+    int64_t count;
+    int64_t sum;
+    int64_t max;
+    int64_t buckets[HIST_BUCKETS];
+};
+
+/* Histograms are never cleared. Every reader keeps a copy taken at its
+   last reset instead, and percentiles are computed from the difference,
+   so readers do not take each other's samples. */
+enum {LATENCY_READER_API, LATENCY_READER_METRICS, NUM_LATENCY_READERS};
+
+/* How handle_request() dispatched a request */
+enum {
+    DISPATCH_OTHER, DISPATCH_HANDLER, DISPATCH_STATIC, DISPATCH_CGI,
+    DISPATCH_LUA_SCRIPT, DISPATCH_LUA_PAGE, DISPATCH_SSI,
+
+    NUM_DISPATCH_CLASSES
+};
+
+static const char *dispatch_class_names[NUM_DISPATCH_CLASSES] = {
+    "other", "handler", "static", "cgi", "lua", "lsp", "ssi"
+};
+
+/* Index of the request headers, built by index_headers() once a request
+   has been parsed. Headers are found by their hash in an open addressing
+   table, well-known headers directly by their HTTP_HEADER_* number. */
+#define MAX_HEADERS 64                /* http_headers of mg_request_info */
+#define HEADER_INDEX_SIZE 128         /* Power of two, at least 2 * MAX_HEADERS */
+#define NUM_KNOWN_HEADERS (HTTP_HEADER_X_FORWARDED_FOR + 1)
+
+struct header_index {
+    int valid;                              /* Index matches request_info */
+    uint32_t hash[MAX_HEADERS];             /* header_hash() of every name */
+    unsigned char slot[HEADER_INDEX_SIZE];  /* Header number + 1, 0 if free */
+    signed char known[NUM_KNOWN_HEADERS];   /* Header number, -1 if absent */
+};
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+/* Idle keep-alive connection, waiting for the next request */
+struct parked_socket {
+    struct socket client;           /* Parked client socket */
+    struct socket_queue *queue;     /* Queue the connection came from */
+    int64_t parked_at;              /* When the connection went idle, usec */
+    struct parked_socket *prev;
+    struct parked_socket *next;
+};
+#endif
+
+/* Slot of a socket_queue. seq == pos means the slot is free for the
+   producer at position pos, seq == pos + 1 that it holds the socket for the
+   consumer at position pos. */
+struct sq_slot {
+    volatile unsigned seq;
+    struct socket so;
+};
+
+/* Bounded multi-producer/multi-consumer ring of accepted sockets, after
+   Dmitry Vyukov's design. Every acceptor thread has one, and its own
+   workers, see set_acceptors_option(). Producers and consumers claim a position with a
+   compare-and-swap on head or tail, and only take the mutex to sleep on a
+   full or empty queue, or to wake up a thread sleeping there. */
+struct socket_queue {
+    struct mg_context *ctx;
+    struct sq_slot *slots;
+    unsigned mask;                  /* Number of slots - 1 */
+    volatile unsigned head;         /* Next position to produce at */
+    volatile unsigned tail;         /* Next position to consume from */
+#if defined(NO_ATOMICS)
+    pthread_mutex_t ring_mutex;     /* Protects head, tail and the slots */
+#endif
+    pthread_mutex_t mutex;          /* Used with not_empty and not_full */
+    pthread_cond_t not_empty;       /* Signaled when a socket is produced */
+    pthread_cond_t not_full;        /* Signaled when a socket is consumed */
+    volatile int idle;              /* Consumers waiting for not_empty */
+    volatile int blocked;           /* Producers waiting for not_full */
+    volatile int max_depth;         /* Highest queue depth seen */
+    int64_t full_count;             /* Times a producer found it full */
+    int64_t wait_usec;              /* Time producers waited for a slot */
+};
+
+/* Additional listening thread, see set_acceptors_option() */
+struct mg_acceptor {
+    struct mg_context *ctx;
+    struct socket *listening_sockets; /* One per entry in listening_ports */
+    struct socket_queue *queue;     /* Where its connections go */
+    pthread_t thread_id;
+    int thread_started;
+};
+
+/* Alternative of a compiled pattern. Most patterns in practice are plain
+   prefixes like "/api", exact names like "/favicon.ico$" or extension
+   tests like "**.cgi$", which need no backtracking. */
+enum {PATTERN_GLOB, PATTERN_PREFIX, PATTERN_EXACT, PATTERN_SUFFIX};
+
+struct pattern_alt {
+    const char *str;                /* Literal text, or the glob for match_prefix() */
+    int len;
+    int kind;                       /* PATTERN_* */
+};
+
+/* Pattern split at '|' by compile_pattern(), see match_pattern(). It points
+   into the pattern string, which must outlive it. */
+struct pattern {
+    struct pattern_alt *alts;
+    int num_alts;
+};
+
+/* Entry of url_rewrite_patterns */
+struct rewrite_rule {
+    struct pattern uri;
+    const char *dir;                /* Points into config[REWRITE] */
+    int dir_len;
+};
+
+/* Entry of access_control_list, see set_acl_option() */
+struct acl_rule {
+    uint32_t net;
+    uint32_t mask;
+    int allow;
+};
+
+/* Token bucket of a throttled connection, or of a ":shared" throttle rule,
+   see take_tokens() */
+struct token_bucket {
+    int64_t rate;                   /* Bytes per second */
+    int64_t burst;                  /* Most bytes sent at once */
+    int64_t tokens;                 /* In millionths of a byte */
+    int64_t updated;                /* Last refill, see get_monotonic_usec() */
+    int shared;                     /* 1 if mutex must be held */
+    pthread_mutex_t mutex;
+};
+
+/* Entry of throttle, see set_throttle_option() */
+struct throttle_rule {
+    struct pattern uri;             /* Without alternatives, matches IPs */
+    uint32_t net;                   /* in net/mask; "*" has a zero mask */
+    uint32_t mask;
+    int rate;                       /* Bytes per second */
+    struct token_bucket *bucket;    /* Shared by all matches, or NULL */
+};
+
+enum {
+    ACCESS_LOG_COMBINED, ACCESS_LOG_JSON, ACCESS_LOG_BINARY
+};
+
+/* Fields of the json and binary access log formats, see access_log_fields */
+enum {
+    LOG_REMOTE_ADDR, LOG_REMOTE_PORT, LOG_REMOTE_USER, LOG_TIME, LOG_METHOD,
+    LOG_URI, LOG_QUERY, LOG_HTTP_VERSION, LOG_HOST, LOG_STATUS,
+    LOG_BYTES_SENT, LOG_BYTES_RECEIVED, LOG_REFERER, LOG_USER_AGENT,
+    LOG_QUEUE_USEC, LOG_READ_USEC, LOG_HANDLE_USEC, LOG_TOTAL_USEC,
+    LOG_HANDLER, LOG_HANDLER_URI, LOG_SSL, LOG_SSL_PROTOCOL, LOG_SSL_CIPHER,
+
+    NUM_LOG_FIELDS
+};
+
+static const struct {
+    const char *name;
+    int is_number;
+} log_fields[NUM_LOG_FIELDS] = {
+    {"remote_addr", 0}, {"remote_port", 1}, {"remote_user", 0}, {"time", 1},
+    {"method", 0}, {"uri", 0}, {"query", 0}, {"http_version", 0},
+    {"host", 0}, {"status", 1}, {"bytes_sent", 1}, {"bytes_received", 1},
+    {"referer", 0}, {"user_agent", 0}, {"queue_usec", 1}, {"read_usec", 1},
+    {"handle_usec", 1}, {"total_usec", 1}, {"handler", 0},
+    {"handler_uri", 0}, {"ssl", 1}, {"ssl_protocol", 0}, {"ssl_cipher", 0}
+};
+
+/* Options used on every request or connection, converted once by mg_start()
+   and never changed afterwards */
+struct parsed_config {
+    int keep_alive;                 /* enable_keep_alive */
+    int decode_url;                 /* decode_url */
+    int directory_listing;          /* enable_directory_listing */
+    int access_log_timings;         /* access_log_timings */
+    int access_log_format;          /* ACCESS_LOG_* */
+    unsigned char access_log_fields[NUM_LOG_FIELDS]; /* LOG_*, in order */
+    int num_access_log_fields;
+    int request_timeout;            /* request_timeout_ms */
+    struct pattern cgi_pattern;     /* The *_pattern options */
+    struct pattern ssi_pattern;
+    struct pattern lua_script_pattern;
+    struct pattern lua_page_pattern;
+    struct pattern lua_websocket_pattern;
+    struct pattern hide_files;      /* hide_files_patterns */
+    struct pattern passwords_file;  /* Always hidden */
+    struct pattern compression_mime_types;
+    struct rewrite_rule *rewrite;
+    int num_rewrite_rules;
+    int acl_default_allow;          /* Without a matching ACL rule */
+    struct acl_rule *acl;
+    int num_acl_rules;
+    struct throttle_rule *throttle;
+    int num_throttle_rules;
+};
+
 struct mg_request_handler_info {
     char *uri;
     size_t uri_len;
+    struct pattern pattern;         /* uri, compiled */
     mg_request_handler handler;
     void *cbdata;
+    struct latency_histogram latency;
+    struct latency_histogram latency_base[NUM_LATENCY_READERS];
     struct mg_request_handler_info *next;
 };
 
+/* Node of the request handler trie, keyed on the path segments of the
+   handler URIs */
+struct route_node {
+    const char *segment;            /* Points into a handler URI */
+    size_t segment_len;
+    struct mg_request_handler_info *handler; /* For this path and below */
+    struct mg_request_handler_info **globs;  /* Pattern URIs starting here */
+    int num_globs;
+    struct route_node **children;   /* Sorted by segment */
+    int num_children;
+};
+
+/* Snapshot of the request handlers. Workers read it without locking, so it
+   is never changed once published: mg_set_request_handler() builds a new
+   one and retires the old one until no worker uses it any more. */
+struct route_table {
+    struct route_node root;
+    struct mg_request_handler_info *removed; /* Freed along with the table */
+    struct route_table *next_retired;
+};
+
+#define MAX_ROUTE_DEPTH 64
+
+#if defined(USE_FILE_CACHE)
+#define FILE_CACHE_SHARDS 16
+#define STATIC_CACHE_MAX_FILE_SIZE (1024 * 1024)
+
+/* Result of stat() for a path, plus an open descriptor once the file has
+   been served, see file_cache_stat() and file_cache_open() */
+struct file_cache_entry {
+    char *path;
+    uint32_t hash;
+    int exists;
+    int is_directory;
+    time_t modification_time;
+    int64_t size;
+    int fd;                         /* -1 until served */
+    struct vec mime;                /* Content type by extension */
+    int64_t expires;                /* get_monotonic_usec() time */
+    int refs;                       /* Requests using fd, plus 1 while cached */
+    int hits;                       /* Times opened */
+    int loading;                    /* Body is being read */
+    int unlinked;                   /* No longer in the cache */
+    char *body;                     /* Content, see static_cache_size */
+    int64_t body_len;
+    char *headers;                  /* Content-Type, Etag, Last-Modified */
+    int headers_len;
+    char last_modified[32];         /* modification_time, formatted */
+    struct file_cache_entry *hash_next;
+    struct file_cache_entry *lru_prev; /* More recently used */
+    struct file_cache_entry *lru_next;
+    struct file_cache_shard *shard; /* Protects refs and the lists */
+};
+
+struct file_cache_shard {
+    pthread_mutex_t mutex;
+    struct file_cache_entry **buckets;
+    int num_entries;
+    unsigned long generation;       /* Incremented by every invalidation */
+    int64_t body_bytes;             /* Sum of body_len */
+    struct file_cache_entry *lru_head;
+    struct file_cache_entry *lru_tail;
+};
+
+/* Directory watched for changes of cached entries */
+struct file_cache_watch {
+    int wd;
+    char *dir;
+};
+
+struct file_cache {
+    struct file_cache_shard shards[FILE_CACHE_SHARDS];
+    int num_buckets;                /* Per shard */
+    int max_entries;                /* Per shard */
+    int64_t ttl;                    /* usec until an entry is checked again */
+    int64_t max_body_bytes;         /* Per shard, 0 if bodies are not kept */
+    int64_t max_body_len;
+#if defined(USE_INOTIFY)
+    int inotify_fd;
+    pthread_mutex_t watch_mutex;    /* Protects watches */
+    struct file_cache_watch *watches;
+    int num_watches;
+    int max_watches;
+#endif
+};
+
+static void file_cache_release(struct file_cache_entry *e);
+#endif
+
+#if defined(USE_ZLIB)
+#define COMPRESSION_MIN_FILE_SIZE 256
+#define COMPRESSION_MAX_FILE_SIZE (1024 * 1024)
+
+enum {ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_DEFLATE};
+
+/* A file compressed on the fly, see get_compressed_file() */
+struct compressed_file {
+    char *path;
+    uint32_t hash;
+    time_t modification_time;       /* Of the uncompressed file */
+    int64_t size;
+    int encoding;
+    char *data;                     /* NULL if compression does not pay off */
+    size_t len;
+    int refs;                       /* Requests sending data, plus 1 while
+                                       cached */
+    struct compressed_file *hash_next;
+    struct compressed_file *lru_prev;
+    struct compressed_file *lru_next;
+};
+
+struct compression_cache {
+    pthread_mutex_t mutex;
+    struct compressed_file **buckets;
+    int num_buckets;
+    struct compressed_file *lru_head;
+    struct compressed_file *lru_tail;
+    int64_t bytes;                  /* Sum of len */
+    int64_t max_bytes;
+};
+#endif
+
+/* Lines for a log file, written in batches by a thread of their own, see
+   log_buffer_size. The thread writes one buffer while connections fill the
+   other. */
+struct log_writer {
+    const char *path;
+    FILE *fp;                       /* Only used by the thread */
+    char *buf;                      /* Lines not written yet */
+    size_t len;
+    size_t size;
+    char *spare;                    /* Being written by the thread */
+    int drop;                       /* Drop lines when buf is full */
+    int reopen;                     /* Set by mg_reopen_logs() */
+    int stop;
+    int64_t dropped;                /* Lines dropped */
+    pthread_mutex_t mutex;          /* Protects all of the above but fp */
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t thread;
+};
+
+/* The current second, formatted once for all responses and log lines. See
+   read_clock() for why readers need no lock. */
+#define CLOCK_SLOTS 4
+
+struct clock_slot {
+    volatile time_t time;           /* 0 while being written */
+    char date[32];                  /* For the Date header, GMT */
+    char log_date[32];              /* For the access log, local time */
+};
+
+struct mg_clock {
+    struct clock_slot slots[CLOCK_SLOTS];
+    volatile unsigned int current;  /* Slot most recently written */
+    pthread_mutex_t mutex;          /* Serializes writers */
+};
+
 struct mg_context {
     volatile int stop_flag;         /* Should we stop event loop */
     void *ssllib_dll_handle;        /* Store the ssl library handle. */
     void *cryptolib_dll_handle;     /* Store the crypto library handle. */
     SSL_CTX *ssl_ctx;               /* SSL context */
     char *config[NUM_OPTIONS];      /* Civetweb configuration parameters */
+    struct parsed_config cfg;       /* Parsed copies of some of config[] */
+#if defined(USE_FILE_CACHE)
+    struct file_cache *file_cache;  /* NULL unless file_cache_size is set */
+#endif
+#if defined(USE_ZLIB)
+    struct compression_cache *compression_cache; /* NULL unless
+                                       compression_cache_size is set */
+#endif
     struct mg_callbacks callbacks;  /* User-defined callback function */
     void *user_data;                /* User-defined data */
 
     struct socket *listening_sockets;
     in_port_t *listening_ports;
     int num_listening_sockets;
+    struct mg_acceptor *acceptors;  /* Acceptor threads besides the master */
+    int num_acceptors;
 
     volatile int num_threads;       /* Number of threads */
+    int min_threads;                /* Workers started by mg_start() */
+    int max_threads;                /* Limit for additional workers */
+    int thread_idle_timeout;        /* ms until an additional worker exits */
     pthread_mutex_t thread_mutex;   /* Protects (max|num)_threads */
     pthread_cond_t thread_cond;     /* Condvar for tracking workers terminations */
 
-    struct socket queue[MGSQLEN];   /* Accepted sockets */
-    volatile int sq_head;           /* Head of the socket queue */
-    volatile int sq_tail;           /* Tail of the socket queue */
-    pthread_cond_t sq_full;         /* Signaled when socket is produced */
-    pthread_cond_t sq_empty;        /* Signaled when socket is consumed */
+    struct socket_queue **queues;   /* Master's, then one per acceptor */
+    int num_queues;
+    int sq_watermark;               /* Queue depth to reject connections at */
+    int64_t sq_shed_count;          /* Connections rejected with 503 */
+    struct mg_connection *workers;  /* Connections of running workers */
+    int64_t stats[NUM_STATS];       /* Counters of exited workers */
+    pthread_mutex_t latency_mutex;  /* Protects the handler latency histograms */
+    pthread_mutex_t throttle_mutex; /* Used with throttle_cond */
+    pthread_cond_t throttle_cond;   /* Signaled on stop, see throttle_wait() */
+    /* Latency of exited workers, and the readers' copies of the totals,
+       under thread_mutex */
+    struct latency_histogram dispatch_latency[NUM_DISPATCH_CLASSES];
+    struct latency_histogram status_latency[6];
+    struct latency_histogram
+        dispatch_base[NUM_LATENCY_READERS][NUM_DISPATCH_CLASSES];
+    struct latency_histogram status_base[NUM_LATENCY_READERS][6];
     pthread_t masterthreadid;       /* The master thread ID */
     int workerthreadcount;          /* The amount of worker threads. */
     pthread_t *workerthreadids;     /* The worker thread IDs */
@@ -805,8 +1304,18 @@ struct mg_context {
 
     char *systemName;               /* What operating system is running */
 
-    /* linked list of uri handlers */
+#if defined(USE_KEEP_ALIVE_PARKING)
+    int park_fd;                    /* epoll descriptor for idle connections */
+    pthread_mutex_t park_mutex;     /* Protects park_fd and the parked list */
+    struct parked_socket *parked_head; /* Connection idle for the longest time */
+    struct parked_socket *parked_tail; /* Most recently parked connection */
+#endif
+
+    /* linked list of uri handlers, in registration order */
     struct mg_request_handler_info *request_handlers;
+    struct route_table *volatile routes; /* Handlers as seen by workers */
+    struct route_table *retired_routes;  /* Replaced, maybe still in use */
+    pthread_mutex_t handlers_mutex; /* Serializes mg_set_request_handler() */
 
 #if defined(USE_LUA) && defined(USE_WEBSOCKET)
     /* linked list of shared lua websockets */
@@ -816,6 +1325,11 @@ struct mg_context {
 #ifdef USE_TIMERS
     struct timers * timers;
 #endif
+
+    struct mg_clock clock;          /* Refreshed by the master thread */
+
+    struct log_writer *access_log;  /* NULL if written synchronously */
+    struct log_writer *error_log;
 };
 
 struct mg_connection {
@@ -837,13 +1351,27 @@ struct mg_connection {
     int data_len;                   /* Total size of data in a buffer */
     int status_code;                /* HTTP reply status code, e.g. 200 */
     int throttle;                   /* Throttling, bytes/sec. <= 0 means no throttle */
-    time_t last_throttle_time;      /* Last time throttled data was sent */
-    int64_t last_throttle_bytes;    /* Bytes sent this second */
+    struct token_bucket *bucket;    /* own_bucket or a shared one if throttled */
+    struct token_bucket own_bucket;
     pthread_mutex_t mutex;          /* Used by mg_lock_connection/mg_unlock_connection to ensure atomic transmissions for websockets */
+    int64_t websocket_frames_out;   /* Sent by any thread, under mutex */
 #if defined(USE_LUA) && defined(USE_WEBSOCKET)
     void * lua_websocket_state;     /* Lua_State for a websocket connection */
 #endif
     int is_chunked;                 /* transfer-encoding is chunked */
+    struct mg_request_timings timings; /* Phase timestamps of this request */
+    int64_t stats[NUM_STATS];       /* Counters of the worker thread */
+    struct socket_queue *queue;     /* Where the worker takes sockets from */
+    struct latency_histogram dispatch_latency[NUM_DISPATCH_CLASSES];
+    struct latency_histogram status_latency[6];
+    struct mg_connection *next_worker; /* Next in ctx->workers */
+    int dispatch;                   /* DISPATCH_* class of the request */
+    struct mg_request_handler_info *request_handler; /* Handler called */
+    struct route_table *routes;     /* Handlers in use, see use_request_handler() */
+    struct header_index header_index; /* Index of request_info.http_headers */
+    int buffer_output;              /* mg_write() collects into out_buf */
+    int out_len;                    /* Bytes in out_buf */
+    char out_buf[MG_BUF_LEN];       /* Response not sent yet */
 };
 
 static pthread_key_t sTlsKey;  /* Thread local storage index */
@@ -928,6 +1456,12 @@ static void mg_fclose(struct file *filep)
     if (filep != NULL && filep->fp != NULL) {
         fclose(filep->fp);
     }
+#if defined(USE_FILE_CACHE)
+    if (filep != NULL && filep->cached != NULL) {
+        file_cache_release(filep->cached);
+        filep->cached = NULL;
+    }
+#endif
 }
 
 static void mg_strlcpy(register char *dst, register const char *src, size_t n)
@@ -943,13 +1477,17 @@ static int lowercase(const char *s)
     return tolower(* (const unsigned char *) s);
 }
 
+/* The case insensitive comparisons only lowercase characters that
+   differ, most header names are spelled the same on both sides */
 int mg_strncasecmp(const char *s1, const char *s2, size_t len)
 {
     int diff = 0;
 
     if (len > 0)
         do {
-            diff = lowercase(s1++) - lowercase(s2++);
+            diff = *s1 == *s2 ? 0 : lowercase(s1) - lowercase(s2);
+            s1++;
+            s2++;
         } while (diff == 0 && s1[-1] != '\0' && --len > 0);
 
     return diff;
@@ -960,7 +1498,9 @@ static int mg_strcasecmp(const char *s1, const char *s2)
     int diff;
 
     do {
-        diff = lowercase(s1++) - lowercase(s2++);
+        diff = *s1 == *s2 ? 0 : lowercase(s1) - lowercase(s2);
+        s1++;
+        s2++;
     } while (diff == 0 && s1[-1] != '\0');
 
     return diff;
@@ -1090,6 +1630,15 @@ static void sockaddr_to_string(char *buf, size_t len,
 #endif
 }
 
+/* Monotonic clock in microseconds, for measuring intervals */
+static int64_t get_monotonic_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /* Convert time_t to a string. According to RFC2616, Sec 14.18, this must be included in all responses other than 100, 101, 5xx. */
 static void gmt_time_string(char *buf, size_t buf_len, time_t *t)
 {
@@ -1104,13 +1653,134 @@ static void gmt_time_string(char *buf, size_t buf_len, time_t *t)
     }
 }
 
+/* Convert time_t to local time in Common Log Format */
+static void log_time_string(char *buf, size_t buf_len, time_t *t)
+{
+    struct tm *tm;
+
+    tm = localtime(t);
+    if (tm != NULL) {
+        strftime(buf, buf_len, "%d/%b/%Y:%H:%M:%S %z", tm);
+    } else {
+        mg_strlcpy(buf, "01/Jan/1970:00:00:00 +0000", buf_len);
+        buf[buf_len - 1] = '\0';
+    }
+}
+
+/* Format t into the slot after the current one and publish it, unless
+   another thread is doing so already */
+static void refresh_clock(struct mg_context *ctx, time_t t)
+{
+#if !defined(NO_CLOCK)
+    struct mg_clock *clock = &ctx->clock;
+    struct clock_slot *slot;
+
+    if (pthread_mutex_trylock(&clock->mutex) != 0) {
+        return;
+    }
+    if (clock->slots[clock->current % CLOCK_SLOTS].time != t) {
+        slot = &clock->slots[(clock->current + 1) % CLOCK_SLOTS];
+        slot->time = 0;
+        mg_memory_barrier();
+        gmt_time_string(slot->date, sizeof(slot->date), &t);
+        log_time_string(slot->log_date, sizeof(slot->log_date), &t);
+        mg_memory_barrier();
+        slot->time = t;
+        mg_memory_barrier();
+        clock->current++;
+    }
+    (void) pthread_mutex_unlock(&clock->mutex);
+#else
+    (void) ctx;
+    (void) t;
+#endif
+}
+
+/* Copy the date or log date for t from the current slot. A slot is only
+   rewritten CLOCK_SLOTS - 1 seconds after it stopped being current, and
+   its time is zero meanwhile, so checking the time before and after the
+   copy catches the rare reader that took that long. Return 0 if t is not
+   the current second. */
+static int read_clock(struct mg_context *ctx, time_t t, int log,
+                      char *buf, size_t buf_len)
+{
+#if !defined(NO_CLOCK)
+    const struct clock_slot *slot =
+        &ctx->clock.slots[ctx->clock.current % CLOCK_SLOTS];
+
+    mg_memory_barrier();
+    if (t == 0 || slot->time != t) {
+        return 0;
+    }
+    mg_strlcpy(buf, log ? slot->log_date : slot->date, buf_len);
+    mg_memory_barrier();
+    return slot->time == t;
+#else
+    (void) ctx;
+    (void) t;
+    (void) log;
+    (void) buf;
+    (void) buf_len;
+    return 0;
+#endif
+}
+
+/* The Date header value for now. Only the first response in a second
+   formats it, if the master thread has not done so already. */
+static void current_date_string(struct mg_context *ctx, char *buf,
+                                size_t buf_len)
+{
+    time_t now = time(NULL);
+
+    if (!read_clock(ctx, now, 0, buf, buf_len)) {
+        refresh_clock(ctx, now);
+        if (!read_clock(ctx, now, 0, buf, buf_len)) {
+            gmt_time_string(buf, buf_len, &now);
+        }
+    }
+}
+
+/* Like current_date_string(), for the access log and the time a request
+   was received, which is usually the current second too */
+static void log_date_string(struct mg_context *ctx, char *buf, size_t buf_len,
+                            time_t t)
+{
+    if (!read_clock(ctx, t, 1, buf, buf_len)) {
+        if (t == time(NULL)) {
+            refresh_clock(ctx, t);
+        }
+        if (!read_clock(ctx, t, 1, buf, buf_len)) {
+            log_time_string(buf, buf_len, &t);
+        }
+    }
+}
+
+/* The Last-Modified header value for a file. A file served through the
+   file cache has it formatted already, and it does not change while the
+   descriptor is open. */
+static void last_modified_string(char *buf, size_t buf_len,
+                                 struct file *filep)
+{
+#if defined(USE_FILE_CACHE)
+    if (filep->cached != NULL &&
+        filep->cached->modification_time == filep->modification_time) {
+        mg_strlcpy(buf, filep->cached->last_modified, buf_len);
+        return;
+    }
+#endif
+    gmt_time_string(buf, buf_len, &filep->modification_time);
+}
+
+static void log_write(struct log_writer *w, const char *record, size_t len);
+
 /* Print error message to the opened error log stream. */
 void mg_cry(struct mg_connection *conn, const char *fmt, ...)
 {
-    char buf[MG_BUF_LEN], src_addr[IP_ADDR_STR_LEN];
+    char buf[MG_BUF_LEN], src_addr[IP_ADDR_STR_LEN], line[MG_BUF_LEN + 256];
     va_list ap;
     FILE *fp;
     time_t timestamp;
+    int len;
 
     va_start(ap, fmt);
     IGNORE_UNUSED_RESULT(vsnprintf(buf, sizeof(buf), fmt, ap));
@@ -1121,6 +1791,29 @@ void mg_cry(struct mg_connection *conn, const char *fmt, ...)
        same way string option can. */
     if (conn->ctx->callbacks.log_message == NULL ||
         conn->ctx->callbacks.log_message(conn, buf) == 0) {
+        if (conn->ctx->error_log != NULL) {
+            sockaddr_to_string(src_addr, sizeof(src_addr), &conn->client.rsa);
+            if (conn->request_info.request_method != NULL) {
+                len = snprintf(line, sizeof(line),
+                               "[%010lu] [error] [client %s] %s %s: %s\n",
+                               (unsigned long) time(NULL), src_addr,
+                               conn->request_info.request_method,
+                               conn->request_info.uri, buf);
+            } else {
+                len = snprintf(line, sizeof(line),
+                               "[%010lu] [error] [client %s] %s\n",
+                               (unsigned long) time(NULL), src_addr, buf);
+            }
+            if (len >= (int) sizeof(line)) {
+                len = (int) sizeof(line) - 1;
+                line[len - 1] = '\n';
+            }
+            if (len > 0) {
+                log_write(conn->ctx->error_log, line, (size_t) len);
+            }
+            return;
+        }
+
         fp = conn->ctx->config[ERROR_LOG_FILE] == NULL ? NULL :
              fopen(conn->ctx->config[ERROR_LOG_FILE], "a+");
 
@@ -1169,6 +1862,12 @@ struct mg_request_info *mg_get_request_info(struct mg_connection *conn)
     return &conn->request_info;
 }
 
+const struct mg_request_timings *mg_get_request_timings(
+    const struct mg_connection *conn)
+{
+    return &conn->timings;
+}
+
 /* Skip the characters until one of the delimiters characters found.
    0-terminate resulting word. Skip the delimiter and following whitespaces.
    Advance pointer to buffer to the next word. Return found 0-terminated word.
@@ -1237,9 +1936,129 @@ static const char *get_header(const struct mg_request_info *ri,
     return NULL;
 }
 
+/* Case insensitive FNV-1a hash of a header name */
+static uint32_t header_hash(const char *name)
+{
+    uint32_t hash = 2166136261U;
+    int c;
+
+    for (; *name != '\0'; name++) {
+        c = * (const unsigned char *) name;
+        hash = (hash ^ (uint32_t) (c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c)) *
+               16777619U;
+    }
+    return hash;
+}
+
+/* Names of the HTTP_HEADER_* constants, with their header_hash() */
+static const struct {
+    const char *name;
+    uint32_t hash;
+} known_headers[NUM_KNOWN_HEADERS] = {
+    {"Host", 0xaffea56fU},
+    {"Connection", 0x38b99ed9U},
+    {"Content-Length", 0x4df9451dU},
+    {"Content-Type", 0xfcf70995U},
+    {"Content-Range", 0xd3ecfa4aU},
+    {"Transfer-Encoding", 0xddb4744cU},
+    {"Expect", 0x96da6b58U},
+    {"Range", 0xfadc0cd2U},
+    {"If-Range", 0x8b887e3eU},
+    {"If-Modified-Since", 0x83e879a9U},
+    {"If-None-Match", 0x972b6177U},
+    {"Accept", 0x08247e29U},
+    {"Accept-Encoding", 0xc9715a99U},
+    {"Authorization", 0x913657beU},
+    {"Cookie", 0x77a740bfU},
+    {"Origin", 0xd97f9a4fU},
+    {"Referer", 0xec9af966U},
+    {"User-Agent", 0x24259beeU},
+    {"Upgrade", 0xdc97cc77U},
+    {"Sec-WebSocket-Key", 0xcab5ec26U},
+    {"Sec-WebSocket-Version", 0x050a86e1U},
+    {"Depth", 0xfe759eeaU},
+    {"X-Forwarded-For", 0xadb2f988U}
+};
+
+/* Perfect hash of the known header hashes: KNOWN_HEADER_SLOT() is different
+   for all of them, known_header_slots maps it to the HTTP_HEADER_* number.
+   When adding a header, find a shift that keeps the slots distinct. */
+#define KNOWN_HEADER_SLOT(hash) (((hash) ^ ((hash) >> 23)) & 63)
+
+static const signed char known_header_slots[64] = {
+    -1, -1, -1, -1, -1, -1,  2, -1, -1, -1, -1, 12, -1, -1, 18, -1,
+    14, -1, -1, 22, -1, -1, 21, -1, -1, 10, -1, -1, 13, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, 17,  7,  1,  8, -1, 20,  3,  4,  9, -1,
+     0, -1, -1, 19, -1,  6, -1,  5, -1, 11, -1, -1, -1, 15, -1, 16
+};
+
+static void index_headers(struct mg_connection *conn)
+{
+    const struct mg_request_info *ri = &conn->request_info;
+    struct header_index *hi = &conn->header_index;
+    uint32_t hash;
+    int i, j, s, id;
+
+    memset(hi->slot, 0, sizeof(hi->slot));
+    memset(hi->known, -1, sizeof(hi->known));
+    for (i = 0; i < ri->num_headers; i++) {
+        hash = hi->hash[i] = header_hash(ri->http_headers[i].name);
+        for (s = hash & (HEADER_INDEX_SIZE - 1); hi->slot[s] != 0;
+             s = (s + 1) & (HEADER_INDEX_SIZE - 1)) {
+            j = hi->slot[s] - 1;
+            if (hi->hash[j] == hash &&
+                !mg_strcasecmp(ri->http_headers[j].name,
+                               ri->http_headers[i].name)) {
+                break;  /* Repeated header, the first one is used */
+            }
+        }
+        if (hi->slot[s] == 0) {
+            hi->slot[s] = (unsigned char) (i + 1);
+            id = known_header_slots[KNOWN_HEADER_SLOT(hash)];
+            if (id >= 0 && known_headers[id].hash == hash &&
+                !mg_strcasecmp(known_headers[id].name,
+                               ri->http_headers[i].name)) {
+                hi->known[id] = (signed char) i;
+            }
+        }
+    }
+    hi->valid = 1;
+}
+
 const char *mg_get_header(const struct mg_connection *conn, const char *name)
 {
-    return get_header(&conn->request_info, name);
+    const struct mg_request_info *ri = &conn->request_info;
+    const struct header_index *hi = &conn->header_index;
+    uint32_t hash;
+    int s, i;
+
+    if (!hi->valid) {
+        return get_header(ri, name);
+    }
+
+    hash = header_hash(name);
+    for (s = hash & (HEADER_INDEX_SIZE - 1); hi->slot[s] != 0;
+         s = (s + 1) & (HEADER_INDEX_SIZE - 1)) {
+        i = hi->slot[s] - 1;
+        if (hi->hash[i] == hash &&
+            !mg_strcasecmp(ri->http_headers[i].name, name)) {
+            return ri->http_headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+const char *mg_get_header_id(const struct mg_connection *conn, int header_id)
+{
+    const struct header_index *hi = &conn->header_index;
+
+    if (header_id < 0 || header_id >= NUM_KNOWN_HEADERS) {
+        return NULL;
+    } else if (!hi->valid) {
+        return get_header(&conn->request_info, known_headers[header_id].name);
+    }
+    return hi->known[header_id] < 0 ? NULL :
+           conn->request_info.http_headers[(int) hi->known[header_id]].value;
 }
 
 /* A helper function for traversing a comma separated list of values.
@@ -1322,16 +2141,112 @@ static int match_prefix(const char *pattern, int pattern_len, const char *str)
     return j;
 }
 
+static int is_literal_pattern(const char *s, int len)
+{
+    return len <= 0 || (memchr(s, '*', len) == NULL &&
+                        memchr(s, '?', len) == NULL &&
+                        memchr(s, '$', len) == NULL);
+}
+
+/* Split pattern at '|' and classify the alternatives, so that match_pattern()
+   need not interpret them on every call. NULL compiles to a pattern that
+   never matches. Return 0 if out of memory. */
+static int compile_pattern(struct pattern *p, const char *pattern,
+                           int pattern_len)
+{
+    struct pattern_alt *alt;
+    const char *s, *e, *end = pattern + pattern_len;
+    int n = 1;
+
+    p->alts = NULL;
+    p->num_alts = 0;
+    if (pattern == NULL) {
+        return 1;
+    }
+    for (s = pattern; (s = (const char *) memchr(s, '|', end - s)) != NULL; s++) {
+        n++;
+    }
+    if ((p->alts = (struct pattern_alt *) mg_malloc(n * sizeof(*alt))) == NULL) {
+        return 0;
+    }
+
+    for (s = pattern; p->num_alts < n; s = e + 1) {
+        if ((e = (const char *) memchr(s, '|', end - s)) == NULL) {
+            e = end;
+        }
+        alt = &p->alts[p->num_alts++];
+        alt->str = s;
+        alt->len = (int) (e - s);
+        alt->kind = PATTERN_GLOB;
+        if (alt->len >= 3 && s[0] == '*' && s[1] == '*' && e[-1] == '$' &&
+            is_literal_pattern(s + 2, alt->len - 3)) {
+            alt->kind = PATTERN_SUFFIX;
+            alt->str += 2;
+            alt->len -= 3;
+        } else if (alt->len >= 1 && e[-1] == '$' &&
+                   is_literal_pattern(s, alt->len - 1)) {
+            alt->kind = PATTERN_EXACT;
+            alt->len--;
+        } else if (is_literal_pattern(s, alt->len)) {
+            alt->kind = PATTERN_PREFIX;
+        }
+    }
+
+    return 1;
+}
+
+static void free_pattern(struct pattern *p)
+{
+    mg_free(p->alts);
+    p->alts = NULL;
+    p->num_alts = 0;
+}
+
+/* Same result as match_prefix() on the source of the compiled pattern */
+static int match_pattern(const struct pattern *p, const char *str)
+{
+    const struct pattern_alt *alt = p->alts, *end = alt + p->num_alts;
+    int res = -1, str_len = -1;
+
+    for (; alt < end; alt++) {
+        switch (alt->kind) {
+        case PATTERN_SUFFIX:
+            if (str_len < 0) {
+                str_len = (int) strlen(str);
+            }
+            res = str_len >= alt->len &&
+                  !mg_strncasecmp(str + str_len - alt->len, alt->str, alt->len) ?
+                  str_len : -1;
+            break;
+        case PATTERN_EXACT:
+            res = !mg_strncasecmp(str, alt->str, alt->len) &&
+                  str[alt->len] == '\0' ? alt->len : -1;
+            break;
+        case PATTERN_PREFIX:
+            res = !mg_strncasecmp(str, alt->str, alt->len) ? alt->len : -1;
+            break;
+        default:
+            res = match_prefix(alt->str, alt->len, str);
+            break;
+        }
+        if (res > 0) {
+            break;
+        }
+    }
+
+    return res;
+}
+
 /* HTTP 1.1 assumes keep alive if "Connection:" header is not set
    This function must tolerate situations when connection info is not
    set up, for example if request parsing failed. */
 static int should_keep_alive(const struct mg_connection *conn)
 {
     const char *http_version = conn->request_info.http_version;
-    const char *header = mg_get_header(conn, "Connection");
+    const char *header = mg_get_header_id(conn, HTTP_HEADER_CONNECTION);
     if (conn->must_close ||
         conn->status_code == 401 ||
-        mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") != 0 ||
+        !conn->ctx->cfg.keep_alive ||
         (header != NULL && mg_strcasecmp(header, "keep-alive") != 0) ||
         (header == NULL && http_version && 0!=strcmp(http_version, "1.1"))) {
         return 0;
@@ -1341,7 +2256,7 @@ static int should_keep_alive(const struct mg_connection *conn)
 
 static int should_decode_url(const struct mg_connection *conn)
 {
-    return (mg_strcasecmp(conn->ctx->config[DECODE_URL], "yes") == 0);
+    return conn->ctx->cfg.decode_url;
 }
 
 static const char *suggest_connection_header(const struct mg_connection *conn)
@@ -1350,12 +2265,25 @@ static const char *suggest_connection_header(const struct mg_connection *conn)
 }
 
 static void handle_file_based_request(struct mg_connection *conn, const char *path, struct file *filep);
+static int get_method_id(const char *method);
 static int mg_stat(struct mg_connection *conn, const char *path, struct file *filep);
+static int flush_output(struct mg_connection *conn);
+static void end_output_buffering(struct mg_connection *conn);
 
 static void send_http_error(struct mg_connection *, int, const char *,
                             PRINTF_FORMAT_STRING(const char *fmt), ...)
 PRINTF_ARGS(4, 5);
 
+/* The error callback is user code, so it writes unbuffered */
+static int call_http_error(struct mg_connection *conn, int status)
+{
+    int buffer_output = conn->buffer_output, not_handled;
+
+    end_output_buffering(conn);
+    not_handled = conn->ctx->callbacks.http_error(conn, status);
+    conn->buffer_output = buffer_output;
+    return not_handled;
+}
 
 static void send_http_error(struct mg_connection *conn, int status,
                             const char *reason, const char *fmt, ...)
@@ -1364,7 +2292,6 @@ static void send_http_error(struct mg_connection *conn, int status,
     va_list ap;
     int len = 0, i, page_handler_found, scope;
     char date[64];
-    time_t curtime = time(NULL);
     const char *error_handler = NULL;
     struct file error_page_file = STRUCT_FILE_INITIALIZER;
     const char *error_page_file_ext, *tstr;
@@ -1372,7 +2299,7 @@ static void send_http_error(struct mg_connection *conn, int status,
     conn->status_code = status;
     if (conn->in_error_handler ||
         conn->ctx->callbacks.http_error == NULL ||
-        conn->ctx->callbacks.http_error(conn, status)) {
+        call_http_error(conn, status)) {
 
         if (!conn->in_error_handler) {
             /* Send user defined error pages, if defined */
@@ -1414,7 +2341,7 @@ static void send_http_error(struct mg_connection *conn, int status,
         }
 
         buf[0] = '\0';
-        gmt_time_string(date, sizeof(date), &curtime);
+        current_date_string(conn->ctx, date, sizeof(date));
 
         /* Errors 1xx, 204 and 304 MUST NOT send a body */
         if (status > 199 && status != 204 && status != 304) {
@@ -1523,7 +2450,7 @@ static int pthread_cond_init(pthread_cond_t *cv, const void *unused)
 static int pthread_cond_timedwait(pthread_cond_t *cv, pthread_mutex_t *mutex, const struct timespec * abstime)
 {
     struct mg_workerTLS * tls = (struct mg_workerTLS *)TlsGetValue(sTlsKey);
-    int ok;
+    int ok, i, found = 0;
     struct timespec tsnow;
     int64_t nsnow, nswaitabs, nswaitrel;
     DWORD mswaitrel;
@@ -1536,8 +2463,8 @@ static int pthread_cond_timedwait(pthread_cond_t *cv, pthread_mutex_t *mutex, co
 
     if (abstime) {
         clock_gettime(CLOCK_REALTIME, &tsnow);
-        nsnow = (((uint64_t)tsnow.tv_sec)<<32) + tsnow.tv_nsec;
-        nswaitabs = (((uint64_t)abstime->tv_sec)<<32) + abstime->tv_nsec;
+        nsnow = ((int64_t)tsnow.tv_sec) * 1000000000 + tsnow.tv_nsec;
+        nswaitabs = ((int64_t)abstime->tv_sec) * 1000000000 + abstime->tv_nsec;
         nswaitrel = nswaitabs - nsnow;
         if (nswaitrel<0) nswaitrel=0;
         mswaitrel = (DWORD)(nswaitrel / 1000000);
@@ -1547,7 +2474,28 @@ static int pthread_cond_timedwait(pthread_cond_t *cv, pthread_mutex_t *mutex, co
 
     pthread_mutex_unlock(mutex);
     ok = (WAIT_OBJECT_0 == WaitForSingleObject(tls->pthread_cond_helper_mutex, mswaitrel));
-    pthread_mutex_lock(mutex);
+
+    if (!ok) {
+        /* Timed out: leave the list of waiting threads. If this thread is
+           not in the list any more, it has been signaled in the meantime. */
+        EnterCriticalSection(&cv->threadIdSec);
+        for (i = 0; !found && i < cv->waitingthreadcount; i++) {
+            if (cv->waitingthreadhdls[i] == tls->pthread_cond_helper_mutex) {
+                found = 1;
+            }
+        }
+        for (; found && i < cv->waitingthreadcount; i++) {
+            cv->waitingthreadhdls[i-1] = cv->waitingthreadhdls[i];
+        }
+        if (found) {
+            cv->waitingthreadcount--;
+        }
+        LeaveCriticalSection(&cv->threadIdSec);
+        if (!found) {
+            ok = (WAIT_OBJECT_0 == WaitForSingleObject(tls->pthread_cond_helper_mutex, INFINITE));
+        }
+    }
+    pthread_mutex_lock(mutex);
 
     return ok ? 0 : -1;
 }
@@ -2040,11 +2988,630 @@ static int set_non_blocking_mode(SOCKET sock)
 }
 
 #else
+#if defined(USE_FILE_CACHE)
+static void get_mime_type(struct mg_context *ctx, const char *path,
+                          struct vec *vec);
+static void set_close_on_exec(int fd, struct mg_connection *conn);
+static int set_non_blocking_mode(SOCKET sock);
+
+static struct file_cache_shard *get_file_cache_shard(struct file_cache *cache,
+                                                     uint32_t hash)
+{
+    return &cache->shards[hash % FILE_CACHE_SHARDS];
+}
+
+static struct file_cache_entry **get_file_cache_bucket(struct file_cache *cache,
+                                                       struct file_cache_shard *shard,
+                                                       uint32_t hash)
+{
+    return &shard->buckets[(hash / FILE_CACHE_SHARDS) % cache->num_buckets];
+}
+
+static void free_file_cache_entry(struct file_cache_entry *e)
+{
+    if (e->fd >= 0) {
+        (void) close(e->fd);
+    }
+    mg_free(e->body);
+    mg_free(e->headers);
+    mg_free(e->path);
+    mg_free(e);
+}
+
+/* Must be called with the shard mutex held. Return 1 if the entry must be
+   freed by the caller, after unlocking. */
+static int unlink_file_cache_entry(struct file_cache *cache,
+                                   struct file_cache_shard *shard,
+                                   struct file_cache_entry *e)
+{
+    struct file_cache_entry **pp = get_file_cache_bucket(cache, shard, e->hash);
+
+    while (*pp != e) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = e->hash_next;
+    if (e->lru_prev != NULL) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        shard->lru_head = e->lru_next;
+    }
+    if (e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        shard->lru_tail = e->lru_prev;
+    }
+    shard->num_entries--;
+    shard->body_bytes -= e->body_len;
+    e->unlinked = 1;
+
+    return --e->refs == 0;
+}
+
+/* Find a fresh entry and mark it as most recently used. Must be called with
+   the shard mutex held. */
+static struct file_cache_entry *find_file_cache_entry(struct file_cache *cache,
+                                                      struct file_cache_shard *shard,
+                                                      const char *path,
+                                                      uint32_t hash)
+{
+    struct file_cache_entry *e = *get_file_cache_bucket(cache, shard, hash);
+
+    while (e != NULL && (e->hash != hash || strcmp(e->path, path) != 0)) {
+        e = e->hash_next;
+    }
+    if (e == NULL) {
+        return NULL;
+    } else if (e->expires < get_monotonic_usec()) {
+        if (unlink_file_cache_entry(cache, shard, e)) {
+            free_file_cache_entry(e);
+        }
+        return NULL;
+    }
+
+    if (e != shard->lru_head) {
+        e->lru_prev->lru_next = e->lru_next;
+        if (e->lru_next != NULL) {
+            e->lru_next->lru_prev = e->lru_prev;
+        } else {
+            shard->lru_tail = e->lru_prev;
+        }
+        e->lru_prev = NULL;
+        e->lru_next = shard->lru_head;
+        shard->lru_head->lru_prev = e;
+        shard->lru_head = e;
+    }
+    return e;
+}
+
+static void invalidate_file_cache_entry(struct file_cache *cache,
+                                        const char *path)
+{
+    uint32_t hash = header_hash(path);
+    struct file_cache_shard *shard = get_file_cache_shard(cache, hash);
+    struct file_cache_entry *e;
+    int must_free = 0;
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    shard->generation++;
+    for (e = *get_file_cache_bucket(cache, shard, hash); e != NULL;
+         e = e->hash_next) {
+        if (e->hash == hash && !strcmp(e->path, path)) {
+            must_free = unlink_file_cache_entry(cache, shard, e);
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock(&shard->mutex);
+
+    if (must_free) {
+        free_file_cache_entry(e);
+    }
+}
+
+/* Invalidate path and all entries below it. This walks every shard, so it
+   is only used for directories removed by DELETE. */
+static void invalidate_file_cache_tree(struct file_cache *cache,
+                                       const char *path)
+{
+    struct file_cache_shard *shard;
+    struct file_cache_entry *e, *next, *evicted = NULL;
+    size_t len = strlen(path);
+    int i;
+
+    while (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        shard = &cache->shards[i];
+        (void) pthread_mutex_lock(&shard->mutex);
+        shard->generation++;
+        for (e = shard->lru_head; e != NULL; e = next) {
+            next = e->lru_next;
+            if (!strncmp(e->path, path, len) &&
+                (e->path[len] == '\0' || e->path[len] == '/') &&
+                unlink_file_cache_entry(cache, shard, e)) {
+                e->hash_next = evicted;
+                evicted = e;
+            }
+        }
+        (void) pthread_mutex_unlock(&shard->mutex);
+    }
+
+    while ((e = evicted) != NULL) {
+        evicted = e->hash_next;
+        free_file_cache_entry(e);
+    }
+}
+
+static void flush_file_cache(struct file_cache *cache)
+{
+    struct file_cache_shard *shard;
+    struct file_cache_entry *e;
+    int i;
+
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        shard = &cache->shards[i];
+        (void) pthread_mutex_lock(&shard->mutex);
+        shard->generation++;
+        while ((e = shard->lru_head) != NULL) {
+            if (unlink_file_cache_entry(cache, shard, e)) {
+                free_file_cache_entry(e);
+            }
+        }
+        (void) pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+#if defined(USE_INOTIFY)
+/* Watch the directory of path, so that changes to it invalidate its entry.
+   Without a watch, the entry is only checked again after the TTL. */
+static void watch_file_cache_dir(struct file_cache *cache, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    int i, wd;
+
+    if (cache->inotify_fd < 0 || slash == NULL || slash == path ||
+        slash - path >= (int) sizeof(dir)) {
+        return;
+    }
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+
+    (void) pthread_mutex_lock(&cache->watch_mutex);
+    for (i = 0; i < cache->num_watches; i++) {
+        if (!strcmp(cache->watches[i].dir, dir)) {
+            break;
+        }
+    }
+    if (i == cache->num_watches && i < cache->max_watches &&
+        (wd = inotify_add_watch(cache->inotify_fd, dir,
+                                IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE |
+                                IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                IN_MOVED_TO | IN_DELETE_SELF |
+                                IN_MOVE_SELF)) >= 0) {
+        /* The same directory under another name, e.g. with a trailing
+           slash, gets the same wd. Events can only be mapped back to one
+           of the names. */
+        for (i = 0; i < cache->num_watches; i++) {
+            if (cache->watches[i].wd == wd) {
+                break;
+            }
+        }
+        if (i == cache->num_watches &&
+            (cache->watches[i].dir = mg_strdup(dir)) != NULL) {
+            cache->watches[i].wd = wd;
+            cache->num_watches++;
+        }
+    }
+    (void) pthread_mutex_unlock(&cache->watch_mutex);
+}
+
+/* Called by the master thread when the inotify descriptor is readable */
+static void read_file_cache_events(struct mg_context *ctx)
+{
+    struct file_cache *cache = ctx->file_cache;
+    union {
+        struct inotify_event event;
+        char buf[4096];
+    } u;
+    const struct inotify_event *ev;
+    char dir[PATH_MAX], path[PATH_MAX];
+    ssize_t n;
+    int i, j, flush;
+
+    while ((n = read(cache->inotify_fd, &u, sizeof(u))) > 0) {
+        flush = 0;
+        for (i = 0; i + (int) sizeof(*ev) <= n;
+             i += (int) sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *) (u.buf + i);
+            if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF |
+                            IN_MOVE_SELF)) {
+                /* Events were lost, or a watched directory is gone */
+                flush = 1;
+            }
+
+            dir[0] = '\0';
+            (void) pthread_mutex_lock(&cache->watch_mutex);
+            for (j = 0; j < cache->num_watches; j++) {
+                if (cache->watches[j].wd == ev->wd) {
+                    mg_strlcpy(dir, cache->watches[j].dir, sizeof(dir));
+                    if (ev->mask & IN_IGNORED) {
+                        mg_free(cache->watches[j].dir);
+                        cache->watches[j] = cache->watches[--cache->num_watches];
+                    }
+                    break;
+                }
+            }
+            (void) pthread_mutex_unlock(&cache->watch_mutex);
+
+            if (dir[0] != '\0' && ev->len > 0) {
+                /* A subdirectory is cached with and without trailing slash */
+                mg_snprintf(fc(ctx), path, sizeof(path), "%s/%s", dir, ev->name);
+                invalidate_file_cache_entry(cache, path);
+                mg_snprintf(fc(ctx), path, sizeof(path), "%s/%s/", dir, ev->name);
+                invalidate_file_cache_entry(cache, path);
+            }
+            if (dir[0] != '\0' &&
+                (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                             IN_MOVED_TO))) {
+                /* The directory itself changed, e.g. its mtime */
+                invalidate_file_cache_entry(cache, dir);
+                mg_snprintf(fc(ctx), path, sizeof(path), "%s/", dir);
+                invalidate_file_cache_entry(cache, path);
+            }
+        }
+        if (flush) {
+            flush_file_cache(cache);
+        }
+    }
+}
+#endif
+
+static void destroy_file_cache(struct file_cache *cache);
+
+static struct file_cache *create_file_cache(struct mg_context *ctx)
+{
+    struct file_cache *cache;
+    int i, size = atoi(ctx->config[FILE_CACHE_SIZE]);
+
+    if ((cache = (struct file_cache *) mg_calloc(1, sizeof(*cache))) == NULL) {
+        return NULL;
+    }
+    cache->max_entries = (size + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS;
+    cache->num_buckets = cache->max_entries;
+    cache->ttl = (int64_t) atoi(ctx->config[FILE_CACHE_TTL]) * 1000;
+    cache->max_body_bytes = (int64_t) atoi(ctx->config[STATIC_CACHE_SIZE]) /
+                            FILE_CACHE_SHARDS;
+    cache->max_body_len = cache->max_body_bytes / 4;
+    if (cache->max_body_len > STATIC_CACHE_MAX_FILE_SIZE) {
+        cache->max_body_len = STATIC_CACHE_MAX_FILE_SIZE;
+    }
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        (void) pthread_mutex_init(&cache->shards[i].mutex, NULL);
+        cache->shards[i].buckets = (struct file_cache_entry **)
+            mg_calloc(cache->num_buckets, sizeof(struct file_cache_entry *));
+    }
+
+#if defined(USE_INOTIFY)
+    (void) pthread_mutex_init(&cache->watch_mutex, NULL);
+    cache->max_watches = size;
+    cache->watches = (struct file_cache_watch *)
+        mg_calloc(cache->max_watches, sizeof(*cache->watches));
+    cache->inotify_fd = -1;
+    if (cache->watches == NULL) {
+        cache->max_watches = 0;
+    }
+#endif
+
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        if (cache->shards[i].buckets == NULL) {
+            destroy_file_cache(cache);
+            return NULL;
+        }
+    }
+
+#if defined(USE_INOTIFY)
+    if ((cache->inotify_fd = inotify_init()) < 0) {
+        mg_cry(fc(ctx), "%s: inotify_init failed, file cache entries expire "
+               "after %s ms: %s", __func__, ctx->config[FILE_CACHE_TTL],
+               strerror(ERRNO));
+    } else {
+        set_close_on_exec(cache->inotify_fd, fc(ctx));
+        set_non_blocking_mode(cache->inotify_fd);
+    }
+#endif
+
+    return cache;
+}
+
+static void destroy_file_cache(struct file_cache *cache)
+{
+    int i;
+
+    flush_file_cache(cache);
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        (void) pthread_mutex_destroy(&cache->shards[i].mutex);
+        mg_free(cache->shards[i].buckets);
+    }
+#if defined(USE_INOTIFY)
+    if (cache->inotify_fd >= 0) {
+        (void) close(cache->inotify_fd);
+    }
+    for (i = 0; i < cache->num_watches; i++) {
+        mg_free(cache->watches[i].dir);
+    }
+    mg_free(cache->watches);
+    (void) pthread_mutex_destroy(&cache->watch_mutex);
+#endif
+    mg_free(cache);
+}
+
+/* Fill filep from the cache, calling stat() on a miss. Nonexistent paths
+   are cached as well, index file probing asks for them all the time. */
+static int file_cache_stat(struct mg_context *ctx, const char *path,
+                           struct file *filep)
+{
+    struct file_cache *cache = ctx->file_cache;
+    uint32_t hash = header_hash(path);
+    struct file_cache_shard *shard = get_file_cache_shard(cache, hash);
+    struct file_cache_entry *e, *evicted = NULL;
+    unsigned long generation;
+    struct stat st;
+    int exists;
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    e = find_file_cache_entry(cache, shard, path, hash);
+    if (e != NULL) {
+        exists = e->exists;
+        filep->size = e->size;
+        filep->modification_time = e->modification_time;
+        filep->is_directory = e->is_directory;
+    }
+    generation = shard->generation;
+    (void) pthread_mutex_unlock(&shard->mutex);
+    if (e != NULL) {
+        return exists;
+    }
+
+    /* Watch before stat(), so that no change after it goes unnoticed */
+#if defined(USE_INOTIFY)
+    watch_file_cache_dir(cache, path);
+#endif
+    exists = !stat(path, &st);
+    if (exists) {
+        filep->size = st.st_size;
+        filep->modification_time = st.st_mtime;
+        filep->is_directory = S_ISDIR(st.st_mode);
+    }
+
+    if ((e = (struct file_cache_entry *) mg_calloc(1, sizeof(*e))) == NULL ||
+        (e->path = mg_strdup(path)) == NULL) {
+        mg_free(e);
+        return exists;
+    }
+    e->hash = hash;
+    e->exists = exists;
+    e->size = filep->size;
+    e->modification_time = filep->modification_time;
+    gmt_time_string(e->last_modified, sizeof(e->last_modified),
+                    &e->modification_time);
+    e->is_directory = filep->is_directory;
+    e->fd = -1;
+    e->refs = 1;
+    e->shard = shard;
+    e->expires = get_monotonic_usec() + cache->ttl;
+    get_mime_type(ctx, path, &e->mime);
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    /* Skip the insert if anything was invalidated since the lookup, the
+       result of stat() may be stale already. Another thread may also have
+       inserted the same path in the meantime. */
+    if (generation != shard->generation ||
+        find_file_cache_entry(cache, shard, path, hash) != NULL) {
+        evicted = e;
+    } else {
+        if (shard->num_entries >= cache->max_entries) {
+            evicted = shard->lru_tail;
+            if (!unlink_file_cache_entry(cache, shard, evicted)) {
+                /* Still being sent, the last request frees it */
+                evicted = NULL;
+            }
+        }
+        e->hash_next = *get_file_cache_bucket(cache, shard, hash);
+        *get_file_cache_bucket(cache, shard, hash) = e;
+        e->lru_next = shard->lru_head;
+        if (shard->lru_head != NULL) {
+            shard->lru_head->lru_prev = e;
+        } else {
+            shard->lru_tail = e;
+        }
+        shard->lru_head = e;
+        shard->num_entries++;
+    }
+    (void) pthread_mutex_unlock(&shard->mutex);
+
+    if (evicted != NULL) {
+        free_file_cache_entry(evicted);
+    }
+    return exists;
+}
+
+static void construct_etag(char *buf, size_t buf_len,
+                           const struct file *filep);
+
+/* Read the body of a small file that was asked for before, so that it can
+   be served from memory. Called with e pinned and the shard unlocked. Least
+   recently used bodies are dropped to stay within static_cache_size. */
+static void load_file_cache_body(struct mg_connection *conn,
+                                 struct file_cache_entry *e, int64_t len,
+                                 struct file *filep)
+{
+    struct file_cache *cache = conn->ctx->file_cache;
+    struct file_cache_shard *shard = e->shard;
+    struct file_cache_entry *victim, *prev, *evicted = NULL;
+    char lm[64], etag[64], buf[512], *body, *headers = NULL;
+    int headers_len = 0;
+
+    if ((body = (char *) mg_malloc((size_t) len + 1)) != NULL &&
+        pread(e->fd, body, (size_t) len, 0) == (ssize_t) len) {
+        last_modified_string(lm, sizeof(lm), filep);
+        construct_etag(etag, sizeof(etag), filep);
+        headers_len = snprintf(buf, sizeof(buf),
+                               "Last-Modified: %s\r\n"
+                               "Etag: %s\r\n"
+                               "Content-Type: %.*s\r\n"
+                               "Accept-Ranges: bytes\r\n",
+                               lm, etag, (int) e->mime.len, e->mime.ptr);
+        if (headers_len > 0 && headers_len < (int) sizeof(buf)) {
+            headers = mg_strdup(buf);
+        }
+    }
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    e->loading = 0;
+    if (headers != NULL && !e->unlinked) {
+        e->body = body;
+        e->body_len = len;
+        e->headers = headers;
+        e->headers_len = headers_len;
+        shard->body_bytes += len;
+        body = headers = NULL;
+
+        for (victim = shard->lru_tail;
+             victim != NULL && shard->body_bytes > cache->max_body_bytes;
+             victim = prev) {
+            prev = victim->lru_prev;
+            if (victim->body != NULL && victim != e) {
+                if (unlink_file_cache_entry(cache, shard, victim)) {
+                    victim->hash_next = evicted;
+                    evicted = victim;
+                }
+                conn->stats[STAT_STATIC_CACHE_EVICTIONS]++;
+            }
+        }
+    }
+    if (e->body != NULL) {
+        filep->membuf = e->body;
+    }
+    (void) pthread_mutex_unlock(&shard->mutex);
+
+    mg_free(body);
+    mg_free(headers);
+    while ((victim = evicted) != NULL) {
+        evicted = victim->hash_next;
+        free_file_cache_entry(victim);
+    }
+}
+
+/* Open path through the cache, sharing one descriptor between requests.
+   On success filep->cached is set and must be released by mg_fclose().
+   filep->membuf is set too if the content is kept in memory. */
+static int file_cache_open(struct mg_connection *conn, const char *path,
+                           struct file *filep)
+{
+    struct file_cache *cache = conn->ctx->file_cache;
+    uint32_t hash = header_hash(path);
+    struct file_cache_shard *shard = get_file_cache_shard(cache, hash);
+    struct file_cache_entry *e, *unpinned = NULL;
+    struct stat st;
+    int load = 0, fd = -1;
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    e = find_file_cache_entry(cache, shard, path, hash);
+    if (e != NULL && e->exists && !e->is_directory && e->fd < 0) {
+        /* Open with the entry pinned and the shard unlocked, open() may
+           block on slow storage */
+        e->refs++;
+        (void) pthread_mutex_unlock(&shard->mutex);
+        if ((fd = open(path, O_RDONLY)) >= 0) {
+            set_close_on_exec(fd, conn);
+            if (fstat(fd, &st) != 0) {
+                (void) close(fd);
+                fd = -1;
+            }
+        }
+        (void) pthread_mutex_lock(&shard->mutex);
+
+        /* Another request may have opened it meanwhile, then its descriptor
+           is used. An entry invalidated meanwhile is not used at all. */
+        if (!e->unlinked && e->fd < 0 && fd >= 0) {
+            e->fd = fd;
+            fd = -1;
+            /* The size sent must match the descriptor, not the earlier
+               stat() */
+            if (e->size != st.st_size ||
+                e->modification_time != st.st_mtime) {
+                e->size = st.st_size;
+                e->modification_time = st.st_mtime;
+                gmt_time_string(e->last_modified, sizeof(e->last_modified),
+                                &e->modification_time);
+            }
+        }
+        if (--e->refs == 0) {
+            unpinned = e;
+        }
+        if (e->unlinked) {
+            e = NULL;
+        }
+    }
+    if (e != NULL && e->fd >= 0) {
+        e->refs++;
+        filep->size = e->size;
+        filep->modification_time = e->modification_time;
+        filep->membuf = e->body;
+        filep->cached = e;
+        /* Only files asked for more than once are worth the memory */
+        if (e->body == NULL && !e->loading && ++e->hits >= 2 &&
+            e->size <= cache->max_body_len) {
+            load = e->loading = 1;
+        }
+    }
+    (void) pthread_mutex_unlock(&shard->mutex);
+
+    if (fd >= 0) {
+        (void) close(fd);
+    }
+    if (unpinned != NULL) {
+        free_file_cache_entry(unpinned);
+    }
+    if (load) {
+        load_file_cache_body(conn, e, filep->size, filep);
+    }
+
+    return filep->cached != NULL;
+}
+
+/* An entry invalidated while requests still send from its descriptor is
+   freed when the last of them is done */
+static void file_cache_release(struct file_cache_entry *e)
+{
+    struct file_cache_shard *shard = e->shard;
+    int refs;
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    refs = --e->refs;
+    (void) pthread_mutex_unlock(&shard->mutex);
+
+    if (refs == 0) {
+        free_file_cache_entry(e);
+    }
+}
+#endif /* USE_FILE_CACHE */
+
 static int mg_stat(struct mg_connection *conn, const char *path,
                    struct file *filep)
 {
     struct stat st;
 
+#if defined(USE_FILE_CACHE)
+    if (conn->ctx->file_cache != NULL && !is_file_in_memory(conn, path, filep)) {
+        if (!file_cache_stat(conn->ctx, path, filep)) {
+            filep->modification_time = (time_t) 0;
+        }
+        return filep->modification_time != (time_t) 0;
+    }
+#endif
+
     if (!is_file_in_memory(conn, path, filep) && !stat(path, &st)) {
         filep->size = st.st_size;
         filep->modification_time = st.st_mtime;
@@ -2134,7 +3701,9 @@ static pid_t spawn_process(struct mg_connection *conn, const char *prog,
         /* Parent */
         send_http_error(conn, 500, http_500_error, "fork(): %s", strerror(ERRNO));
     } else if (pid == 0) {
-        /* Child */
+        /* Child. The log writer threads were not forked, and their locks
+           may be held, so errors are logged synchronously. */
+        conn->ctx->access_log = conn->ctx->error_log = NULL;
         if (chdir(dir) != 0) {
             mg_cry(conn, "%s: chdir(%s): %s", __func__, dir, strerror(ERRNO));
         } else if (dup2(fdin, 0) == -1) {
@@ -2224,6 +3793,12 @@ static int pull(FILE *fp, struct mg_connection *conn, char *buf, int len)
 {
     int nread;
 
+    /* The client may be waiting for what has been written so far, e.g. a
+       100 Continue, and so may a streaming CGI's client */
+    if (conn->out_len > 0 && !flush_output(conn)) {
+        return -1;
+    }
+
     if (fp != NULL) {
         /* Use read() instead of fread(), because if we're reading from the
            CGI pipe, fread() may block until IO buffer is filled up. We cannot
@@ -2358,67 +3933,236 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
 }
 
 
-int mg_write(struct mg_connection *conn, const void *buf, size_t len)
+static void init_token_bucket(struct token_bucket *b, int rate)
+{
+    /* A tenth of a second worth of data, but not tiny writes either */
+    b->rate = rate;
+    b->burst = rate / 10 > 1024 ? rate / 10 : rate < 1024 ? rate : 1024;
+    b->tokens = b->burst * 1000000;
+    b->updated = get_monotonic_usec();
+}
+
+/* Refill the bucket for the time passed and take up to want bytes from it.
+   Return the number of bytes that may be sent now. If that is 0, *wait is
+   set to the microseconds until a worthwhile amount is available. */
+static int64_t take_tokens(struct token_bucket *b, int64_t want,
+                           int64_t *wait)
+{
+    int64_t now = get_monotonic_usec(), need, granted = 0;
+
+    if (b->shared) {
+        (void) pthread_mutex_lock(&b->mutex);
+    }
+
+    if (now - b->updated >= 10000000) {
+        b->tokens = b->burst * 1000000;
+    } else if (now > b->updated) {
+        b->tokens += (now - b->updated) * b->rate;
+        if (b->tokens > b->burst * 1000000) {
+            b->tokens = b->burst * 1000000;
+        }
+    }
+    b->updated = now;
+
+    /* Wait for a quarter of the burst rather than trickle out tiny writes */
+    need = b->burst / 4 + 1 < want ? b->burst / 4 + 1 : want;
+    if (b->tokens >= need * 1000000) {
+        granted = b->tokens / 1000000 < want ? b->tokens / 1000000 : want;
+        b->tokens -= granted * 1000000;
+    } else {
+        *wait = (need * 1000000 - b->tokens + b->rate - 1) / b->rate;
+    }
+
+    if (b->shared) {
+        (void) pthread_mutex_unlock(&b->mutex);
+    }
+    return granted;
+}
+
+/* Sleep for usec microseconds, or until the server stops */
+static void throttle_wait(struct mg_context *ctx, int64_t usec)
+{
+    struct timespec abstime;
+
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += (time_t) (usec / 1000000);
+    abstime.tv_nsec += (long) (usec % 1000000) * 1000;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+
+    (void) pthread_mutex_lock(&ctx->throttle_mutex);
+    if (ctx->stop_flag == 0) {
+        (void) pthread_cond_timedwait(&ctx->throttle_cond,
+                                      &ctx->throttle_mutex, &abstime);
+    }
+    (void) pthread_mutex_unlock(&ctx->throttle_mutex);
+}
+
+/* Send to the client right away, throttled if need be */
+static int write_output(struct mg_connection *conn, const void *buf,
+                        size_t len)
 {
-    time_t now;
-    int64_t n, total, allowed;
+    int64_t n, total = 0, allowed, wait = 0;
 
     if (conn->throttle > 0) {
-        if ((now = time(NULL)) != conn->last_throttle_time) {
-            conn->last_throttle_time = now;
-            conn->last_throttle_bytes = 0;
-        }
-        allowed = conn->throttle - conn->last_throttle_bytes;
-        if (allowed > (int64_t) len) {
-            allowed = len;
-        }
-        if ((total = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
-                          (int64_t) allowed)) == allowed) {
-            buf = (char *) buf + total;
-            conn->last_throttle_bytes += total;
-            while (total < (int64_t) len && conn->ctx->stop_flag == 0) {
-                allowed = conn->throttle > (int64_t) len - total ?
-                          (int64_t) len - total : conn->throttle;
-                if ((n = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
-                              (int64_t) allowed)) != allowed) {
-                    break;
-                }
-                sleep(1);
-                conn->last_throttle_bytes = allowed;
-                conn->last_throttle_time = time(NULL);
-                buf = (char *) buf + n;
+        while (total < (int64_t) len && conn->ctx->stop_flag == 0) {
+            if ((allowed = take_tokens(conn->bucket, (int64_t) len - total,
+                                       &wait)) == 0) {
+                throttle_wait(conn->ctx, wait);
+                continue;
+            }
+            n = push(NULL, conn->client.sock, conn->ssl,
+                     (const char *) buf + total, allowed);
+            if (n > 0) {
                 total += n;
             }
+            if (n != allowed) {
+                break;
+            }
         }
     } else {
         total = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
                      (int64_t) len);
     }
+    if (total > 0) {
+        conn->timings.last_write = get_monotonic_usec();
+    }
     return (int) total;
 }
 
-/* Alternative alloc_vprintf() for non-compliant C runtimes */
-static int alloc_vprintf2(char **buf, const char *fmt, va_list ap)
-{
-    va_list ap_copy;
-    int size = MG_BUF_LEN;
-    int len = -1;
+#if !defined(_WIN32)
+/* Like write_output(), but for several buffers, which are sent with as few
+   system calls as possible */
+static int64_t push_iov(struct mg_connection *conn, struct iovec *iov,
+                        int iovcnt)
+{
+    struct msghdr msg;
+    int64_t total = 0;
+    ssize_t n;
+    int i;
 
-    *buf = NULL;
-    while (len == -1) {
-        if (*buf) mg_free(*buf);
-        *buf = (char *)mg_malloc(size *= 4);
-        if (!*buf) break;
-        va_copy(ap_copy, ap);
-        len = vsnprintf(*buf, size, fmt, ap_copy);
-        va_end(ap_copy);
+    if (conn->ssl != NULL || conn->throttle > 0) {
+        for (i = 0; i < iovcnt; i++) {
+            n = write_output(conn, iov[i].iov_base, iov[i].iov_len);
+            total += n > 0 ? n : 0;
+            if (n != (ssize_t) iov[i].iov_len) {
+                break;
+            }
+        }
+        return total;
     }
 
-    return len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0 && conn->ctx->stop_flag == 0) {
+        n = sendmsg(conn->client.sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && ERRNO == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        total += n;
+        while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    if (total > 0) {
+        conn->timings.last_write = get_monotonic_usec();
+    }
+    return total;
 }
+#endif
 
-/* Print message to buffer. If buffer is large enough to hold the message,
-   return buffer. If buffer is to small, allocate large enough buffer on heap,
+/* Send what mg_write() has collected. Return 0 if not everything could be
+   sent. */
+static int flush_output(struct mg_connection *conn)
+{
+    int len = conn->out_len;
+
+    if (len == 0) {
+        return 1;
+    }
+    conn->out_len = 0;
+    return write_output(conn, conn->out_buf, (size_t) len) == len;
+}
+
+/* While a response is being produced by the server itself, small writes
+   are collected in conn->out_buf, so that headers and small bodies go out
+   in one segment. A write that does not fit is sent together with the
+   collected output. The output is flushed before reading from the client,
+   before handing the connection to user code and after every request. */
+int mg_write(struct mg_connection *conn, const void *buf, size_t len)
+{
+#if !defined(_WIN32)
+    struct iovec iov[2];
+    int64_t n;
+#endif
+
+    if (!conn->buffer_output) {
+        return write_output(conn, buf, len);
+    } else if (len <= sizeof(conn->out_buf) - conn->out_len) {
+        memcpy(conn->out_buf + conn->out_len, buf, len);
+        conn->out_len += (int) len;
+        return (int) len;
+    }
+
+#if !defined(_WIN32)
+    if (conn->out_len > 0) {
+        iov[0].iov_base = conn->out_buf;
+        iov[0].iov_len = conn->out_len;
+        iov[1].iov_base = (void *) buf;
+        iov[1].iov_len = len;
+        n = push_iov(conn, iov, 2) - conn->out_len;
+        conn->out_len = 0;
+        return n > 0 ? (int) n : 0;
+    }
+#else
+    if (!flush_output(conn)) {
+        return 0;
+    }
+#endif
+    return write_output(conn, buf, len);
+}
+
+/* Flush and stop collecting output, before calling user code that may
+   stream its response or write from other threads */
+static void end_output_buffering(struct mg_connection *conn)
+{
+    (void) flush_output(conn);
+    conn->buffer_output = 0;
+}
+
+/* Alternative alloc_vprintf() for non-compliant C runtimes */
+static int alloc_vprintf2(char **buf, const char *fmt, va_list ap)
+{
+    va_list ap_copy;
+    int size = MG_BUF_LEN;
+    int len = -1;
+
+    *buf = NULL;
+    while (len == -1) {
+        if (*buf) mg_free(*buf);
+        *buf = (char *)mg_malloc(size *= 4);
+        if (!*buf) break;
+        va_copy(ap_copy, ap);
+        len = vsnprintf(*buf, size, fmt, ap_copy);
+        va_end(ap_copy);
+    }
+
+    return len;
+}
+
+/* Print message to buffer. If buffer is large enough to hold the message,
+   return buffer. If buffer is to small, allocate large enough buffer on heap,
    and return allocated buffer. */
 static int alloc_vprintf(char **buf, size_t size, const char *fmt, va_list ap)
 {
@@ -2461,6 +4205,19 @@ int mg_vprintf(struct mg_connection *conn, const char *fmt, va_list ap)
 {
     char mem[MG_BUF_LEN], *buf = mem;
     int len;
+    size_t space = sizeof(conn->out_buf) - conn->out_len;
+    va_list ap_copy;
+
+    /* Format straight into the output buffer if it fits */
+    if (conn->buffer_output && space > 0) {
+        va_copy(ap_copy, ap);
+        len = vsnprintf(conn->out_buf + conn->out_len, space, fmt, ap_copy);
+        va_end(ap_copy);
+        if (len >= 0 && (size_t) len < space) {
+            conn->out_len += len;
+            return len;
+        }
+    }
 
     if ((len = alloc_vprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
         len = mg_write(conn, buf, (size_t) len);
@@ -2674,15 +4431,62 @@ static int base64_decode(const unsigned char *src, int src_len, char *dst, size_
 }
 #endif
 
+/* Return the quality, 0 to 1000, that an Accept-Encoding header gives a
+   content coding, see RFC 7231 section 5.3.4. A missing q parameter means
+   1000, codings that are not listed get the quality of "*", or 0. */
+static int get_encoding_quality(const char *header, const char *coding)
+{
+    const char *p = header, *name, *q;
+    size_t coding_len = strlen(coding), name_len;
+    int quality, star = -1;
+
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        name = p;
+        while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' &&
+               *p != '\t') {
+            p++;
+        }
+        name_len = (size_t) (p - name);
+
+        /* Parameters, only q is of interest */
+        quality = 1000;
+        while (*p != '\0' && *p != ',') {
+            if (*p == ';') {
+                q = p + 1;
+                while (*q == ' ' || *q == '\t') {
+                    q++;
+                }
+                if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+                    quality = (int) (strtod(q + 2, NULL) * 1000 + 0.5);
+                    quality = quality < 0 ? 0 : quality > 1000 ? 1000 : quality;
+                }
+            }
+            p++;
+        }
+
+        if (name_len == coding_len &&
+            mg_strncasecmp(name, coding, coding_len) == 0) {
+            return quality;
+        } else if (name_len == 1 && *name == '*') {
+            star = quality;
+        }
+    }
+
+    return star >= 0 ? star : 0;
+}
+
 static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
                                      size_t buf_len, struct file *filep,
                                      int * is_script_ressource)
 {
-    struct vec a, b;
-    const char *rewrite, *uri = conn->request_info.uri,
-                          *root = conn->ctx->config[DOCUMENT_ROOT];
+    const struct rewrite_rule *rewrite;
+    const char *uri = conn->request_info.uri,
+               *root = conn->ctx->config[DOCUMENT_ROOT];
     char *p;
-    int match_len;
+    int i, match_len;
     char gz_path[PATH_MAX];
     char const* accept_encoding;
 
@@ -2701,11 +4505,11 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
                 root == NULL ? "" : root,
                 root == NULL ? "" : uri);
 
-    rewrite = conn->ctx->config[REWRITE];
-    while ((rewrite = next_option(rewrite, &a, &b)) != NULL) {
-        if ((match_len = match_prefix(a.ptr, (int) a.len, uri)) > 0) {
-            mg_snprintf(conn, buf, buf_len - 1, "%.*s%s", (int) b.len, b.ptr,
-                        uri + match_len);
+    for (i = 0; i < conn->ctx->cfg.num_rewrite_rules; i++) {
+        rewrite = &conn->ctx->cfg.rewrite[i];
+        if ((match_len = match_pattern(&rewrite->uri, uri)) > 0) {
+            mg_snprintf(conn, buf, buf_len - 1, "%.*s%s", rewrite->dir_len,
+                        rewrite->dir, uri + match_len);
             break;
         }
     }
@@ -2718,8 +4522,8 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
        to indicate that the response need to have the content-
        encoding: gzip header
        we can only do this if the browser declares support */
-    if ((accept_encoding = mg_get_header(conn, "Accept-Encoding")) != NULL) {
-        if (strstr(accept_encoding,"gzip") != NULL) {
+    if ((accept_encoding = mg_get_header_id(conn, HTTP_HEADER_ACCEPT_ENCODING)) != NULL) {
+        if (get_encoding_quality(accept_encoding, "gzip") > 0) {
             snprintf(gz_path, sizeof(gz_path), "%s.gz", buf);
             if (mg_stat(conn, gz_path, filep)) {
                 filep->gzipped = 1;
@@ -2732,12 +4536,10 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
     for (p = buf + strlen(buf); p > buf + 1; p--) {
         if (*p == '/') {
             *p = '\0';
-            if ((match_prefix(conn->ctx->config[CGI_EXTENSIONS],
-                              (int)strlen(conn->ctx->config[CGI_EXTENSIONS]), buf) > 0
+            if ((match_pattern(&conn->ctx->cfg.cgi_pattern, buf) > 0
 #ifdef USE_LUA
                  ||
-                 match_prefix(conn->ctx->config[LUA_SCRIPT_EXTENSIONS],
-                              (int)strlen(conn->ctx->config[LUA_SCRIPT_EXTENSIONS]), buf) > 0
+                 match_pattern(&conn->ctx->cfg.lua_script_pattern, buf) > 0
 #endif
                 ) && mg_stat(conn, buf, filep)) {
                 /* Shift PATH_INFO block one character right, e.g.
@@ -2758,38 +4560,143 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
     }
 }
 
-/* Check whether full request is buffered. Return:
+/* Request line plus the http_headers of struct mg_request_info */
+#define MAX_REQUEST_LINES 65
+
+/* State of an incremental scan of HTTP headers, see scan_request().
+   Besides looking for the end of the headers, the scan records where the
+   lines and their first colons are, so that parsing the headers does not
+   need to look at every byte again. */
+struct request_scan {
+    int pos;            /* Bytes consumed so far */
+    int state;          /* SCAN_* */
+    int in_content;     /* A ':' has been seen, control characters are OK */
+    int first;          /* Offset of the first non-space character */
+    int num_lines;      /* Complete lines recorded, -1 before first */
+    int colon[MAX_REQUEST_LINES];    /* First ':' of each line, or -1 */
+    int line_end[MAX_REQUEST_LINES]; /* The '\n' ending each line */
+};
+
+enum { SCAN_TEXT, SCAN_LF, SCAN_LF_CR };
+
+static void init_request_scan(struct request_scan *st)
+{
+    st->pos = 0;
+    st->state = SCAN_TEXT;
+    st->in_content = 0;
+    st->first = 0;
+    st->num_lines = -1;
+}
+
+/* Return the number of bytes at the start of s which are neither '\n' nor,
+   if need_colon is set, ':'. These are all header value bytes where
+   scan_request() has nothing to do. */
+static int skip_header_text(const char *s, int len, int need_colon)
+{
+    const char *p;
+    int i = 0;
+
+    if (!need_colon) {
+        p = (const char *) memchr(s, '\n', len);
+        return p == NULL ? len : (int) (p - s);
+    }
+#if defined(USE_SSE2)
+    {
+        const __m128i nl = _mm_set1_epi8('\n'), colon = _mm_set1_epi8(':');
+        __m128i v;
+        int mask;
+
+        for (; i + 16 <= len; i += 16) {
+            v = _mm_loadu_si128((const __m128i *) (s + i));
+            mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                                                  _mm_cmpeq_epi8(v, colon)));
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+    for (; i < len && s[i] != '\n' && s[i] != ':'; i++) {
+    }
+    return i;
+}
+
+/* Continue scanning the buffer for the end of the HTTP headers, at the
+   position where the previous call for the same buffer stopped. Every byte
+   is looked at once, no matter how many reads a request arrives in. Return:
      -1  if request is malformed
       0  if request is not yet fully buffered
      >0  actual request length, including last \r\n\r\n */
-static int get_request_len(const char *buf, int buflen)
+static int scan_request(const char *buf, int buflen, struct request_scan *st)
 {
-    const char *s, *e;
-    int len = 0;
-    int in_content = 0;
+    int i, c;
+
+    for (i = st->pos; i < buflen; i++) {
+        /* After the first colon only line ends and the first colon of a
+           line matter, skip the text in between in bulk */
+        if (st->in_content && st->state == SCAN_TEXT && i < buflen - 1) {
+            i += skip_header_text(buf + i, buflen - 1 - i,
+                                  st->num_lines < MAX_REQUEST_LINES &&
+                                  st->colon[st->num_lines] < 0);
+        }
+        c = * (const unsigned char *) &buf[i];
+
+        /* The end is "\n\n" or "\n\r\n" */
+        if (c == '\n' && (st->state == SCAN_LF || st->state == SCAN_LF_CR)) {
+            return i + 1;
+        }
+        /* The last byte is only looked at as the end of the headers: a
+           request followed by a NUL is still a valid request */
+        if (i == buflen - 1) {
+            break;
+        }
 
-    for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++) {
         /* Control characters are not allowed but >=128 is. */
-        if (!in_content && !isprint(* (const unsigned char *) s) && *s != '\r' &&
-            *s != '\n' && * (const unsigned char *) s < 128) {
-            len = -1;
-            break;  /* [i_a] abort scan as soon as one malformed character is
-                       found; */
-            /* don't let subsequent \r\n\r\n win us over anyhow */
-        } else if (s[0] == '\n' && s[1] == '\n') {
-            len = (int) (s - buf) + 2;
-        } else if (s[0] == '\n' && &s[1] < e &&
-                   s[1] == '\r' && s[2] == '\n') {
-            len = (int) (s - buf) + 3;
-	    in_content = 0;
-        }
-
-	if (!in_content && *s == ':') {
-	    in_content = 1;
-	}
+        if (!st->in_content && !isprint(c) && c != '\r' && c != '\n' &&
+            c < 128) {
+            return -1;
+        }
+
+        if (st->num_lines < 0 && !isspace(c)) {
+            /* Initial whitespace is ignored, the first line starts here */
+            st->first = i;
+            st->num_lines = 0;
+            st->colon[0] = -1;
+        }
+
+        if (c == '\n') {
+            st->state = SCAN_LF;
+            if (st->num_lines >= 0 && st->num_lines < MAX_REQUEST_LINES) {
+                st->line_end[st->num_lines++] = i;
+                if (st->num_lines < MAX_REQUEST_LINES) {
+                    st->colon[st->num_lines] = -1;
+                }
+            }
+        } else if (c == '\r' && st->state == SCAN_LF) {
+            st->state = SCAN_LF_CR;
+        } else {
+            st->state = SCAN_TEXT;
+            if (c == ':') {
+                st->in_content = 1;
+                if (st->num_lines >= 0 && st->num_lines < MAX_REQUEST_LINES &&
+                    st->colon[st->num_lines] < 0) {
+                    st->colon[st->num_lines] = i;
+                }
+            }
+        }
     }
+    st->pos = i;
 
-    return len;
+    return 0;
+}
+
+/* Check whether full request is buffered. Return values as scan_request() */
+static int get_request_len(const char *buf, int buflen)
+{
+    struct request_scan st;
+
+    init_request_scan(&st);
+    return scan_request(buf, buflen, &st);
 }
 
 /* Convert month to the month number. Return -1 on error, or month number */
@@ -3124,7 +5031,7 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
     unsigned long nonce;
 
     (void) memset(ah, 0, sizeof(*ah));
-    if ((auth_header = mg_get_header(conn, "Authorization")) == NULL ||
+    if ((auth_header = mg_get_header_id(conn, HTTP_HEADER_AUTHORIZATION)) == NULL ||
         mg_strncasecmp(auth_header, "Digest ", 7) != 0) {
         return 0;
     }
@@ -3359,7 +5266,6 @@ static int check_authorization(struct mg_connection *conn, const char *path)
 static void send_authorization_request(struct mg_connection *conn)
 {
     char date[64];
-    time_t curtime = time(NULL);
     unsigned long nonce = (unsigned long)(conn->ctx->start_time);
 
     (void)pthread_mutex_lock(&conn->ctx->nonce_mutex);
@@ -3371,7 +5277,7 @@ static void send_authorization_request(struct mg_connection *conn)
     conn->status_code = 401;
     conn->must_close = 1;
 
-    gmt_time_string(date, sizeof(date), &curtime);
+    current_date_string(conn->ctx, date, sizeof(date));
 
     mg_printf(conn,
               "HTTP/1.1 401 Unauthorized\r\n"
@@ -3614,10 +5520,8 @@ static int WINCDECL compare_dir_entries(const void *p1, const void *p2)
 
 static int must_hide_file(struct mg_connection *conn, const char *path)
 {
-    const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
-    const char *pattern = conn->ctx->config[HIDE_FILES];
-    return match_prefix(pw_pattern, (int)strlen(pw_pattern), path) > 0 ||
-           (pattern != NULL && match_prefix(pattern, (int)strlen(pattern), path) > 0);
+    return match_pattern(&conn->ctx->cfg.passwords_file, path) > 0 ||
+           match_pattern(&conn->ctx->cfg.hide_files, path) > 0;
 }
 
 static int scan_directory(struct mg_connection *conn, const char *dir,
@@ -3753,7 +5657,6 @@ static void handle_directory_request(struct mg_connection *conn,
     int i, sort_direction;
     struct dir_scan_data data = { NULL, 0, 128 };
     char date[64];
-    time_t curtime = time(NULL);
 
     if (!scan_directory(conn, dir, &data, dir_scan_callback)) {
         send_http_error(conn, 500, "Cannot open directory",
@@ -3761,7 +5664,7 @@ static void handle_directory_request(struct mg_connection *conn,
         return;
     }
 
-    gmt_time_string(date, sizeof(date), &curtime);
+    current_date_string(conn->ctx, date, sizeof(date));
 
     sort_direction = conn->request_info.query_string != NULL &&
                      conn->request_info.query_string[1] == 'd' ? 'a' : 'd';
@@ -3805,12 +5708,72 @@ static void handle_directory_request(struct mg_connection *conn,
     conn->status_code = 200;
 }
 
+#if defined(USE_SENDFILE)
+/* Send len bytes of the file starting at offset with sendfile(). Return the
+   number of bytes sent, or -1 if the file or socket do not support
+   sendfile() and the data must be copied instead. */
+static int64_t send_file_zero_copy(struct mg_connection *conn, int fd,
+                                   int64_t offset, int64_t len)
+{
+    off_t off = (off_t) offset;
+    int64_t sent = 0;
+    ssize_t n;
+
+    while (sent < len && conn->ctx->stop_flag == 0) {
+        /* Linux sends a little under 2 GB per call, so ask for 1 GB */
+        n = sendfile(conn->client.sock, fd, &off,
+                     (size_t) (len - sent > 0x40000000 ? 0x40000000 : len - sent));
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && ERRNO == EINTR) {
+            continue;
+        } else if (n < 0 && sent == 0 && (ERRNO == EINVAL || ERRNO == ENOSYS)) {
+            return -1;
+        } else {
+            /* Client gone, send timeout, or the file got shorter */
+            break;
+        }
+    }
+    if (sent > 0) {
+        conn->timings.last_write = get_monotonic_usec();
+    }
+
+    return sent;
+}
+
+/* Flush the collected headers before sendfile() takes over, topped up with
+   the start of the file, so that a small file goes out in the same segment.
+   Pipes cannot be read this way and are left alone. */
+static int flush_with_file_head(struct mg_connection *conn, int fd,
+                                int64_t *offset, int64_t *len)
+{
+    size_t space = sizeof(conn->out_buf) - conn->out_len;
+    ssize_t n;
+
+    if (conn->out_len > 0 && space > 0) {
+        n = pread(fd, conn->out_buf + conn->out_len,
+                  (int64_t) space > *len ? (size_t) *len : space,
+                  (off_t) *offset);
+        if (n > 0) {
+            conn->out_len += (int) n;
+            conn->num_bytes_sent += n;
+            *offset += n;
+            *len -= n;
+        }
+    }
+    return flush_output(conn);
+}
+#endif
+
 /* Send len bytes from the opened file to the client. */
 static void send_file_data(struct mg_connection *conn, struct file *filep,
                            int64_t offset, int64_t len)
 {
     char buf[MG_BUF_LEN];
     int to_read, num_read, num_written;
+#if defined(USE_SENDFILE)
+    int64_t sent;
+#endif
 
     /* Sanity check the offset */
     offset = offset < 0 ? 0 : offset > filep->size ? filep->size : offset;
@@ -3821,6 +5784,18 @@ static void send_file_data(struct mg_connection *conn, struct file *filep,
         }
         mg_write(conn, filep->membuf + offset, (size_t) len);
     } else if (len > 0 && filep->fp != NULL) {
+#if defined(USE_SENDFILE)
+        /* SSL must encrypt in user space, and throttling is done by
+           mg_write() */
+        if (conn->ssl == NULL && conn->throttle == 0 &&
+            flush_with_file_head(conn, fileno(filep->fp), &offset, &len) &&
+            (len == 0 ||
+             (sent = send_file_zero_copy(conn, fileno(filep->fp), offset,
+                                         len)) >= 0)) {
+            conn->num_bytes_sent += len == 0 ? 0 : sent;
+            return;
+        }
+#endif
         if (offset > 0 && fseeko(filep->fp, offset, SEEK_SET) != 0) {
             mg_cry(conn, "%s: fseeko() failed: %s",
                    __func__, strerror(ERRNO));
@@ -3846,6 +5821,37 @@ static void send_file_data(struct mg_connection *conn, struct file *filep,
             conn->num_bytes_sent += num_written;
             len -= num_written;
         }
+#if defined(USE_FILE_CACHE)
+    } else if (len > 0 && filep->cached != NULL) {
+#if defined(USE_SENDFILE)
+        if (conn->ssl == NULL && conn->throttle == 0 &&
+            flush_with_file_head(conn, filep->cached->fd, &offset, &len) &&
+            (len == 0 ||
+             (sent = send_file_zero_copy(conn, filep->cached->fd, offset,
+                                         len)) >= 0)) {
+            conn->num_bytes_sent += len == 0 ? 0 : sent;
+            return;
+        }
+#endif
+        /* The descriptor is shared with other requests, so the file
+           position must not be used */
+        while (len > 0) {
+            to_read = sizeof(buf);
+            if ((int64_t) to_read > len) {
+                to_read = (int) len;
+            }
+            if ((num_read = (int) pread(filep->cached->fd, buf,
+                                        (size_t) to_read, offset)) <= 0) {
+                break;
+            }
+            if ((num_written = mg_write(conn, buf, (size_t) num_read)) != num_read) {
+                break;
+            }
+            conn->num_bytes_sent += num_written;
+            offset += num_written;
+            len -= num_written;
+        }
+#endif
     }
 }
 
@@ -3854,6 +5860,105 @@ static int parse_range_header(const char *header, int64_t *a, int64_t *b)
     return sscanf(header, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
 }
 
+#define MAX_RANGES 32
+
+/* First and last byte of a range */
+struct byte_range {
+    int64_t start;
+    int64_t end;
+};
+
+static const char *parse_range_number(const char *p, int64_t *value)
+{
+    if (!isdigit(* (const unsigned char *) p)) {
+        return NULL;
+    }
+    for (*value = 0; isdigit(* (const unsigned char *) p); p++) {
+        if (*value > (INT64_MAX - 9) / 10) {
+            return NULL;
+        }
+        *value = *value * 10 + (*p - '0');
+    }
+    return p;
+}
+
+/* Parse the byte-range-set of a Range header (RFC 7233 section 2.1) for a
+   file of the given size. The ranges are sorted, and overlapping or
+   adjacent ones are merged, so they can be sent in one pass over the file.
+   Return the number of ranges, 0 if none is satisfiable, or -1 if the
+   header is invalid or asks for too many ranges, and must be ignored. */
+static int parse_range_set(const char *header, int64_t size,
+                           struct byte_range *ranges, int max_ranges)
+{
+    const char *p = header;
+    struct byte_range r;
+    int i, j, n = 0, satisfiable;
+
+    if (mg_strncasecmp(p, "bytes=", 6) != 0) {
+        return -1;
+    }
+    for (p += 6; *p != '\0';) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        } else if (*p == '-') {
+            /* Suffix range, the last bytes of the file */
+            if ((p = parse_range_number(p + 1, &r.start)) == NULL) {
+                return -1;
+            }
+            satisfiable = r.start > 0 && size > 0;
+            r.start = r.start > size ? 0 : size - r.start;
+            r.end = size - 1;
+        } else {
+            if ((p = parse_range_number(p, &r.start)) == NULL || *p++ != '-') {
+                return -1;
+            }
+            if (isdigit(* (const unsigned char *) p)) {
+                if ((p = parse_range_number(p, &r.end)) == NULL ||
+                    r.end < r.start) {
+                    return -1;
+                }
+            } else {
+                r.end = size - 1;
+            }
+            satisfiable = r.start < size;
+            if (r.end > size - 1) {
+                r.end = size - 1;
+            }
+        }
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p != ',' && *p != '\0') {
+            return -1;
+        }
+
+        if (satisfiable) {
+            if (n == max_ranges) {
+                return -1;
+            }
+            for (i = n++; i > 0 && ranges[i - 1].start > r.start; i--) {
+                ranges[i] = ranges[i - 1];
+            }
+            ranges[i] = r;
+        }
+    }
+
+    for (i = 0, j = 1; j < n; j++) {
+        if (ranges[j].start <= ranges[i].end + 1) {
+            if (ranges[j].end > ranges[i].end) {
+                ranges[i].end = ranges[j].end;
+            }
+        } else {
+            ranges[++i] = ranges[j];
+        }
+    }
+
+    return n == 0 ? 0 : i + 1;
+}
+
 static void construct_etag(char *buf, size_t buf_len,
                            const struct file *filep)
 {
@@ -3861,6 +5966,33 @@ static void construct_etag(char *buf, size_t buf_len,
              (unsigned long) filep->modification_time, filep->size);
 }
 
+/* Return 1 unless an If-Range header says that the client's partial copy is
+   outdated, in which case the whole file is sent, see RFC 7233 section 3.2.
+   Entity tags are compared strongly, weak ones never match. */
+static int is_range_current(const struct mg_connection *conn,
+                            const struct file *filep)
+{
+    const char *if_range = mg_get_header_id(conn, HTTP_HEADER_IF_RANGE);
+    char etag[64];
+
+    if (if_range == NULL) {
+        return 1;
+    } else if (if_range[0] == '"') {
+        construct_etag(etag, sizeof(etag), filep);
+        return !strcmp(if_range, etag);
+    } else if (if_range[0] == 'W' && if_range[1] == '/') {
+        return 0;
+    }
+    return parse_date_string(if_range) == filep->modification_time;
+}
+
+/* Part header of a multipart/byteranges response */
+static const char range_part_fmt[] =
+    "\r\n--%s\r\n"
+    "Content-Type: %.*s\r\n"
+    "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT "\r\n"
+    "\r\n";
+
 static void fclose_on_exec(struct file *filep, struct mg_connection *conn)
 {
     if (filep != NULL && filep->fp != NULL) {
@@ -3875,78 +6007,548 @@ static void fclose_on_exec(struct file *filep, struct mg_connection *conn)
     }
 }
 
-static void handle_static_file_request(struct mg_connection *conn, const char *path, struct file *filep)
+/* Open a file for handle_static_file_request(), using a cached descriptor
+   if there is one. The size may change, it is the size of what is sent. */
+static int open_static_file(struct mg_connection *conn, const char *path,
+                            struct file *filep)
 {
-    char date[64], lm[64], etag[64], range[64];
-    const char *msg = "OK", *hdr;
-    time_t curtime = time(NULL);
-    int64_t cl, r1, r2;
-    struct vec mime_vec;
-    int n;
-    char gz_path[PATH_MAX];
-    const char *encoding = "";
-    const char *cors1, *cors2, *cors3;
-
-    get_mime_type(conn->ctx, path, &mime_vec);
-    cl = filep->size;
-    conn->status_code = 200;
-    range[0] = '\0';
-
-    /* if this file is in fact a pre-gzipped file, rewrite its filename
-       it's important to rewrite the filename after resolving
-       the mime type from it, to preserve the actual file's type */
-    if (filep->gzipped) {
-        snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
-        path = gz_path;
-        encoding = "Content-Encoding: gzip\r\n";
+#if defined(USE_FILE_CACHE)
+    if (conn->ctx->file_cache != NULL && filep->membuf == NULL &&
+        file_cache_open(conn, path, filep)) {
+        return 1;
     }
-
+#endif
     if (!mg_fopen(conn, path, "rb", filep)) {
-        send_http_error(conn, 500, http_500_error,
-                        "fopen(%s): %s", path, strerror(ERRNO));
-        return;
+        return 0;
     }
-
     fclose_on_exec(filep, conn);
 
-    /* If Range: header specified, act accordingly */
-    r1 = r2 = 0;
-    hdr = mg_get_header(conn, "Range");
-    if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0 &&
-        r1 >= 0 && r2 >= 0) {
-        /* actually, range requests don't play well with a pre-gzipped
-           file (since the range is specified in the uncompressed space) */
-        if (filep->gzipped) {
-            send_http_error(conn, 501, "Not Implemented", "range requests in gzipped files are not supported");
-            mg_fclose(filep);
-            return;
-        }
-        conn->status_code = 206;
-        cl = n == 2 ? (r2 > cl ? cl : r2) - r1 + 1: cl - r1;
-        mg_snprintf(conn, range, sizeof(range),
-                    "Content-Range: bytes "
-                    "%" INT64_FMT "-%"
-                    INT64_FMT "/%" INT64_FMT "\r\n",
-                    r1, r1 + cl - 1, filep->size);
-        msg = "Partial Content";
-    }
+    return 1;
+}
 
-    hdr = mg_get_header(conn, "Origin");
-    if (hdr) {
-        /* Cross-origin resource sharing (CORS), see http://www.html5rocks.com/en/tutorials/cors/,
-           http://www.html5rocks.com/static/images/cors_server_flowchart.png - preflight is not supported for files. */
-        cors1 = "Access-Control-Allow-Origin: ";
-        cors2 = conn->ctx->config[ACCESS_CONTROL_ALLOW_ORIGIN];
-        cors3 = "\r\n";
-    } else {
-        cors1 = cors2 = cors3 = "";
+#if defined(USE_FILE_CACHE)
+/* Send a complete 200 response for a file kept in memory by the file cache.
+   The headers that only depend on the file were prepared when the body was
+   read, so this is a single writev(). Return 0 if the response must be
+   built as usual. */
+static int send_cached_file(struct mg_connection *conn, struct file *filep)
+{
+    const struct file_cache_entry *e = filep->cached;
+    char head[256], tail[128], date[64];
+    const char *origin = "";
+    struct iovec iov[4];
+    int head_len, tail_len;
+    int64_t sent;
+
+    if (mg_get_header_id(conn, HTTP_HEADER_ORIGIN) != NULL) {
+        origin = conn->ctx->config[ACCESS_CONTROL_ALLOW_ORIGIN];
+    }
+    current_date_string(conn->ctx, date, sizeof(date));
+    head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n%s%s%s"
+                        "Date: %s\r\n", *origin ? "Access-Control-Allow-"
+                        "Origin: " : "", origin, *origin ? "\r\n" : "", date);
+    tail_len = snprintf(tail, sizeof(tail),
+                        "Content-Length: %" INT64_FMT "\r\n"
+                        "Connection: %s\r\n\r\n",
+                        e->body_len, suggest_connection_header(conn));
+    if (head_len < 0 || head_len >= (int) sizeof(head) ||
+        tail_len < 0 || tail_len >= (int) sizeof(tail)) {
+        return 0;
     }
 
-    /* Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
-       http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3 */
-    gmt_time_string(date, sizeof(date), &curtime);
-    gmt_time_string(lm, sizeof(lm), &filep->modification_time);
-    construct_etag(etag, sizeof(etag), filep);
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = e->headers;
+    iov[1].iov_len = e->headers_len;
+    iov[2].iov_base = tail;
+    iov[2].iov_len = tail_len;
+    iov[3].iov_base = e->body;
+    iov[3].iov_len = conn->request_info.method_id == HTTP_METHOD_HEAD ?
+                     0 : (size_t) e->body_len;
+
+    conn->status_code = 200;
+    if (!flush_output(conn)) {
+        return 1;
+    }
+    sent = push_iov(conn, iov, 4) - head_len - e->headers_len - tail_len;
+    if (sent > 0) {
+        conn->num_bytes_sent += sent;
+    }
+    return 1;
+}
+#endif
+
+#if defined(USE_ZLIB)
+static struct compression_cache *create_compression_cache(struct mg_context *ctx)
+{
+    struct compression_cache *cache;
+
+    if ((cache = (struct compression_cache *)
+                 mg_calloc(1, sizeof(*cache))) == NULL) {
+        return NULL;
+    }
+    cache->max_bytes = atoi(ctx->config[COMPRESSION_CACHE_SIZE]);
+    cache->num_buckets = (int) (cache->max_bytes / 4096);
+    cache->num_buckets = cache->num_buckets < 64 ? 64 :
+                         cache->num_buckets > 65536 ? 65536 :
+                         cache->num_buckets;
+    if ((cache->buckets = (struct compressed_file **)
+         mg_calloc(cache->num_buckets, sizeof(cache->buckets[0]))) == NULL) {
+        mg_free(cache);
+        return NULL;
+    }
+    (void) pthread_mutex_init(&cache->mutex, NULL);
+
+    return cache;
+}
+
+static void free_compressed_file(struct compressed_file *cf)
+{
+    mg_free(cf->data);
+    mg_free(cf->path);
+    mg_free(cf);
+}
+
+/* Must be called with the cache mutex held. Return 1 if the entry must be
+   freed by the caller. */
+static int unlink_compressed_file(struct compression_cache *cache,
+                                  struct compressed_file *cf)
+{
+    struct compressed_file **pp = &cache->buckets[cf->hash % cache->num_buckets];
+
+    while (*pp != cf) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = cf->hash_next;
+    if (cf->lru_prev != NULL) {
+        cf->lru_prev->lru_next = cf->lru_next;
+    } else {
+        cache->lru_head = cf->lru_next;
+    }
+    if (cf->lru_next != NULL) {
+        cf->lru_next->lru_prev = cf->lru_prev;
+    } else {
+        cache->lru_tail = cf->lru_prev;
+    }
+    cache->bytes -= cf->len;
+
+    return --cf->refs == 0;
+}
+
+/* Must be called with the cache mutex held */
+static struct compressed_file *find_compressed_file(
+    struct compression_cache *cache, uint32_t hash, int encoding,
+    const char *path)
+{
+    struct compressed_file *cf;
+
+    for (cf = cache->buckets[hash % cache->num_buckets]; cf != NULL;
+         cf = cf->hash_next) {
+        if (cf->hash == hash && cf->encoding == encoding &&
+            !strcmp(cf->path, path)) {
+            break;
+        }
+    }
+    return cf;
+}
+
+static void destroy_compression_cache(struct compression_cache *cache)
+{
+    struct compressed_file *cf;
+
+    while ((cf = cache->lru_head) != NULL) {
+        if (unlink_compressed_file(cache, cf)) {
+            free_compressed_file(cf);
+        }
+    }
+    (void) pthread_mutex_destroy(&cache->mutex);
+    mg_free(cache->buckets);
+    mg_free(cache);
+}
+
+static void release_compressed_file(struct compression_cache *cache,
+                                    struct compressed_file *cf)
+{
+    int refs;
+
+    (void) pthread_mutex_lock(&cache->mutex);
+    refs = --cf->refs;
+    (void) pthread_mutex_unlock(&cache->mutex);
+
+    if (refs == 0) {
+        free_compressed_file(cf);
+    }
+}
+
+/* Pick gzip or deflate, whichever the client prefers, gzip on a tie */
+static int choose_encoding(const struct mg_connection *conn)
+{
+    const char *hdr = mg_get_header_id(conn, HTTP_HEADER_ACCEPT_ENCODING);
+    int gzip, deflate;
+
+    if (hdr == NULL) {
+        return ENCODING_IDENTITY;
+    }
+    gzip = get_encoding_quality(hdr, "gzip");
+    deflate = get_encoding_quality(hdr, "deflate");
+    if (gzip > 0 && gzip >= deflate) {
+        return ENCODING_GZIP;
+    }
+    return deflate > 0 ? ENCODING_DEFLATE : ENCODING_IDENTITY;
+}
+
+/* Read a whole file opened by open_static_file() into buf */
+static int read_static_file(struct file *filep, char *buf, int64_t len)
+{
+    if (filep->membuf != NULL) {
+        memcpy(buf, filep->membuf, (size_t) len);
+        return 1;
+    }
+#if defined(USE_FILE_CACHE)
+    if (filep->cached != NULL) {
+        return pread(filep->cached->fd, buf, (size_t) len, 0) == (ssize_t) len;
+    }
+#endif
+    return filep->fp != NULL && fseeko(filep->fp, 0, SEEK_SET) == 0 &&
+           fread(buf, 1, (size_t) len, filep->fp) == (size_t) len;
+}
+
+/* Compress len bytes of src as gzip or zlib stream, NULL on failure */
+static char *compress_buffer(const char *src, int64_t len, int encoding,
+                             size_t *out_len)
+{
+    z_stream zs;
+    char *out = NULL;
+    uLong bound;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     encoding == ENCODING_GZIP ? 15 + 16 : 15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    bound = deflateBound(&zs, (uLong) len);
+    if ((out = (char *) mg_malloc(bound)) != NULL) {
+        zs.next_in = (Bytef *) src;
+        zs.avail_in = (uInt) len;
+        zs.next_out = (Bytef *) out;
+        zs.avail_out = (uInt) bound;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+            *out_len = zs.total_out;
+        } else {
+            mg_free(out);
+            out = NULL;
+        }
+    }
+    (void) deflateEnd(&zs);
+
+    return out;
+}
+
+/* Return the compressed variant of an opened static file to send instead
+   of the file, or NULL if the file is to be sent as it is. Each file is
+   compressed once per modification time, the result is kept within
+   compression_cache_size. The caller must release the result. */
+static struct compressed_file *get_compressed_file(struct mg_connection *conn,
+                                                   const char *path,
+                                                   struct file *filep,
+                                                   const struct vec *mime_vec)
+{
+    struct compression_cache *cache = conn->ctx->compression_cache;
+    struct compressed_file *cf, *other, *stale = NULL, *evicted = NULL;
+    uint32_t hash = header_hash(path);
+    char mime[128], *content;
+    int encoding, ok = 0;
+
+    if (cache == NULL || filep->gzipped ||
+        filep->size < COMPRESSION_MIN_FILE_SIZE ||
+        filep->size > COMPRESSION_MAX_FILE_SIZE ||
+        mg_get_header_id(conn, HTTP_HEADER_RANGE) != NULL ||
+        mime_vec->len >= sizeof(mime) ||
+        (encoding = choose_encoding(conn)) == ENCODING_IDENTITY) {
+        return NULL;
+    }
+    memcpy(mime, mime_vec->ptr, mime_vec->len);
+    mime[mime_vec->len] = '\0';
+    if (match_pattern(&conn->ctx->cfg.compression_mime_types, mime) <= 0) {
+        return NULL;
+    }
+
+    (void) pthread_mutex_lock(&cache->mutex);
+    cf = find_compressed_file(cache, hash, encoding, path);
+    if (cf != NULL && (cf->modification_time != filep->modification_time ||
+                       cf->size != filep->size)) {
+        /* Changed since it was compressed */
+        if (unlink_compressed_file(cache, cf)) {
+            evicted = cf;
+        }
+        cf = NULL;
+    } else if (cf != NULL) {
+        if (cf != cache->lru_head) {
+            cf->lru_prev->lru_next = cf->lru_next;
+            if (cf->lru_next != NULL) {
+                cf->lru_next->lru_prev = cf->lru_prev;
+            } else {
+                cache->lru_tail = cf->lru_prev;
+            }
+            cf->lru_prev = NULL;
+            cf->lru_next = cache->lru_head;
+            cache->lru_head->lru_prev = cf;
+            cache->lru_head = cf;
+        }
+        cf->refs++;
+    }
+    (void) pthread_mutex_unlock(&cache->mutex);
+    if (evicted != NULL) {
+        free_compressed_file(evicted);
+    }
+    if (cf != NULL) {
+        if (cf->data == NULL) {
+            release_compressed_file(cache, cf);
+            return NULL;
+        }
+        return cf;
+    }
+
+    /* Compress outside of the lock. Requests racing for the same file
+       compress it twice, but only the first result is kept. */
+    if ((cf = (struct compressed_file *) mg_calloc(1, sizeof(*cf))) == NULL ||
+        (cf->path = mg_strdup(path)) == NULL ||
+        (content = (char *) mg_malloc((size_t) filep->size)) == NULL) {
+        if (cf != NULL) {
+            mg_free(cf->path);
+        }
+        mg_free(cf);
+        return NULL;
+    }
+    cf->hash = hash;
+    cf->modification_time = filep->modification_time;
+    cf->size = filep->size;
+    cf->encoding = encoding;
+    cf->refs = 2;
+    if (read_static_file(filep, content, filep->size)) {
+        cf->data = compress_buffer(content, filep->size, encoding, &cf->len);
+        ok = cf->data != NULL;
+    }
+    mg_free(content);
+    if (!ok) {
+        /* Out of memory or a read error: try again next time */
+        free_compressed_file(cf);
+        return NULL;
+    }
+    if ((int64_t) cf->len >= filep->size) {
+        /* Already compressed, remember not to try again */
+        mg_free(cf->data);
+        cf->data = NULL;
+        cf->len = 0;
+    }
+
+    (void) pthread_mutex_lock(&cache->mutex);
+    other = find_compressed_file(cache, hash, encoding, path);
+    if (other != NULL && other->modification_time == cf->modification_time &&
+        other->size == cf->size) {
+        /* Another request was faster, use its result */
+        other->refs++;
+        (void) pthread_mutex_unlock(&cache->mutex);
+        free_compressed_file(cf);
+        if (other->data == NULL) {
+            release_compressed_file(cache, other);
+            return NULL;
+        }
+        return other;
+    } else if (other != NULL && unlink_compressed_file(cache, other)) {
+        /* Changed since the other request compressed it */
+        stale = other;
+    }
+    if ((int64_t) cf->len <= cache->max_bytes) {
+        cf->hash_next = cache->buckets[hash % cache->num_buckets];
+        cache->buckets[hash % cache->num_buckets] = cf;
+        cf->lru_next = cache->lru_head;
+        if (cache->lru_head != NULL) {
+            cache->lru_head->lru_prev = cf;
+        } else {
+            cache->lru_tail = cf;
+        }
+        cache->lru_head = cf;
+        cache->bytes += cf->len;
+        while (cache->bytes > cache->max_bytes) {
+            evicted = cache->lru_tail;
+            if (unlink_compressed_file(cache, evicted)) {
+                evicted->hash_next = NULL;
+                (void) pthread_mutex_unlock(&cache->mutex);
+                free_compressed_file(evicted);
+                (void) pthread_mutex_lock(&cache->mutex);
+            }
+        }
+    } else {
+        cf->refs--;
+    }
+    (void) pthread_mutex_unlock(&cache->mutex);
+    if (stale != NULL) {
+        free_compressed_file(stale);
+    }
+
+    if (cf->data == NULL) {
+        release_compressed_file(cache, cf);
+        return NULL;
+    }
+    return cf;
+}
+#endif
+
+static void handle_static_file_request(struct mg_connection *conn, const char *path, struct file *filep)
+{
+    char date[64], lm[64], etag[64], range[64];
+    const char *msg = "OK", *hdr;
+    int64_t cl, r1;
+    struct vec mime_vec;
+    char gz_path[PATH_MAX];
+    const char *encoding = "";
+    const char *cors1, *cors2, *cors3;
+    const char *mime_path = path;
+    struct byte_range ranges[MAX_RANGES];
+    int num_ranges = -1, i;
+    char boundary[64], multipart_type[96];
+    struct vec part_mime = {NULL, 0};
+#if defined(USE_ZLIB)
+    struct compressed_file *cf = NULL;
+    int n;
+#endif
+
+    conn->status_code = 200;
+    range[0] = '\0';
+
+    /* if this file is in fact a pre-gzipped file, rewrite its filename
+       the mime type is still resolved from mime_path, to preserve the
+       actual file's type */
+    if (filep->gzipped) {
+        snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+        path = gz_path;
+        encoding = "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+    }
+
+    if (!open_static_file(conn, path, filep)) {
+        send_http_error(conn, 500, http_500_error,
+                        "fopen(%s): %s", path, strerror(ERRNO));
+        return;
+    }
+    cl = filep->size;
+
+#if defined(USE_FILE_CACHE)
+    if (filep->cached != NULL && !filep->gzipped) {
+        mime_vec = filep->cached->mime;
+    } else {
+        get_mime_type(conn->ctx, mime_path, &mime_vec);
+    }
+#else
+    get_mime_type(conn->ctx, mime_path, &mime_vec);
+#endif
+
+#if defined(USE_ZLIB)
+    if ((cf = get_compressed_file(conn, path, filep, &mime_vec)) != NULL) {
+        encoding = cf->encoding == ENCODING_GZIP ?
+                   "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" :
+                   "Content-Encoding: deflate\r\nVary: Accept-Encoding\r\n";
+        cl = (int64_t) cf->len;
+    }
+#endif
+
+#if defined(USE_FILE_CACHE)
+    if (conn->ctx->file_cache != NULL &&
+        conn->ctx->file_cache->max_body_bytes > 0) {
+        conn->stats[filep->cached != NULL && filep->membuf != NULL ?
+                    STAT_STATIC_CACHE_HITS : STAT_STATIC_CACHE_MISSES]++;
+    }
+    if (filep->cached != NULL && filep->membuf != NULL && !filep->gzipped &&
+#if defined(USE_ZLIB)
+        cf == NULL &&
+#endif
+        mg_get_header_id(conn, HTTP_HEADER_RANGE) == NULL &&
+        send_cached_file(conn, filep)) {
+        mg_fclose(filep);
+        return;
+    }
+#endif
+
+    /* If Range: header specified, act accordingly */
+    r1 = 0;
+    hdr = mg_get_header_id(conn, HTTP_HEADER_RANGE);
+    if (hdr != NULL && is_range_current(conn, filep) &&
+        (num_ranges = parse_range_set(hdr, filep->size, ranges,
+                                      MAX_RANGES)) >= 0) {
+        /* actually, range requests don't play well with a pre-gzipped
+           file (since the range is specified in the uncompressed space) */
+        if (filep->gzipped) {
+            send_http_error(conn, 501, "Not Implemented", "range requests in gzipped files are not supported");
+            mg_fclose(filep);
+            return;
+        }
+        if (num_ranges == 0) {
+            conn->status_code = 416;
+            current_date_string(conn->ctx, date, sizeof(date));
+            mg_printf(conn, "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+                      "Date: %s\r\n"
+                      "Content-Range: bytes */%" INT64_FMT "\r\n"
+                      "Content-Length: 0\r\n"
+                      "Connection: %s\r\n\r\n",
+                      date, filep->size, suggest_connection_header(conn));
+            mg_fclose(filep);
+            return;
+        }
+        conn->status_code = 206;
+        msg = "Partial Content";
+        if (num_ranges == 1) {
+            r1 = ranges[0].start;
+            cl = ranges[0].end - ranges[0].start + 1;
+            mg_snprintf(conn, range, sizeof(range),
+                        "Content-Range: bytes "
+                        "%" INT64_FMT "-%"
+                        INT64_FMT "/%" INT64_FMT "\r\n",
+                        r1, ranges[0].end, filep->size);
+        } else {
+            /* The parts are sent straight from the file, so the length of
+               the whole body is worked out up front */
+            snprintf(boundary, sizeof(boundary), "%lx%" INT64_FMT,
+                     (unsigned long) filep->modification_time,
+                     get_monotonic_usec());
+            part_mime = mime_vec;
+            cl = (int64_t) strlen(boundary) + 8;
+            for (i = 0; i < num_ranges; i++) {
+                cl += snprintf(NULL, 0, range_part_fmt, boundary,
+                               (int) part_mime.len, part_mime.ptr,
+                               ranges[i].start, ranges[i].end, filep->size);
+                cl += ranges[i].end - ranges[i].start + 1;
+            }
+            mime_vec.len = snprintf(multipart_type, sizeof(multipart_type),
+                                    "multipart/byteranges; boundary=%s",
+                                    boundary);
+            mime_vec.ptr = multipart_type;
+        }
+    }
+
+    hdr = mg_get_header_id(conn, HTTP_HEADER_ORIGIN);
+    if (hdr) {
+        /* Cross-origin resource sharing (CORS), see http://www.html5rocks.com/en/tutorials/cors/,
+           http://www.html5rocks.com/static/images/cors_server_flowchart.png - preflight is not supported for files. */
+        cors1 = "Access-Control-Allow-Origin: ";
+        cors2 = conn->ctx->config[ACCESS_CONTROL_ALLOW_ORIGIN];
+        cors3 = "\r\n";
+    } else {
+        cors1 = cors2 = cors3 = "";
+    }
+
+    /* Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
+       http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3 */
+    current_date_string(conn->ctx, date, sizeof(date));
+    last_modified_string(lm, sizeof(lm), filep);
+    construct_etag(etag, sizeof(etag), filep);
+#if defined(USE_ZLIB)
+    if (cf != NULL && (n = (int) strlen(etag)) > 1) {
+        /* A different representation needs a different entity tag */
+        snprintf(etag + n - 1, sizeof(etag) - n + 1, "-%s\"",
+                 cf->encoding == ENCODING_GZIP ? "gzip" : "deflate");
+    }
+#endif
 
     (void) mg_printf(conn,
                      "HTTP/1.1 %d %s\r\n"
@@ -3964,7 +6566,29 @@ static void handle_static_file_request(struct mg_connection *conn, const char *p
                      date, lm, etag, (int) mime_vec.len,
                      mime_vec.ptr, cl, suggest_connection_header(conn), range, encoding);
 
-    if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
+#if defined(USE_ZLIB)
+    if (cf != NULL) {
+        if (conn->request_info.method_id != HTTP_METHOD_HEAD &&
+            (n = mg_write(conn, cf->data, cf->len)) > 0) {
+            conn->num_bytes_sent += n;
+        }
+        release_compressed_file(conn->ctx->compression_cache, cf);
+        mg_fclose(filep);
+        return;
+    }
+#endif
+    if (conn->request_info.method_id == HTTP_METHOD_HEAD) {
+        /* Headers only */
+    } else if (num_ranges > 1) {
+        for (i = 0; i < num_ranges; i++) {
+            mg_printf(conn, range_part_fmt, boundary, (int) part_mime.len,
+                      part_mime.ptr, ranges[i].start, ranges[i].end,
+                      filep->size);
+            send_file_data(conn, filep, ranges[i].start,
+                           ranges[i].end - ranges[i].start + 1);
+        }
+        mg_printf(conn, "\r\n--%s--\r\n", boundary);
+    } else {
         send_file_data(conn, filep, r1, cl);
     }
     mg_fclose(filep);
@@ -3981,39 +6605,56 @@ void mg_send_file(struct mg_connection *conn, const char *path)
 }
 
 
-/* Parse HTTP headers from the given buffer, advance buffer to the point
-   where parsing stopped. */
-static void parse_http_headers(char **buf, struct mg_request_info *ri)
+/* NUL-terminate a line recorded by scan_request(), return its start */
+static char *terminate_line(char *buf, const struct request_scan *st, int line)
 {
-    int i;
+    int start = line == 0 ? st->first : st->line_end[line - 1] + 1;
+    int end = st->line_end[line];
 
-    for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
-        ri->http_headers[i].name = skip_quoted(buf, ":", " ", 0);
-        ri->http_headers[i].value = skip(buf, "\r\n");
-        if (ri->http_headers[i].name[0] == '\0')
-            break;
-        ri->num_headers = i + 1;
+    buf[end] = '\0';
+    if (end > start && buf[end - 1] == '\r') {
+        buf[end - 1] = '\0';
     }
+    return buf + start;
 }
 
-#ifndef RGW
-static int is_valid_http_method(const char *method)
+/* Parse the HTTP headers found by scan_request(), starting with the given
+   line. Lines without a colon are taken as a header name without value. */
+static void parse_http_headers(char *buf, const struct request_scan *st,
+                               int first_line, struct mg_request_info *ri)
 {
-    return !strcmp(method, "GET") || !strcmp(method, "POST") ||
-           !strcmp(method, "HEAD") || !strcmp(method, "CONNECT") ||
-           !strcmp(method, "PUT") || !strcmp(method, "DELETE") ||
-           !strcmp(method, "OPTIONS") || !strcmp(method, "PROPFIND")
-           || !strcmp(method, "MKCOL")
-           ;
+    char *name, *value;
+    int line;
+
+    ri->num_headers = 0;
+    for (line = first_line; line < st->num_lines &&
+         ri->num_headers < (int) ARRAY_SIZE(ri->http_headers); line++) {
+        name = terminate_line(buf, st, line);
+        if (st->colon[line] < 0) {
+            value = name + strlen(name);
+        } else {
+            buf[st->colon[line]] = '\0';
+            for (value = buf + st->colon[line] + 1; *value == ' '; value++) {
+            }
+        }
+        if (name[0] == '\0')
+            break;
+        ri->http_headers[ri->num_headers].name = name;
+        ri->http_headers[ri->num_headers].value = value;
+        ri->num_headers++;
+    }
 }
-#endif
 
-/* Parse HTTP request, fill in mg_request_info structure.
-   This function modifies the buffer by NUL-terminating
+/* Parse HTTP request scanned by scan_request(), fill in mg_request_info
+   structure. This function modifies the buffer by NUL-terminating
    HTTP request components, header names and header values. */
-static int parse_http_message(char *buf, int len, struct mg_request_info *ri)
+static int parse_scanned_message(char *buf, int request_length,
+                                 const struct request_scan *st,
+                                 struct mg_request_info *ri)
 {
-    int is_request, request_length = get_request_len(buf, len);
+    char *line;
+    int is_request;
+
     if (request_length > 0) {
         /* Reset attributes. DO NOT TOUCH is_ssl, remote_ip, remote_port */
         ri->remote_user = ri->request_method = ri->uri = ri->http_version = NULL;
@@ -4021,18 +6662,21 @@ static int parse_http_message(char *buf, int len, struct mg_request_info *ri)
 
         buf[request_length - 1] = '\0';
 
-        /* RFC says that all initial whitespaces should be ingored */
-        while (*buf != '\0' && isspace(* (unsigned char *) buf)) {
-            buf++;
+        /* RFC says that all initial whitespaces should be ingored,
+           scan_request() has skipped them */
+        if (st->num_lines <= 0) {
+            return -1;
         }
-        ri->request_method = skip(&buf, " ");
-        ri->uri = skip(&buf, " ");
-        ri->http_version = skip(&buf, "\r\n");
+        line = terminate_line(buf, st, 0);
+        ri->request_method = skip(&line, " ");
+        ri->uri = skip(&line, " ");
+        ri->http_version = skip(&line, "\r\n");
+        ri->method_id = get_method_id(ri->request_method);
 
         /* HTTP message could be either HTTP request or HTTP response, e.g.
            "GET / HTTP/1.0 ...." or  "HTTP/1.0 200 OK ..." */
 #ifndef RGW
-        is_request = is_valid_http_method(ri->request_method);
+        is_request = ri->method_id != HTTP_METHOD_OTHER;
         if ((is_request && memcmp(ri->http_version, "HTTP/", 5) != 0) ||
             (!is_request && memcmp(ri->request_method, "HTTP/", 5) != 0)) {
             request_length = -1;
@@ -4040,7 +6684,7 @@ static int parse_http_message(char *buf, int len, struct mg_request_info *ri)
             if (is_request) {
                 ri->http_version += 5;
             }
-            parse_http_headers(&buf, ri);
+            parse_http_headers(buf, st, 1, ri);
         }
 #else
 	is_request = (memcmp(ri->http_version, "HTTP/", 5) == 0);
@@ -4048,7 +6692,7 @@ static int parse_http_message(char *buf, int len, struct mg_request_info *ri)
 	    ri->http_version += 5;
 	}
 	if (is_request || memcmp(ri->request_method, "HTTP/", 5) == 0) {
-            parse_http_headers(&buf, ri);
+            parse_http_headers(buf, st, 1, ri);
 	} else {
             request_length = -1;
 	}
@@ -4061,19 +6705,22 @@ static int parse_http_message(char *buf, int len, struct mg_request_info *ri)
    or SSL descriptor ssl) into buffer buf, until \r\n\r\n appears in the
    buffer (which marks the end of HTTP request). Buffer buf may already
    have some data. The length of the data is stored in nread.
-   Upon every read operation, increase nread by the number of bytes read. */
+   Upon every read operation, increase nread by the number of bytes read.
+   The scan state st is ready for parse_scanned_message() afterwards. */
 static int read_request(FILE *fp, struct mg_connection *conn,
-                        char *buf, int bufsiz, int *nread)
+                        char *buf, int bufsiz, int *nread,
+                        struct request_scan *st)
 {
     int request_len, n = 0;
 
-    request_len = get_request_len(buf, *nread);
+    init_request_scan(st);
+    request_len = scan_request(buf, *nread, st);
     while (conn->ctx->stop_flag == 0 &&
            *nread < bufsiz && request_len == 0 &&
            (n = pull(fp, conn, buf + *nread, bufsiz - *nread)) > 0) {
         *nread += n;
         assert(*nread <= bufsiz);
-        request_len = get_request_len(buf, *nread);
+        request_len = scan_request(buf, *nread, st);
     }
 
     return request_len <= 0 && n <= 0 ? -1 : request_len;
@@ -4132,8 +6779,8 @@ static int is_not_modified(const struct mg_connection *conn,
                            const struct file *filep)
 {
     char etag[64];
-    const char *ims = mg_get_header(conn, "If-Modified-Since");
-    const char *inm = mg_get_header(conn, "If-None-Match");
+    const char *ims = mg_get_header_id(conn, HTTP_HEADER_IF_MODIFIED_SINCE);
+    const char *inm = mg_get_header_id(conn, HTTP_HEADER_IF_NONE_MATCH);
     construct_etag(etag, sizeof(etag), filep);
     return (inm != NULL && !mg_strcasecmp(etag, inm)) ||
            (ims != NULL && filep->modification_time <= parse_date_string(ims));
@@ -4146,7 +6793,7 @@ static int forward_body_data(struct mg_connection *conn, FILE *fp,
     char buf[MG_BUF_LEN];
     int to_read, nread, buffered_len, success = 0;
 
-    expect = mg_get_header(conn, "Expect");
+    expect = mg_get_header_id(conn, HTTP_HEADER_EXPECT);
     assert(fp != NULL);
 
     if (conn->content_len == -1 && !conn->is_chunked) {
@@ -4295,13 +6942,13 @@ static void prepare_cgi_environment(struct mg_connection *conn,
     addenv(blk, "PATH_TRANSLATED=%s", prog);
     addenv(blk, "HTTPS=%s", conn->ssl == NULL ? "off" : "on");
 
-    if ((s = mg_get_header(conn, "Content-Type")) != NULL)
+    if ((s = mg_get_header_id(conn, HTTP_HEADER_CONTENT_TYPE)) != NULL)
         addenv(blk, "CONTENT_TYPE=%s", s);
 
     if (conn->request_info.query_string != NULL)
         addenv(blk, "QUERY_STRING=%s", conn->request_info.query_string);
 
-    if ((s = mg_get_header(conn, "Content-Length")) != NULL)
+    if ((s = mg_get_header_id(conn, HTTP_HEADER_CONTENT_LENGTH)) != NULL)
         addenv(blk, "CONTENT_LENGTH=%s", s);
 
     if ((s = getenv("PATH")) != NULL)
@@ -4379,8 +7026,9 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog)
     size_t buflen;
     int headers_len, data_len, i, fdin[2] = { 0, 0 }, fdout[2] = { 0, 0 };
     const char *status, *status_text, *connection_state;
-    char *pbuf, dir[PATH_MAX], *p;
+    char dir[PATH_MAX], *p;
     struct mg_request_info ri;
+    struct request_scan scan;
     struct cgi_env_block blk;
     FILE *in = NULL, *out = NULL;
     struct file fout = STRUCT_FILE_INITIALIZER;
@@ -4441,7 +7089,7 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog)
     fout.fp = out;
 
     /* Send POST data to the CGI process if needed */
-    if (!strcmp(conn->request_info.request_method, "POST") &&
+    if (conn->request_info.method_id == HTTP_METHOD_POST &&
         !forward_body_data(conn, in, INVALID_SOCKET, NULL)) {
         goto done;
     }
@@ -4463,7 +7111,7 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog)
                         (unsigned int) buflen);
         goto done;
     }
-    headers_len = read_request(out, conn, buf, (int) buflen, &data_len);
+    headers_len = read_request(out, conn, buf, (int) buflen, &data_len, &scan);
     if (headers_len <= 0) {
         send_http_error(conn, 500, http_500_error,
                         "CGI program sent malformed or too big (>%u bytes) "
@@ -4471,9 +7119,8 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog)
                         (unsigned) buflen, data_len, buf);
         goto done;
     }
-    pbuf = buf;
     buf[headers_len - 1] = '\0';
-    parse_http_headers(&pbuf, &ri);
+    parse_http_headers(buf, &scan, 0, &ri);
 
     /* Make up and send the status line */
     status_text = "OK";
@@ -4544,6 +7191,33 @@ done:
 }
 #endif /* !NO_CGI */
 
+/* Forget what the file cache knows about a path after changing it, the
+   inotify event may arrive only after the next request */
+static void file_changed(struct mg_connection *conn, const char *path)
+{
+#if defined(USE_FILE_CACHE)
+    if (conn->ctx->file_cache != NULL) {
+        invalidate_file_cache_entry(conn->ctx->file_cache, path);
+    }
+#else
+    (void) conn;
+    (void) path;
+#endif
+}
+
+/* Like file_changed(), for a removed directory and everything below it */
+static void directory_removed(struct mg_connection *conn, const char *path)
+{
+#if defined(USE_FILE_CACHE)
+    if (conn->ctx->file_cache != NULL) {
+        invalidate_file_cache_tree(conn->ctx->file_cache, path);
+    }
+#else
+    (void) conn;
+    (void) path;
+#endif
+}
+
 /* For a given PUT path, create all intermediate subdirectories
    for given path. Return 0 if the path itself is a directory,
    or -1 on error, 1 if OK. */
@@ -4565,9 +7239,12 @@ static int put_dir(struct mg_connection *conn, const char *path)
 
         /* Try to create intermediate directory */
         DEBUG_TRACE("mkdir(%s)", buf);
-        if (!mg_stat(conn, buf, &file) && mg_mkdir(buf, 0755) != 0) {
-            res = -1;
-            break;
+        if (!mg_stat(conn, buf, &file)) {
+            if (mg_mkdir(buf, 0755) != 0) {
+                res = -1;
+                break;
+            }
+            file_changed(conn, buf);
         }
 
         /* Is path itself a directory? */
@@ -4584,7 +7261,6 @@ static void mkcol(struct mg_connection *conn, const char *path)
     int rc, body_len;
     struct de de;
     char date[64];
-    time_t curtime = time(NULL);
 
     memset(&de.file, 0, sizeof(de.file));
     if (!mg_stat(conn, path, &de.file)) {
@@ -4608,8 +7284,9 @@ static void mkcol(struct mg_connection *conn, const char *path)
     rc = mg_mkdir(path, 0755);
 
     if (rc == 0) {
+        file_changed(conn, path);
         conn->status_code = 201;
-        gmt_time_string(date, sizeof(date), &curtime);
+        current_date_string(conn->ctx, date, sizeof(date));
         mg_printf(conn, "HTTP/1.1 %d Created\r\nDate: %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
                   conn->status_code, date, suggest_connection_header(conn));
     } else if (rc == -1) {
@@ -4635,12 +7312,11 @@ static void put_file(struct mg_connection *conn, const char *path)
     int64_t r1, r2;
     int rc;
     char date[64];
-    time_t curtime = time(NULL);
 
     conn->status_code = mg_stat(conn, path, &file) ? 200 : 201;
 
     if ((rc = put_dir(conn, path)) == 0) {
-        gmt_time_string(date, sizeof(date), &curtime);
+        current_date_string(conn->ctx, date, sizeof(date));
         mg_printf(conn, "HTTP/1.1 %d OK\r\nDate: %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
                   conn->status_code, date, suggest_connection_header(conn));
     } else if (rc == -1) {
@@ -4652,7 +7328,7 @@ static void put_file(struct mg_connection *conn, const char *path)
                         "fopen(%s): %s", path, strerror(ERRNO));
     } else {
         fclose_on_exec(&file, conn);
-        range = mg_get_header(conn, "Content-Range");
+        range = mg_get_header_id(conn, HTTP_HEADER_CONTENT_RANGE);
         r1 = r2 = 0;
         if (range != NULL && parse_range_header(range, &r1, &r2) > 0) {
             conn->status_code = 206;
@@ -4661,7 +7337,9 @@ static void put_file(struct mg_connection *conn, const char *path)
         if (!forward_body_data(conn, file.fp, INVALID_SOCKET, NULL)) {
             conn->status_code = 500;
         }
-        gmt_time_string(date, sizeof(date), &curtime);
+        fflush(file.fp);
+        file_changed(conn, path);
+        current_date_string(conn->ctx, date, sizeof(date));
         mg_printf(conn, "HTTP/1.1 %d OK\r\nDate: %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
                   conn->status_code, date, suggest_connection_header(conn));
         mg_fclose(&file);
@@ -4711,8 +7389,7 @@ static void do_ssi_include(struct mg_connection *conn, const char *ssi,
                tag, path, strerror(ERRNO));
     } else {
         fclose_on_exec(&file, conn);
-        if (match_prefix(conn->ctx->config[SSI_EXTENSIONS],
-                         (int)strlen(conn->ctx->config[SSI_EXTENSIONS]), path) > 0) {
+        if (match_pattern(&conn->ctx->cfg.ssi_pattern, path) > 0) {
             send_ssi_file(conn, path, &file, include_level + 1);
         } else {
             send_file_data(conn, &file, 0, INT64_MAX);
@@ -4821,10 +7498,9 @@ static void handle_ssi_file_request(struct mg_connection *conn,
 {
     struct file file = STRUCT_FILE_INITIALIZER;
     char date[64];
-    time_t curtime = time(NULL);
     const char *cors1, *cors2, *cors3;
 
-    if (mg_get_header(conn, "Origin")) {
+    if (mg_get_header_id(conn, HTTP_HEADER_ORIGIN)) {
         /* Cross-origin resource sharing (CORS). */
         cors1 = "Access-Control-Allow-Origin: ";
         cors2 = conn->ctx->config[ACCESS_CONTROL_ALLOW_ORIGIN];
@@ -4838,7 +7514,7 @@ static void handle_ssi_file_request(struct mg_connection *conn,
                         strerror(ERRNO));
     } else {
         conn->must_close = 1;
-        gmt_time_string(date, sizeof(date), &curtime);
+        current_date_string(conn->ctx, date, sizeof(date));
         fclose_on_exec(&file, conn);
         mg_printf(conn, "HTTP/1.1 200 OK\r\n"
                         "%s%s%s"
@@ -4855,11 +7531,10 @@ static void handle_ssi_file_request(struct mg_connection *conn,
 static void send_options(struct mg_connection *conn)
 {
     char date[64];
-    time_t curtime = time(NULL);
 
     conn->status_code = 200;
     conn->must_close = 1;
-    gmt_time_string(date, sizeof(date), &curtime);
+    current_date_string(conn->ctx, date, sizeof(date));
 
     mg_printf(conn, "HTTP/1.1 200 OK\r\n"
                     "Date: %s\r\n"
@@ -4907,11 +7582,10 @@ static void print_dav_dir_entry(struct de *de, void *data)
 static void handle_propfind(struct mg_connection *conn, const char *path,
                             struct file *filep)
 {
-    const char *depth = mg_get_header(conn, "Depth");
+    const char *depth = mg_get_header_id(conn, HTTP_HEADER_DEPTH);
     char date[64];
-    time_t curtime = time(NULL);
 
-    gmt_time_string(date, sizeof(date), &curtime);
+    current_date_string(conn->ctx, date, sizeof(date));
 
     conn->must_close = 1;
     conn->status_code = 207;
@@ -4930,7 +7604,7 @@ static void handle_propfind(struct mg_connection *conn, const char *path,
 
     /* If it is a directory, print directory entries too if Depth is not 0 */
     if (filep->is_directory &&
-        !mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes") &&
+        conn->ctx->cfg.directory_listing &&
         (depth == NULL || strcmp(depth, "0") != 0)) {
         scan_directory(conn, path, conn, &print_dav_dir_entry);
     }
@@ -5175,7 +7849,7 @@ static void send_websocket_handshake(struct mg_connection *conn)
     SHA1_CTX sha_ctx;
 
     mg_snprintf(conn, buf, sizeof(buf), "%s%s",
-                mg_get_header(conn, "Sec-WebSocket-Key"), magic);
+                mg_get_header_id(conn, HTTP_HEADER_SEC_WEBSOCKET_KEY), magic);
     SHA1Init(&sha_ctx);
     SHA1Update(&sha_ctx, (unsigned char *) buf, (uint32_t)strlen(buf));
     SHA1Final((unsigned char *) sha, &sha_ctx);
@@ -5187,6 +7861,16 @@ static void send_websocket_handshake(struct mg_connection *conn)
               "Sec-WebSocket-Accept: ", b64_sha, "\r\n\r\n");
 }
 
+/* mg_websocket_write() may run on any thread, while stats are only written
+   by the worker owning the connection. Move its count over to them. */
+static void count_websocket_frames_out(struct mg_connection *conn)
+{
+    mg_lock_connection(conn);
+    conn->stats[STAT_WEBSOCKET_FRAMES_OUT] += conn->websocket_frames_out;
+    conn->websocket_frames_out = 0;
+    mg_unlock_connection(conn);
+}
+
 static void read_websocket(struct mg_connection *conn)
 {
     /* Pointer to the beginning of the portion of the incoming websocket
@@ -5294,6 +7978,9 @@ static void read_websocket(struct mg_connection *conn)
                 conn->data_len -= (int)len;
             }
 
+            conn->stats[STAT_WEBSOCKET_FRAMES_IN]++;
+            count_websocket_frames_out(conn);
+
             /* Apply mask if necessary */
             if (mask_len > 0) {
                 for (i = 0; i < data_len; ++i) {
@@ -5331,6 +8018,7 @@ static void read_websocket(struct mg_connection *conn)
             conn->data_len += n;
         }
     }
+    count_websocket_frames_out(conn);
 }
 
 int mg_websocket_write(struct mg_connection* conn, int opcode, const char* data, size_t dataLen)
@@ -5368,6 +8056,7 @@ int mg_websocket_write(struct mg_connection* conn, int opcode, const char* data,
     (void) mg_lock_connection(conn);
     retval = mg_write(conn, header, headerLen);
     retval = mg_write(conn, data, dataLen);
+    conn->websocket_frames_out++;
     mg_unlock_connection(conn);
 
     return retval;
@@ -5375,13 +8064,16 @@ int mg_websocket_write(struct mg_connection* conn, int opcode, const char* data,
 
 static void handle_websocket_request(struct mg_connection *conn, const char *path, int is_script_resource)
 {
-    const char *version = mg_get_header(conn, "Sec-WebSocket-Version");
+    const char *version = mg_get_header_id(conn, HTTP_HEADER_SEC_WEBSOCKET_VERSION);
 #ifdef USE_LUA
     int lua_websock = 0;
     /* TODO: A websocket script may be shared between several clients, allowing them to communicate
              directly instead of writing to a data base and polling the data base. */
 #endif
 
+    /* Frames are written as they come, possibly from other threads */
+    end_output_buffering(conn);
+
     if (version == NULL || strcmp(version, "13") != 0) {
         send_http_error(conn, 426, "Upgrade Required", "%s", "Upgrade Required");
     } else if (conn->ctx->callbacks.websocket_connect != NULL &&
@@ -5390,11 +8082,8 @@ static void handle_websocket_request(struct mg_connection *conn, const char *pat
         /* The C callback is called before Lua and may prevent Lua from handling the websocket. */
     } else {
 #ifdef USE_LUA
-        if (conn->ctx->config[LUA_WEBSOCKET_EXTENSIONS]) {
-            lua_websock = match_prefix(conn->ctx->config[LUA_WEBSOCKET_EXTENSIONS],
-                                       (int)strlen(conn->ctx->config[LUA_WEBSOCKET_EXTENSIONS]),
-                                       path);
-        }
+        lua_websock = match_pattern(&conn->ctx->cfg.lua_websocket_pattern,
+                                    path) > 0;
 
         if (lua_websock) {
             conn->lua_websocket_state = lua_websocket_new(path, conn);
@@ -5421,11 +8110,11 @@ static int is_websocket_request(const struct mg_connection *conn)
 {
     const char *host, *upgrade, *connection, *version, *key;
 
-    host = mg_get_header(conn, "Host");
-    upgrade = mg_get_header(conn, "Upgrade");
-    connection = mg_get_header(conn, "Connection");
-    key = mg_get_header(conn, "Sec-WebSocket-Key");
-    version = mg_get_header(conn, "Sec-WebSocket-Version");
+    host = mg_get_header_id(conn, HTTP_HEADER_HOST);
+    upgrade = mg_get_header_id(conn, HTTP_HEADER_UPGRADE);
+    connection = mg_get_header_id(conn, HTTP_HEADER_CONNECTION);
+    key = mg_get_header_id(conn, HTTP_HEADER_SEC_WEBSOCKET_KEY);
+    version = mg_get_header_id(conn, HTTP_HEADER_SEC_WEBSOCKET_VERSION);
 
     return host != NULL && upgrade != NULL && connection != NULL &&
            key != NULL && version != NULL &&
@@ -5455,33 +8144,28 @@ static int parse_net(const char *spec, uint32_t *net, uint32_t *mask)
     return len;
 }
 
-static int set_throttle(const char *spec, uint32_t remote_ip, const char *uri)
+/* Return the rate of the last matching throttle rule. If shared is not NULL,
+   it is set to the rule's shared bucket, or NULL. */
+static int set_throttle(const struct mg_context *ctx, uint32_t remote_ip,
+                        const char *uri, struct token_bucket **shared)
 {
-    int throttle = 0;
-    struct vec vec, val;
-    uint32_t net, mask;
-    char mult;
-    double v;
+    const struct throttle_rule *rule = ctx->cfg.throttle;
+    const struct throttle_rule *end = rule + ctx->cfg.num_throttle_rules;
+    const struct throttle_rule *match = NULL;
 
-    while ((spec = next_option(spec, &vec, &val)) != NULL) {
-        mult = ',';
-        if (sscanf(val.ptr, "%lf%c", &v, &mult) < 1 || v < 0 ||
-            (lowercase(&mult) != 'k' && lowercase(&mult) != 'm' && mult != ',')) {
-            continue;
-        }
-        v *= lowercase(&mult) == 'k' ? 1024 : lowercase(&mult) == 'm' ? 1048576 : 1;
-        if (vec.len == 1 && vec.ptr[0] == '*') {
-            throttle = (int) v;
-        } else if (parse_net(vec.ptr, &net, &mask) > 0) {
-            if ((remote_ip & mask) == net) {
-                throttle = (int) v;
-            }
-        } else if (match_prefix(vec.ptr, (int)vec.len, uri) > 0) {
-            throttle = (int) v;
+    /* The last matching rule wins */
+    for (; rule < end; rule++) {
+        if (rule->uri.num_alts == 0 ?
+            (remote_ip & rule->mask) == rule->net :
+            match_pattern(&rule->uri, uri) > 0) {
+            match = rule;
         }
     }
 
-    return throttle;
+    if (shared != NULL) {
+        *shared = match == NULL ? NULL : match->bucket;
+    }
+    return match == NULL ? 0 : match->rate;
 }
 
 static uint32_t get_remote_ip(const struct mg_connection *conn)
@@ -5513,7 +8197,7 @@ int mg_upload(struct mg_connection *conn, const char *destination_dir)
        ------WebKitFormBoundaryRVr */
 
     /* Extract boundary string from the Content-Type header */
-    if ((content_type_header = mg_get_header(conn, "Content-Type")) == NULL ||
+    if ((content_type_header = mg_get_header_id(conn, HTTP_HEADER_CONTENT_TYPE)) == NULL ||
         (boundary_start = mg_strcasestr(content_type_header,
                                         "boundary=")) == NULL ||
         (sscanf(boundary_start, "boundary=\"%99[^\"]\"", boundary) == 0 &&
@@ -5610,44 +8294,147 @@ int mg_upload(struct mg_connection *conn, const char *destination_dir)
     return num_uploaded_files;
 }
 
-static int is_put_or_delete_request(const struct mg_connection *conn)
+static void handle_put_request(struct mg_connection *conn, const char *path,
+                               struct file *filep)
 {
-    const char *s = conn->request_info.request_method;
-    return s != NULL && (!strcmp(s, "PUT") ||
-                         !strcmp(s, "DELETE") ||
-                         !strcmp(s, "MKCOL"));
+    (void) filep;
+    put_file(conn, path);
 }
 
-static int get_first_ssl_listener_index(const struct mg_context *ctx)
+static void handle_mkcol_request(struct mg_connection *conn, const char *path,
+                                 struct file *filep)
 {
-    int i, idx = -1;
-    for (i = 0; idx == -1 && i < ctx->num_listening_sockets; i++) {
-        idx = ctx->listening_sockets[i].is_ssl ? i : -1;
-    }
-    return idx;
+    (void) filep;
+    mkcol(conn, path);
 }
 
-static void redirect_to_https_port(struct mg_connection *conn, int ssl_index)
+static void handle_delete_request(struct mg_connection *conn, const char *path,
+                                  struct file *filep)
 {
-    char host[1025];
-    const char *host_header;
-    size_t hostlen;
-
-    host_header = mg_get_header(conn, "Host");
-    hostlen = sizeof(host);
-    if (host_header != NULL) {
-        char *pos;
+    struct de de;
 
-        mg_strlcpy(host, host_header, hostlen);
-        host[hostlen - 1] = '\0';
-        pos = strchr(host, ':');
-        if (pos != NULL) {
+    (void) filep;
+    memset(&de.file, 0, sizeof(de.file));
+    if(!mg_stat(conn, path, &de.file)) {
+        send_http_error(conn, 404, "Not Found", "%s", "File not found");
+    } else {
+        if(de.file.modification_time) {
+            if(de.file.is_directory) {
+                remove_directory(conn, path);
+                directory_removed(conn, path);
+                send_http_error(conn, 204, "No Content", "%s", "");
+            } else if (mg_remove(path) == 0) {
+                file_changed(conn, path);
+                send_http_error(conn, 204, "No Content", "%s", "");
+            } else {
+                send_http_error(conn, 423, "Locked", "remove(%s): %s", path,
+                                strerror(ERRNO));
+            }
+        } else {
+            send_http_error(conn, 500, http_500_error, "remove(%s): %s", path,
+                            strerror(ERRNO));
+        }
+    }
+}
+
+/* Methods known to civetweb, which scripts, callbacks and request handlers
+   may implement, but files and directories do not support */
+static void handle_unsupported_method(struct mg_connection *conn,
+                                      const char *path, struct file *filep)
+{
+    (void) path;
+    (void) filep;
+    send_http_error(conn, 405, "Method Not Allowed", "%s",
+                    "Method Not Allowed");
+}
+
+/* Flags of http_methods[] */
+#define METHOD_HAS_BODY   1 /* Without Content-Length, body ends at close */
+#define METHOD_MODIFIES   2 /* Needs put_delete_auth_file authorization */
+#define METHOD_NEEDS_FILE 4 /* Handler is only called for existing files */
+
+typedef void (*method_handler)(struct mg_connection *conn, const char *path,
+                               struct file *filep);
+
+/* Indexed by HTTP_METHOD_*. The handler, if any, serves the method for
+   files and directories below document_root. */
+static const struct {
+    const char *name;
+    int flags;
+    method_handler handler;
+} http_methods[] = {
+    {"",         0,                                 NULL},
+    {"GET",      0,                                 NULL},
+    {"HEAD",     0,                                 NULL},
+    {"POST",     METHOD_HAS_BODY,                   NULL},
+    {"PUT",      METHOD_HAS_BODY | METHOD_MODIFIES, handle_put_request},
+    {"DELETE",   METHOD_MODIFIES,                   handle_delete_request},
+    {"OPTIONS",  0,                                 NULL},
+    {"CONNECT",  0,                                 NULL},
+    {"PROPFIND", METHOD_NEEDS_FILE,                 handle_propfind},
+    {"MKCOL",    METHOD_MODIFIES,                   handle_mkcol_request},
+    {"PATCH",    METHOD_HAS_BODY,                   handle_unsupported_method},
+    {"COPY",     0,                                 handle_unsupported_method},
+    {"MOVE",     0,                                 handle_unsupported_method},
+    {"LOCK",     0,                                 handle_unsupported_method},
+    {"UNLOCK",   0,                                 handle_unsupported_method}
+};
+
+/* Classify a request method, done once when the request is parsed */
+static int get_method_id(const char *method)
+{
+    int i;
+
+    for (i = 1; i < (int) ARRAY_SIZE(http_methods); i++) {
+        if (method[0] == http_methods[i].name[0] &&
+            !strcmp(method, http_methods[i].name)) {
+            return i;
+        }
+    }
+    return HTTP_METHOD_OTHER;
+}
+
+static int is_put_or_delete_request(const struct mg_connection *conn)
+{
+    return http_methods[conn->request_info.method_id].flags & METHOD_MODIFIES;
+}
+
+static int get_first_ssl_listener_index(const struct mg_context *ctx)
+{
+    int i, idx = -1;
+    for (i = 0; idx == -1 && i < ctx->num_listening_sockets; i++) {
+        idx = ctx->listening_sockets[i].is_ssl ? i : -1;
+    }
+    return idx;
+}
+
+static void redirect_to_https_port(struct mg_connection *conn, int ssl_index)
+{
+    char host[1025];
+    const char *host_header;
+    size_t hostlen;
+
+    host_header = mg_get_header_id(conn, HTTP_HEADER_HOST);
+    hostlen = sizeof(host);
+    if (host_header != NULL) {
+        char *pos;
+
+        mg_strlcpy(host, host_header, hostlen);
+        host[hostlen - 1] = '\0';
+        pos = strchr(host, ':');
+        if (pos != NULL) {
             *pos = '\0';
         }
     } else {
         /* Cannot get host from the Host: header.
-           Fallback to our IP address. */
-        sockaddr_to_string(host, hostlen, &conn->client.lsa);
+           Fallback to our IP address. The accepted socket has the address of
+           the listener, which may be a wildcard address. */
+        union usa usa;
+        socklen_t len = sizeof(usa);
+        if (getsockname(conn->client.sock, &usa.sa, &len) != 0) {
+            usa = conn->client.lsa;
+        }
+        sockaddr_to_string(host, hostlen, &usa);
     }
 
     mg_printf(conn, "HTTP/1.1 302 Found\r\nLocation: https://%s:%d%s\r\n\r\n",
@@ -5656,99 +8443,344 @@ static void redirect_to_https_port(struct mg_connection *conn, int ssl_index)
 }
 
 
-void mg_set_request_handler(struct mg_context *ctx, const char *uri, mg_request_handler handler, void *cbdata)
+/* Start of the next path segment at or after s, or NULL at the end */
+static const char *next_segment(const char *s, size_t *len)
 {
-    struct mg_request_handler_info *tmp_rh, *lastref = NULL;
-    size_t urilen = strlen(uri);
+    while (*s == '/') {
+        s++;
+    }
+    *len = strcspn(s, "/");
+    return *s == '\0' ? NULL : s;
+}
+
+/* Index of the child of node for the segment, or where it would go */
+static int find_route_child(const struct route_node *node, const char *seg,
+                            size_t len, int *found)
+{
+    const struct route_node *child;
+    int lo = 0, hi = node->num_children, mid, diff;
+
+    *found = 0;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        child = node->children[mid];
+        diff = memcmp(child->segment, seg,
+                      child->segment_len < len ? child->segment_len : len);
+        if (diff == 0) {
+            diff = (int) child->segment_len - (int) len;
+        }
+        if (diff == 0) {
+            *found = 1;
+            return mid;
+        } else if (diff < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static struct route_node *add_route_child(struct route_node *node,
+                                          const char *seg, size_t len)
+{
+    struct route_node *child, **children;
+    int i, found;
+
+    i = find_route_child(node, seg, len, &found);
+    if (found) {
+        return node->children[i];
+    }
+    if ((child = (struct route_node *) mg_calloc(1, sizeof(*child))) == NULL ||
+        (children = (struct route_node **)
+         mg_realloc(node->children,
+                    (node->num_children + 1) * sizeof(*children))) == NULL) {
+        mg_free(child);
+        return NULL;
+    }
+    memmove(children + i + 1, children + i,
+            (node->num_children - i) * sizeof(*children));
+    children[i] = child;
+    node->children = children;
+    node->num_children++;
+    child->segment = seg;
+    child->segment_len = len;
+    return child;
+}
+
+/* Plain URIs go to the node of their last segment. Patterns go to the node
+   of their literal leading segments and are tried against the whole URI. */
+static int add_route(struct route_table *routes,
+                     struct mg_request_handler_info *rh)
+{
+    struct mg_request_handler_info **globs;
+    struct route_node *node = &routes->root;
+    const char *seg, *glob = strpbrk(rh->uri, "*?$|");
+    size_t len;
+
+    if (glob != NULL && strchr(glob, '|') != NULL) {
+        glob = rh->uri;
+    }
+    for (seg = next_segment(rh->uri, &len);
+         seg != NULL && (glob == NULL || seg + len < glob);
+         seg = next_segment(seg + len, &len)) {
+        if ((node = add_route_child(node, seg, len)) == NULL) {
+            return 0;
+        }
+    }
+
+    if (glob == NULL) {
+        /* Of "/a" and "/a/", the first one registered wins */
+        if (node->handler == NULL) {
+            node->handler = rh;
+        }
+    } else {
+        globs = (struct mg_request_handler_info **)
+            mg_realloc(node->globs, (node->num_globs + 1) * sizeof(*globs));
+        if (globs == NULL) {
+            return 0;
+        }
+        globs[node->num_globs++] = rh;
+        node->globs = globs;
+    }
+    return 1;
+}
+
+static void free_route_node(struct route_node *node)
+{
+    int i;
+
+    for (i = 0; i < node->num_children; i++) {
+        free_route_node(node->children[i]);
+        mg_free(node->children[i]);
+    }
+    mg_free(node->children);
+    mg_free(node->globs);
+}
+
+static void free_request_handler(struct mg_request_handler_info *rh)
+{
+    free_pattern(&rh->pattern);
+    mg_free(rh->uri);
+    mg_free(rh);
+}
+
+static void free_route_table(struct route_table *routes)
+{
+    struct mg_request_handler_info *rh;
+
+    free_route_node(&routes->root);
+    while ((rh = routes->removed) != NULL) {
+        routes->removed = rh->next;
+        free_request_handler(rh);
+    }
+    mg_free(routes);
+}
+
+/* Trie of the registered handlers, with removed replaced by added */
+static struct route_table *build_route_table(struct mg_context *ctx,
+                                             struct mg_request_handler_info *removed,
+                                             struct mg_request_handler_info *added)
+{
+    struct route_table *routes;
+    struct mg_request_handler_info *rh;
+    int ok = 1;
+
+    if ((routes = (struct route_table *) mg_calloc(1, sizeof(*routes))) == NULL) {
+        return NULL;
+    }
+    for (rh = ctx->request_handlers; rh != NULL && ok; rh = rh->next) {
+        if (rh != removed) {
+            ok = add_route(routes, rh);
+        } else if (added != NULL) {
+            ok = add_route(routes, added);
+            added = NULL;
+        }
+    }
+    if (ok && added != NULL) {
+        ok = add_route(routes, added);
+    }
+    if (!ok) {
+        free_route_table(routes);
+        return NULL;
+    }
+    return routes;
+}
+
+/* Free the retired tables that no worker uses any more. A worker announces
+   its table under conn->mutex, so locking that mutex here guarantees that
+   the worker either announced an old table before, or will see the current
+   one. A busy mutex counts as in use. */
+static void reclaim_route_tables(struct mg_context *ctx)
+{
+    struct route_table **pp, *routes;
+    struct mg_connection *conn;
+    int in_use;
 
-    /* first see it the uri exists */
-    for (tmp_rh = ctx->request_handlers;
-         tmp_rh != NULL && 0!=strcmp(uri, tmp_rh->uri);
-         lastref = tmp_rh, tmp_rh = tmp_rh->next) {
-        /* first try for an exact match */
-        if (urilen == tmp_rh->uri_len && !strcmp(tmp_rh->uri,uri)) {
-            /* already there... */
-
-            if (handler != NULL) {
-                /* change this entry */
-                tmp_rh->handler = handler;
-                tmp_rh->cbdata = cbdata;
+    (void) pthread_mutex_lock(&ctx->thread_mutex);
+    for (pp = &ctx->retired_routes; (routes = *pp) != NULL;) {
+        in_use = 0;
+        for (conn = ctx->workers; conn != NULL && !in_use;
+             conn = conn->next_worker) {
+            if (pthread_mutex_trylock(&conn->mutex) != 0) {
+                in_use = 1;
             } else {
-                /* remove this entry */
-                if (lastref != NULL)
-                    lastref->next = tmp_rh->next;
-                else
-                    ctx->request_handlers = tmp_rh->next;
-                mg_free(tmp_rh->uri);
-                mg_free(tmp_rh);
+                in_use = conn->routes == routes;
+                (void) pthread_mutex_unlock(&conn->mutex);
             }
-            return;
         }
+        if (in_use) {
+            pp = &routes->next_retired;
+        } else {
+            *pp = routes->next_retired;
+            free_route_table(routes);
+        }
+    }
+    (void) pthread_mutex_unlock(&ctx->thread_mutex);
+}
+
+void mg_set_request_handler(struct mg_context *ctx, const char *uri, mg_request_handler handler, void *cbdata)
+{
+    struct mg_request_handler_info *tmp_rh = NULL, *removed, **pp;
+    struct route_table *routes;
+    size_t urilen = strlen(uri);
+
+    (void) pthread_mutex_lock(&ctx->handlers_mutex);
 
-        /* next try for a partial match, we will accept uri/something */
-        if (tmp_rh->uri_len < urilen
-            && uri[tmp_rh->uri_len] == '/'
-            && memcmp(tmp_rh->uri, uri, tmp_rh->uri_len) == 0) {
-            /* if there is a partical match this new entry MUST go BEFORE
-               the current position otherwise it will never be matched. */
+    /* Workers use handlers without locking, so they are never changed in
+       place: replacing one removes the old entry and adds a new one. */
+    for (pp = &ctx->request_handlers; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->uri_len == urilen && !strcmp((*pp)->uri, uri)) {
             break;
         }
-
     }
+    removed = *pp;
 
-    if (handler == NULL) {
+    if (handler != NULL) {
+        tmp_rh = (struct mg_request_handler_info *)
+            mg_calloc(1, sizeof(struct mg_request_handler_info));
+        if (tmp_rh == NULL ||
+            (tmp_rh->uri = mg_strdup(uri)) == NULL ||
+            !compile_pattern(&tmp_rh->pattern, tmp_rh->uri, (int) urilen)) {
+            mg_cry(fc(ctx), "%s", "Cannot create new request handler struct, OOM");
+            if (tmp_rh != NULL) {
+                mg_free(tmp_rh->uri);
+                mg_free(tmp_rh);
+            }
+            (void) pthread_mutex_unlock(&ctx->handlers_mutex);
+            return;
+        }
+        tmp_rh->uri_len = urilen;
+        tmp_rh->handler = handler;
+        tmp_rh->cbdata = cbdata;
+    } else if (removed == NULL) {
         /* no handler to set, this was a remove request */
+        (void) pthread_mutex_unlock(&ctx->handlers_mutex);
         return;
     }
 
-    tmp_rh = (struct mg_request_handler_info *)mg_malloc(sizeof(struct mg_request_handler_info));
-    if (tmp_rh == NULL) {
-        mg_cry(fc(ctx), "%s", "Cannot create new request handler struct, OOM");
+    if ((routes = build_route_table(ctx, removed, tmp_rh)) == NULL) {
+        mg_cry(fc(ctx), "%s", "Cannot create request handler table, OOM");
+        if (tmp_rh != NULL) {
+            free_request_handler(tmp_rh);
+        }
+        (void) pthread_mutex_unlock(&ctx->handlers_mutex);
         return;
     }
-    tmp_rh->uri = mg_strdup(uri);
-    tmp_rh->uri_len = urilen;
-    tmp_rh->handler = handler;
-    tmp_rh->cbdata = cbdata;
 
-    if (lastref == NULL) {
-        tmp_rh->next = ctx->request_handlers;
-        ctx->request_handlers = tmp_rh;
-    } else {
-        tmp_rh->next = lastref->next;
-        lastref->next = tmp_rh;
+    (void) pthread_mutex_lock(&ctx->latency_mutex);
+    if (removed != NULL) {
+        *pp = removed->next;
+        removed->next = NULL;
+    }
+    if (tmp_rh != NULL) {
+        if (removed != NULL) {
+            tmp_rh->latency = removed->latency;
+            memcpy(tmp_rh->latency_base, removed->latency_base,
+                   sizeof(tmp_rh->latency_base));
+        }
+        tmp_rh->next = *pp;
+        *pp = tmp_rh;
     }
+    (void) pthread_mutex_unlock(&ctx->latency_mutex);
 
+    if (ctx->routes != NULL) {
+        ctx->routes->removed = removed;
+        ctx->routes->next_retired = ctx->retired_routes;
+        ctx->retired_routes = ctx->routes;
+    }
+    ctx->routes = routes;
+    reclaim_route_tables(ctx);
+
+    (void) pthread_mutex_unlock(&ctx->handlers_mutex);
 }
 
-static int use_request_handler(struct mg_connection *conn)
+static int call_begin_request(struct mg_connection *conn)
 {
-    struct mg_request_info *request_info = mg_get_request_info(conn);
-    const char *uri = request_info->uri;
-    size_t urilen = strlen(uri);
-    struct mg_request_handler_info *tmp_rh = conn->ctx->request_handlers;
+    int handled;
 
-    for (; tmp_rh != NULL; tmp_rh = tmp_rh->next) {
+    end_output_buffering(conn);
+    handled = conn->ctx->callbacks.begin_request(conn);
+    conn->buffer_output = !handled;
+    return handled;
+}
 
-        /* first try for an exact match */
-        if (urilen == tmp_rh->uri_len && !strcmp(tmp_rh->uri,uri)) {
-            return tmp_rh->handler(conn, tmp_rh->cbdata);
-        }
+static int call_request_handler(struct mg_connection *conn,
+                                struct mg_request_handler_info *rh)
+{
+    int handled;
 
-        /* next try for a partial match */
-        /* we will accept uri/something */
-        if (tmp_rh->uri_len < urilen
-            && uri[tmp_rh->uri_len] == '/'
-            && memcmp(tmp_rh->uri, uri, tmp_rh->uri_len) == 0) {
+    /* User code may stream its response, so it writes unbuffered */
+    end_output_buffering(conn);
+    handled = rh->handler(conn, rh->cbdata);
+    conn->buffer_output = !handled;
 
-            return tmp_rh->handler(conn, tmp_rh->cbdata);
-        }
+    if (handled) {
+        conn->dispatch = DISPATCH_HANDLER;
+        conn->request_handler = rh;
+    }
+    return handled;
+}
+
+static int use_request_handler(struct mg_connection *conn)
+{
+    const char *uri = conn->request_info.uri, *seg;
+    const struct route_node *path[MAX_ROUTE_DEPTH], *node;
+    struct route_table *routes;
+    size_t len;
+    int i, found, depth = 0;
+
+    /* Announce the table before using it, see reclaim_route_tables() */
+    (void) pthread_mutex_lock(&conn->mutex);
+    conn->routes = routes = conn->ctx->routes;
+    (void) pthread_mutex_unlock(&conn->mutex);
+    if (routes == NULL) {
+        return 0;
+    }
 
-        /* try for pattern match */
-        if (match_prefix(tmp_rh->uri, tmp_rh->uri_len, uri) > 0) {
-           return tmp_rh->handler(conn, tmp_rh->cbdata);
+    path[depth++] = node = &routes->root;
+    for (seg = next_segment(uri, &len);
+         seg != NULL && depth < MAX_ROUTE_DEPTH;
+         seg = next_segment(seg + len, &len)) {
+        i = find_route_child(node, seg, len, &found);
+        if (!found) {
+            break;
         }
+        path[depth++] = node = node->children[i];
+    }
 
+    /* Longest match first. At each node, patterns go before the plain URI,
+       as they are more specific. */
+    while (depth-- > 0) {
+        node = path[depth];
+        for (i = 0; i < node->num_globs; i++) {
+            if (match_pattern(&node->globs[i]->pattern, uri) > 0) {
+                return call_request_handler(conn, node->globs[i]);
+            }
+        }
+        if (node->handler != NULL) {
+            return call_request_handler(conn, node->handler);
+        }
     }
 
     return 0; /* none found */
@@ -5761,11 +8793,12 @@ static int use_request_handler(struct mg_connection *conn)
 static void handle_request(struct mg_connection *conn)
 {
     struct mg_request_info *ri = &conn->request_info;
+    method_handler handler = http_methods[ri->method_id].handler;
+    int method_flags = http_methods[ri->method_id].flags;
     char path[PATH_MAX];
     int uri_len, ssl_index, is_script_resource;
     struct file file = STRUCT_FILE_INITIALIZER;
     char date[64];
-    time_t curtime = time(NULL);
 
     if ((conn->request_info.query_string = strchr(ri->uri, '?')) != NULL) {
         * ((char *) conn->request_info.query_string++) = '\0';
@@ -5782,8 +8815,13 @@ static void handle_request(struct mg_connection *conn)
 
     path[0] = '\0';
     convert_uri_to_file_name(conn, path, sizeof(path), &file, &is_script_resource);
-    conn->throttle = set_throttle(conn->ctx->config[THROTTLE],
-                                  get_remote_ip(conn), ri->uri);
+    conn->throttle = set_throttle(conn->ctx, get_remote_ip(conn), ri->uri,
+                                  &conn->bucket);
+    if (conn->throttle > 0 && conn->bucket == NULL) {
+        init_token_bucket(&conn->own_bucket, conn->throttle);
+        conn->bucket = &conn->own_bucket;
+    }
+    conn->timings.handler_start = get_monotonic_usec();
 
     DEBUG_TRACE("%s", ri->uri);
     /* Perform redirect and auth checks before calling begin_request() handler.
@@ -5796,17 +8834,17 @@ static void handle_request(struct mg_connection *conn)
                !check_authorization(conn, path)) {
         send_authorization_request(conn);
     } else if (conn->ctx->callbacks.begin_request != NULL &&
-               conn->ctx->callbacks.begin_request(conn)) {
+               call_begin_request(conn)) {
         /* Do nothing, callback has served the request */
 	fast_forward_request(conn);
 #if defined(USE_WEBSOCKET)
     } else if (is_websocket_request(conn)) {
         handle_websocket_request(conn, path, is_script_resource);
 #endif
-    } else if (conn->ctx->request_handlers != NULL &&
+    } else if (conn->ctx->routes != NULL &&
                use_request_handler(conn)) {
         /* Do nothing, callback has served the request */
-    } else if (!is_script_resource && !strcmp(ri->request_method, "OPTIONS")) {
+    } else if (!is_script_resource && ri->method_id == HTTP_METHOD_OPTIONS) {
         /* Scripts should support the OPTIONS method themselves, to allow a maximum flexibility.
            Lua and CGI scripts may fully support CORS this way (including preflights). */
         send_options(conn);
@@ -5815,47 +8853,25 @@ static void handle_request(struct mg_connection *conn)
     } else if (!is_script_resource && is_put_or_delete_request(conn) &&
                (is_authorized_for_put(conn) != 1)) {
         send_authorization_request(conn);
-    } else if (!is_script_resource && !strcmp(ri->request_method, "PUT")) {
-        put_file(conn, path);
-    } else if (!is_script_resource && !strcmp(ri->request_method, "MKCOL")) {
-        mkcol(conn, path);
-    } else if (!is_script_resource && !strcmp(ri->request_method, "DELETE")) {
-        struct de de;
-        memset(&de.file, 0, sizeof(de.file));
-        if(!mg_stat(conn, path, &de.file)) {
-            send_http_error(conn, 404, "Not Found", "%s", "File not found");
-        } else {
-            if(de.file.modification_time) {
-                if(de.file.is_directory) {
-                    remove_directory(conn, path);
-                    send_http_error(conn, 204, "No Content", "%s", "");
-                } else if (mg_remove(path) == 0) {
-                    send_http_error(conn, 204, "No Content", "%s", "");
-                } else {
-                    send_http_error(conn, 423, "Locked", "remove(%s): %s", path,
-                                    strerror(ERRNO));
-                }
-            } else {
-                send_http_error(conn, 500, http_500_error, "remove(%s): %s", path,
-                                strerror(ERRNO));
-            }
-        }
+    } else if (!is_script_resource && handler != NULL &&
+               !(method_flags & METHOD_NEEDS_FILE)) {
+        handler(conn, path, &file);
     } else if ((file.membuf == NULL && file.modification_time == (time_t) 0) ||
                must_hide_file(conn, path)) {
         send_http_error(conn, 404, "Not Found", "%s", "File not found");
     } else if (file.is_directory && ri->uri[uri_len - 1] != '/') {
-        gmt_time_string(date, sizeof(date), &curtime);
+        current_date_string(conn->ctx, date, sizeof(date));
         mg_printf(conn, "HTTP/1.1 301 Moved Permanently\r\n"
                         "Location: %s/\r\n"
                         "Date: %s\r\n"
                         "Content-Length: 0\r\n"
                         "Connection: %s\r\n\r\n",
                         ri->uri, date, suggest_connection_header(conn));
-    } else if (!is_script_resource && !strcmp(ri->request_method, "PROPFIND")) {
-        handle_propfind(conn, path, &file);
+    } else if (!is_script_resource && handler != NULL) {
+        handler(conn, path, &file);
     } else if (file.is_directory &&
                !substitute_index_file(conn, path, sizeof(path), &file)) {
-        if (!mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes")) {
+        if (conn->ctx->cfg.directory_listing) {
             handle_directory_request(conn, path);
         } else {
             send_http_error(conn, 403, "Directory Listing Denied",
@@ -5870,38 +8886,57 @@ static void handle_file_based_request(struct mg_connection *conn, const char *pa
 {
     if (0) {
 #ifdef USE_LUA
-    } else if (match_prefix(conn->ctx->config[LUA_SERVER_PAGE_EXTENSIONS],
-                            (int)strlen(conn->ctx->config[LUA_SERVER_PAGE_EXTENSIONS]),
-                            path) > 0) {
+    } else if (match_pattern(&conn->ctx->cfg.lua_page_pattern, path) > 0) {
         /* Lua server page: an SSI like page containing mostly plain html code plus some tags with server generated contents. */
+        conn->dispatch = DISPATCH_LUA_PAGE;
         handle_lsp_request(conn, path, file, NULL);
-    } else if (match_prefix(conn->ctx->config[LUA_SCRIPT_EXTENSIONS],
-                            (int)strlen(conn->ctx->config[LUA_SCRIPT_EXTENSIONS]),
-                            path) > 0) {
+    } else if (match_pattern(&conn->ctx->cfg.lua_script_pattern, path) > 0) {
         /* Lua in-server module script: a CGI like script used to generate the entire reply. */
+        conn->dispatch = DISPATCH_LUA_SCRIPT;
         mg_exec_lua_script(conn, path, NULL);
 #endif
 #if !defined(NO_CGI)
-    } else if (match_prefix(conn->ctx->config[CGI_EXTENSIONS],
-                            (int)strlen(conn->ctx->config[CGI_EXTENSIONS]),
-                            path) > 0) {
+    } else if (match_pattern(&conn->ctx->cfg.cgi_pattern, path) > 0) {
         /* CGI scripts may support all HTTP methods */
+        conn->dispatch = DISPATCH_CGI;
         handle_cgi_request(conn, path);
 #endif /* !NO_CGI */
-    } else if (match_prefix(conn->ctx->config[SSI_EXTENSIONS],
-                            (int)strlen(conn->ctx->config[SSI_EXTENSIONS]),
-                            path) > 0) {
+    } else if (match_pattern(&conn->ctx->cfg.ssi_pattern, path) > 0) {
+        conn->dispatch = DISPATCH_SSI;
         handle_ssi_file_request(conn, path);
     } else if ((!conn->in_error_handler) && is_not_modified(conn, file)) {
+        conn->dispatch = DISPATCH_STATIC;
         send_http_error(conn, 304, "Not Modified", "%s", "");
     } else {
+        conn->dispatch = DISPATCH_STATIC;
         handle_static_file_request(conn, path, file);
     }
 }
 
+static void close_acceptor_sockets(struct mg_context *ctx)
+{
+    int i, j;
+    struct mg_acceptor *acc;
+
+    for (i = 0; i < ctx->num_acceptors; i++) {
+        acc = &ctx->acceptors[i];
+        if (acc->listening_sockets == NULL) {
+            continue;
+        }
+        for (j = 0; j < ctx->num_listening_sockets; j++) {
+            if (acc->listening_sockets[j].sock != INVALID_SOCKET) {
+                closesocket(acc->listening_sockets[j].sock);
+            }
+        }
+        mg_free(acc->listening_sockets);
+        acc->listening_sockets = NULL;
+    }
+}
+
 static void close_all_listening_sockets(struct mg_context *ctx)
 {
     int i;
+    close_acceptor_sockets(ctx);
     for (i = 0; i < ctx->num_listening_sockets; i++) {
         closesocket(ctx->listening_sockets[i].sock);
         ctx->listening_sockets[i].sock = INVALID_SOCKET;
@@ -5962,6 +8997,50 @@ static int parse_port_string(const struct vec *vec, struct socket *so)
            (ch == '\0' || ch == 's' || ch == 'r' || ch == ',');
 }
 
+static int set_sock_timeout(SOCKET sock, int milliseconds)
+{
+#ifdef _WIN32
+    DWORD t = milliseconds;
+#else
+    struct timeval t;
+    t.tv_sec = milliseconds / 1000;
+    t.tv_usec = (milliseconds * 1000) % 1000000;
+#endif
+    return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &t, sizeof(t)) ||
+           setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &t, sizeof(t));
+}
+
+/* Options for accepted client sockets. With USE_ACCEPT4 they are set once
+   on the listening socket, and inherited by every accepted socket. */
+static void set_client_socket_options(struct mg_context *ctx, SOCKET sock)
+{
+    int on = 1;
+
+    /* Set TCP keep-alive. This is needed because if HTTP-level keep-alive
+       is enabled, and client resets the connection, server won't get
+       TCP FIN or RST and will keep the connection open forever. With TCP
+       keep-alive, next keep-alive handshake will figure out that the
+       client is down and will close the server end.
+       Thanks to Igor Klopov who suggested the patch. */
+    if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on,
+                   sizeof(on)) != 0) {
+        mg_cry(fc(ctx),
+               "%s: setsockopt(SOL_SOCKET SO_KEEPALIVE) failed: %s",
+               __func__, strerror(ERRNO));
+    }
+    set_sock_timeout(sock, ctx->cfg.request_timeout);
+}
+
+/* Prepare a bound listening socket for accept_new_connection() */
+static void set_listener_options(struct mg_context *ctx, SOCKET sock)
+{
+    set_close_on_exec(sock, fc(ctx));
+#if defined(USE_ACCEPT4)
+    set_non_blocking_mode(sock);
+    set_client_socket_options(ctx, sock);
+#endif
+}
+
 static int set_ports_option(struct mg_context *ctx)
 {
     const char *list = ctx->config[LISTENING_PORTS];
@@ -5993,6 +9072,12 @@ static int set_ports_option(struct mg_context *ctx)
                       broadcast UDP sockets */
                    setsockopt(so.sock, SOL_SOCKET, SO_REUSEADDR,
                               (void *) &on, sizeof(on)) != 0 ||
+#if defined(SO_REUSEPORT)
+                   /* Additional acceptor threads bind to the same port */
+                   (atoi(ctx->config[NUM_ACCEPTORS]) > 1 &&
+                    setsockopt(so.sock, SOL_SOCKET, SO_REUSEPORT,
+                               (void *) &on, sizeof(on)) != 0) ||
+#endif
 #if defined(USE_IPV6)
                    (so.lsa.sa.sa_family == AF_INET6 &&
                     setsockopt(so.sock, IPPROTO_IPV6, IPV6_V6ONLY, (void *) &off,
@@ -6024,7 +9109,9 @@ static int set_ports_option(struct mg_context *ctx)
             success = 0;
         }
         else {
-            set_close_on_exec(so.sock, fc(ctx));
+            set_listener_options(ctx, so.sock);
+            /* Accepted sockets copy lsa, make sure it has the actual port */
+            so.lsa.sin.sin_port = usa.sin.sin_port;
             ctx->listening_sockets = ptr;
             ctx->listening_sockets[ctx->num_listening_sockets] = so;
             ctx->listening_ports = portPtr;
@@ -6040,6 +9127,91 @@ static int set_ports_option(struct mg_context *ctx)
     return success;
 }
 
+/* For every acceptor thread besides the master, open one more listening
+   socket per entry in listening_ports. The sockets share their port via
+   SO_REUSEPORT, so the kernel spreads new connections across the threads.
+   Each acceptor is a shard: it produces into a socket queue of its own,
+   consumed by its own workers, see mg_start(). */
+static int set_acceptors_option(struct mg_context *ctx)
+{
+    int num_acceptors = atoi(ctx->config[NUM_ACCEPTORS]);
+#if defined(SO_REUSEPORT)
+    int i, j, on = 1;
+#if defined(USE_IPV6)
+    int off = 0;
+#endif
+    struct mg_acceptor *acc;
+    struct socket *so;
+    socklen_t len;
+#endif
+
+    if (num_acceptors <= 1) {
+        return 1;
+    }
+
+#if !defined(SO_REUSEPORT)
+    mg_cry(fc(ctx), "%s: SO_REUSEPORT is not supported, using one acceptor",
+           __func__);
+    return 1;
+#else
+    if ((ctx->acceptors = (struct mg_acceptor *)
+         mg_calloc(num_acceptors - 1, sizeof(ctx->acceptors[0]))) == NULL) {
+        mg_cry(fc(ctx), "%s", "Not enough memory for acceptor threads");
+        return 0;
+    }
+    ctx->num_acceptors = num_acceptors - 1;
+
+    for (i = 0; i < ctx->num_acceptors; i++) {
+        acc = &ctx->acceptors[i];
+        acc->ctx = ctx;
+        if ((acc->listening_sockets = (struct socket *)
+             mg_calloc(ctx->num_listening_sockets, sizeof(struct socket))) == NULL) {
+            mg_cry(fc(ctx), "%s", "Not enough memory for acceptor threads");
+            close_all_listening_sockets(ctx);
+            return 0;
+        }
+        for (j = 0; j < ctx->num_listening_sockets; j++) {
+            acc->listening_sockets[j].sock = INVALID_SOCKET;
+        }
+
+        for (j = 0; j < ctx->num_listening_sockets; j++) {
+            so = &acc->listening_sockets[j];
+            so->is_ssl = ctx->listening_sockets[j].is_ssl;
+            so->ssl_redir = ctx->listening_sockets[j].ssl_redir;
+
+            /* Bind to the address of the first listener, which also has the
+               actual port number if port 0 was configured */
+            len = sizeof(so->lsa);
+            if (getsockname(ctx->listening_sockets[j].sock, &so->lsa.sa,
+                            &len) != 0 ||
+                (so->sock = socket(so->lsa.sa.sa_family, SOCK_STREAM, 6)) ==
+                INVALID_SOCKET ||
+                setsockopt(so->sock, SOL_SOCKET, SO_REUSEADDR,
+                           (void *) &on, sizeof(on)) != 0 ||
+                setsockopt(so->sock, SOL_SOCKET, SO_REUSEPORT,
+                           (void *) &on, sizeof(on)) != 0 ||
+#if defined(USE_IPV6)
+                (so->lsa.sa.sa_family == AF_INET6 &&
+                 setsockopt(so->sock, IPPROTO_IPV6, IPV6_V6ONLY, (void *) &off,
+                            sizeof(off)) != 0) ||
+#endif
+                bind(so->sock, &so->lsa.sa, so->lsa.sa.sa_family == AF_INET ?
+                     sizeof(so->lsa.sin) : sizeof(so->lsa)) != 0 ||
+                listen(so->sock, SOMAXCONN) != 0) {
+                mg_cry(fc(ctx), "%s: cannot bind acceptor %d to port %d: %d (%s)",
+                       __func__, i + 1, (int) ctx->listening_ports[j],
+                       ERRNO, strerror(ERRNO));
+                close_all_listening_sockets(ctx);
+                return 0;
+            }
+            set_listener_options(ctx, so->sock);
+        }
+    }
+
+    return 1;
+#endif /* SO_REUSEPORT */
+}
+
 static const char* header_val(const struct mg_connection *conn, const char *header)
 {
     const char *header_value;
@@ -6051,53 +9223,472 @@ static const char* header_val(const struct mg_connection *conn, const char *head
     }
 }
 
-static void log_access(const struct mg_connection *conn)
+/* Write batches of lines until stopped, then what is left */
+static void log_writer_run(struct log_writer *w)
 {
-    const struct mg_request_info *ri;
-    FILE *fp;
-    char date[64], src_addr[IP_ADDR_STR_LEN];
-    struct tm *tm;
-
-    const char *referer;
-    const char *user_agent;
-
-    char buf[4096];
+    char *batch;
+    size_t len;
+    int reopen;
 
-    fp = conn->ctx->config[ACCESS_LOG_FILE] == NULL ?  NULL :
-         fopen(conn->ctx->config[ACCESS_LOG_FILE], "a+");
+    (void) pthread_mutex_lock(&w->mutex);
+    for (;;) {
+        while (w->len == 0 && !w->reopen && !w->stop) {
+            (void) pthread_cond_wait(&w->not_empty, &w->mutex);
+        }
+        if (w->len == 0 && !w->reopen) {
+            break;
+        }
+        batch = w->buf;
+        len = w->len;
+        w->buf = w->spare;
+        w->spare = batch;
+        w->len = 0;
+        reopen = w->reopen;
+        w->reopen = 0;
+        (void) pthread_cond_broadcast(&w->not_full);
+        (void) pthread_mutex_unlock(&w->mutex);
+
+        if (reopen) {
+            if (w->fp != NULL) {
+                fclose(w->fp);
+            }
+            w->fp = fopen(w->path, "a");
+        }
+        if (w->fp != NULL && len > 0) {
+            IGNORE_UNUSED_RESULT(fwrite(batch, 1, len, w->fp));
+            fflush(w->fp);
+        }
 
-    if (fp == NULL && conn->ctx->callbacks.log_message == NULL)
-        return;
+        (void) pthread_mutex_lock(&w->mutex);
+    }
+    (void) pthread_mutex_unlock(&w->mutex);
+}
 
-    tm = localtime(&conn->birth_time);
-    if (tm != NULL) {
-        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", tm);
+#ifdef _WIN32
+static unsigned __stdcall log_writer_thread(void *thread_func_param)
+{
+    log_writer_run((struct log_writer *) thread_func_param);
+    return 0;
+}
+#else
+static void *log_writer_thread(void *thread_func_param)
+{
+    log_writer_run((struct log_writer *) thread_func_param);
+    return NULL;
+}
+#endif /* _WIN32 */
+
+static void destroy_log_writer(struct log_writer *w)
+{
+    if (w == NULL) {
+        return;
+    }
+    (void) pthread_mutex_lock(&w->mutex);
+    w->stop = 1;
+    (void) pthread_cond_signal(&w->not_empty);
+    (void) pthread_cond_broadcast(&w->not_full);
+    (void) pthread_mutex_unlock(&w->mutex);
+    mg_join_thread(w->thread);
+
+    if (w->fp != NULL) {
+        fclose(w->fp);
+    }
+    (void) pthread_mutex_destroy(&w->mutex);
+    (void) pthread_cond_destroy(&w->not_empty);
+    (void) pthread_cond_destroy(&w->not_full);
+    mg_free(w->buf);
+    mg_free(w->spare);
+    mg_free(w);
+}
+
+/* Open path for appending and start its writer thread */
+static struct log_writer *create_log_writer(struct mg_context *ctx,
+                                            const char *path)
+{
+    struct log_writer *w;
+    size_t size = (size_t) atoi(ctx->config[LOG_BUFFER_SIZE]);
+
+    if ((w = (struct log_writer *) mg_calloc(1, sizeof(*w))) == NULL) {
+        return NULL;
+    }
+    w->path = path;
+    w->size = size;
+    w->drop = !strcmp(ctx->config[LOG_BUFFER_FULL], "drop");
+    if ((w->buf = (char *) mg_malloc(size)) == NULL ||
+        (w->spare = (char *) mg_malloc(size)) == NULL) {
+        mg_free(w->buf);
+        mg_free(w);
+        return NULL;
+    }
+    if ((w->fp = fopen(path, "a")) == NULL) {
+        mg_cry(fc(ctx), "%s: cannot open %s: %s", __func__, path,
+               strerror(ERRNO));
+    }
+    (void) pthread_mutex_init(&w->mutex, NULL);
+    (void) pthread_cond_init(&w->not_empty, NULL);
+    (void) pthread_cond_init(&w->not_full, NULL);
+    if (mg_start_thread_with_id(log_writer_thread, w, &w->thread) != 0) {
+        mg_cry(fc(ctx), "%s: cannot start thread: %ld", __func__,
+               (long) ERRNO);
+        if (w->fp != NULL) {
+            fclose(w->fp);
+        }
+        (void) pthread_mutex_destroy(&w->mutex);
+        (void) pthread_cond_destroy(&w->not_empty);
+        (void) pthread_cond_destroy(&w->not_full);
+        mg_free(w->buf);
+        mg_free(w->spare);
+        mg_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* Queue a record, usually a line including its newline, for the writer
+   thread. If the buffer is full, wait for the thread, or drop the record if
+   log_buffer_full says so. Records larger than the buffer are always
+   dropped, since a truncated one would corrupt the records after it. */
+static void log_write(struct log_writer *w, const char *record, size_t len)
+{
+    (void) pthread_mutex_lock(&w->mutex);
+    if (len > w->size) {
+        w->dropped++;
+        (void) pthread_mutex_unlock(&w->mutex);
+        return;
+    }
+    while (w->len + len > w->size && !w->drop && !w->stop) {
+        (void) pthread_cond_wait(&w->not_full, &w->mutex);
+    }
+    if (w->len + len > w->size) {
+        w->dropped++;
     } else {
-        mg_strlcpy(date, "01/Jan/1970:00:00:00 +0000", sizeof(date));
-        date[sizeof(date) - 1] = '\0';
+        memcpy(w->buf + w->len, record, len);
+        if (w->len == 0) {
+            (void) pthread_cond_signal(&w->not_empty);
+        }
+        w->len += len;
+    }
+    (void) pthread_mutex_unlock(&w->mutex);
+}
+
+static int64_t log_lines_dropped(struct log_writer *w)
+{
+    int64_t dropped = 0;
+
+    if (w != NULL) {
+        (void) pthread_mutex_lock(&w->mutex);
+        dropped = w->dropped;
+        (void) pthread_mutex_unlock(&w->mutex);
     }
+    return dropped;
+}
 
-    ri = &conn->request_info;
+static void reopen_log_writer(struct log_writer *w)
+{
+    if (w != NULL) {
+        (void) pthread_mutex_lock(&w->mutex);
+        w->reopen = 1;
+        (void) pthread_cond_signal(&w->not_empty);
+        (void) pthread_mutex_unlock(&w->mutex);
+    }
+}
+
+void mg_reopen_logs(struct mg_context *ctx)
+{
+    reopen_log_writer(ctx->access_log);
+    reopen_log_writer(ctx->error_log);
+}
+
+/* Durations of the phases of a request in microseconds: time in the queue,
+   reading the request, handling it, and in total */
+static void get_request_durations(const struct mg_request_timings *t,
+                                  int64_t durations[4])
+{
+    int64_t start = t->queued ? t->queued : t->request_start;
+    int64_t end = t->last_write > t->handler_end ? t->last_write : t->handler_end;
+
+    durations[0] = t->queued ? t->dequeued - t->queued : 0;
+    durations[1] = t->headers_read - t->request_start;
+    durations[2] = t->handler_end - t->headers_read;
+    durations[3] = end - start;
+}
+
+/* Append the phase durations of a request to an access log line */
+static void print_request_timings(char *buf, size_t buf_len,
+                                  const struct mg_request_timings *t)
+{
+    int64_t d[4];
+
+    get_request_durations(t, d);
+    snprintf(buf, buf_len, " queue=%" INT64_FMT " read=%" INT64_FMT
+             " handle=%" INT64_FMT " total=%" INT64_FMT, d[0], d[1], d[2], d[3]);
+}
+
+/* Format the access log line in combined log format, with the timings if
+   access_log_timings is set */
+static int print_combined_record(const struct mg_connection *conn,
+                                 char *buf, size_t buf_len)
+{
+    const struct mg_request_info *ri = &conn->request_info;
+    char date[64], src_addr[IP_ADDR_STR_LEN];
+    int len;
 
+    log_date_string(conn->ctx, date, sizeof(date), conn->birth_time);
     sockaddr_to_string(src_addr, sizeof(src_addr), &conn->client.rsa);
-    referer = header_val(conn, "Referer");
-    user_agent = header_val(conn, "User-Agent");
 
-    snprintf(buf, sizeof(buf), "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT " %s %s",
+    len = snprintf(buf, buf_len, "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT " %s %s",
             src_addr, ri->remote_user == NULL ? "-" : ri->remote_user, date,
             ri->request_method ? ri->request_method : "-",
             ri->uri ? ri->uri : "-", ri->http_version,
             conn->status_code, conn->num_bytes_sent,
-	    referer, user_agent);
+            header_val(conn, "Referer"), header_val(conn, "User-Agent"));
+
+    if (len > 0 && len < (int) buf_len &&
+        conn->ctx->cfg.access_log_timings) {
+        print_request_timings(buf + len, buf_len - len, &conn->timings);
+    }
+    return len < 0 ? 0 : (int) strlen(buf);
+}
+
+static int64_t get_log_number(const struct mg_connection *conn, int field)
+{
+    int64_t d[4];
+
+    switch (field) {
+    case LOG_REMOTE_PORT:
+        return conn->request_info.remote_port;
+    case LOG_TIME:
+        return (int64_t) conn->birth_time;
+    case LOG_STATUS:
+        return conn->status_code;
+    case LOG_BYTES_SENT:
+        return conn->num_bytes_sent;
+    case LOG_BYTES_RECEIVED:
+        return conn->request_len + conn->consumed_content;
+    case LOG_SSL:
+        return conn->ssl != NULL;
+    default:
+        get_request_durations(&conn->timings, d);
+        return d[field - LOG_QUEUE_USEC];
+    }
+}
+
+/* Return NULL if the request does not have the field */
+static const char *get_log_string(const struct mg_connection *conn,
+                                  int field, char *buf, size_t buf_len)
+{
+    const struct mg_request_info *ri = &conn->request_info;
+
+    switch (field) {
+    case LOG_REMOTE_ADDR:
+        sockaddr_to_string(buf, buf_len, &conn->client.rsa);
+        return buf;
+    case LOG_REMOTE_USER:
+        return ri->remote_user;
+    case LOG_METHOD:
+        return ri->request_method;
+    case LOG_URI:
+        return ri->uri;
+    case LOG_QUERY:
+        return ri->query_string;
+    case LOG_HTTP_VERSION:
+        return ri->http_version;
+    case LOG_HOST:
+        return mg_get_header_id(conn, HTTP_HEADER_HOST);
+    case LOG_REFERER:
+        return mg_get_header(conn, "Referer");
+    case LOG_USER_AGENT:
+        return mg_get_header(conn, "User-Agent");
+    case LOG_HANDLER:
+        return dispatch_class_names[conn->dispatch];
+    case LOG_HANDLER_URI:
+        return conn->request_handler != NULL ?
+               conn->request_handler->uri : NULL;
+#if !defined(NO_SSL)
+    case LOG_SSL_PROTOCOL:
+        return conn->ssl != NULL ? SSL_get_version(conn->ssl) : NULL;
+    case LOG_SSL_CIPHER:
+        return conn->ssl != NULL ?
+               SSL_CIPHER_get_name(SSL_get_current_cipher(conn->ssl)) : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+/* Append s to buf as a JSON string. Return 0 if it does not fit below
+   limit, in which case *len is left unchanged. */
+static int append_json_string(char *buf, size_t *len, size_t limit,
+                              const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t n = *len;
+    unsigned char c;
+
+    if (n + 2 > limit) {
+        return 0;
+    }
+    buf[n++] = '"';
+    for (; *s != '\0'; s++) {
+        c = (unsigned char) *s;
+        if (n + 7 > limit) {
+            return 0;
+        } else if (c == '"' || c == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = (char) c;
+        } else if (c < 0x20) {
+            memcpy(buf + n, "\\u00", 4);
+            buf[n + 4] = hex[c >> 4];
+            buf[n + 5] = hex[c & 15];
+            n += 6;
+        } else {
+            buf[n++] = (char) c;
+        }
+    }
+    buf[n++] = '"';
+    *len = n;
+    return 1;
+}
+
+/* Format the access_log_fields as a JSON object on a line of its own.
+   Fields that do not fit into the buffer are left out. */
+static int print_json_record(const struct mg_connection *conn,
+                             char *buf, size_t buf_len)
+{
+    const struct parsed_config *cfg = &conn->ctx->cfg;
+    char tmp[IP_ADDR_STR_LEN];
+    const char *s;
+    size_t len = 1, mark, limit = buf_len - 2;
+    int i, field, n;
+
+    buf[0] = '{';
+    for (i = 0; i < cfg->num_access_log_fields; i++) {
+        field = cfg->access_log_fields[i];
+        mark = len;
+        n = snprintf(buf + len, limit - len, "%s\"%s\":", len > 1 ? "," : "",
+                     log_fields[field].name);
+        if (n < 0 || (size_t) n >= limit - len) {
+            break;
+        }
+        len += n;
+        if (log_fields[field].is_number) {
+            n = snprintf(buf + len, limit - len, "%" INT64_FMT,
+                         get_log_number(conn, field));
+            if (n < 0 || (size_t) n >= limit - len) {
+                len = mark;
+                break;
+            }
+            len += n;
+        } else if ((s = get_log_string(conn, field, tmp, sizeof(tmp))) == NULL) {
+            if (len + 4 > limit) {
+                len = mark;
+                break;
+            }
+            memcpy(buf + len, "null", 4);
+            len += 4;
+        } else if (!append_json_string(buf, &len, limit, s)) {
+            len = mark;
+        }
+    }
+    buf[len++] = '}';
+    buf[len++] = '\n';
+    return (int) len;
+}
+
+static void put_le(char *p, uint64_t value, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        p[i] = (char) (value >> (8 * i));
+    }
+}
+
+/* Format the access_log_fields as a binary record. All integers are little
+   endian. The record starts with its length (4 bytes) and number of fields
+   (2 bytes). Each field follows as its index in the list of fields of
+   access_log_fields (1 byte), and either a number (8 bytes), or the offset
+   (2 bytes) and length (2 bytes) of a string in the string table, which
+   ends the record. Missing strings, and those that do not fit, have a
+   length of 0xffff. */
+static int print_binary_record(const struct mg_connection *conn,
+                               char *buf, size_t buf_len)
+{
+    const struct parsed_config *cfg = &conn->ctx->cfg;
+    char tmp[IP_ADDR_STR_LEN], *p;
+    const char *s;
+    size_t len = 6, table, slen;
+    int i, field;
+
+    for (i = 0; i < cfg->num_access_log_fields; i++) {
+        len += log_fields[cfg->access_log_fields[i]].is_number ? 9 : 5;
+    }
+    table = len;
+
+    p = buf + 6;
+    for (i = 0; i < cfg->num_access_log_fields; i++) {
+        field = cfg->access_log_fields[i];
+        *p++ = (char) field;
+        if (log_fields[field].is_number) {
+            put_le(p, (uint64_t) get_log_number(conn, field), 8);
+            p += 8;
+            continue;
+        }
+        s = get_log_string(conn, field, tmp, sizeof(tmp));
+        slen = s == NULL ? 0 : strlen(s);
+        if (s == NULL || slen >= 0xffff || len - table + slen > 0xffff ||
+            len + slen > buf_len) {
+            put_le(p, 0, 2);
+            put_le(p + 2, 0xffff, 2);
+        } else {
+            put_le(p, len - table, 2);
+            put_le(p + 2, slen, 2);
+            memcpy(buf + len, s, slen);
+            len += slen;
+        }
+        p += 4;
+    }
+    put_le(buf, len, 4);
+    put_le(buf + 4, (uint64_t) cfg->num_access_log_fields, 2);
+    return (int) len;
+}
+
+static void log_access(const struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+    int to_file = ctx->access_log != NULL ||
+                  ctx->config[ACCESS_LOG_FILE] != NULL;
+    char line[4096], record[2 * MG_BUF_LEN];
+    const char *out = line;
+    int len = 0;
+    FILE *fp;
+
+    /* The callback always gets the combined log format */
+    if (ctx->callbacks.log_access != NULL ||
+        (to_file && ctx->cfg.access_log_format == ACCESS_LOG_COMBINED)) {
+        len = print_combined_record(conn, line, sizeof(line) - 1);
+        if (ctx->callbacks.log_access != NULL) {
+            ctx->callbacks.log_access(conn, line);
+        }
+        line[len++] = '\n';
+    }
+    if (!to_file) {
+        return;
+    }
 
-    if (conn->ctx->callbacks.log_access) {
-        conn->ctx->callbacks.log_access(conn, buf);
+    if (ctx->cfg.access_log_format == ACCESS_LOG_JSON) {
+        len = print_json_record(conn, record, sizeof(record));
+        out = record;
+    } else if (ctx->cfg.access_log_format == ACCESS_LOG_BINARY) {
+        len = print_binary_record(conn, record, sizeof(record));
+        out = record;
     }
 
-    if (fp) {
+    if (ctx->access_log != NULL) {
+        log_write(ctx->access_log, out, (size_t) len);
+    } else if ((fp = fopen(ctx->config[ACCESS_LOG_FILE], "ab")) != NULL) {
         flockfile(fp);
-        fprintf(fp, "%s", buf);
-        fputc('\n', fp);
+        IGNORE_UNUSED_RESULT(fwrite(out, 1, (size_t) len, fp));
         fflush(fp);
         funlockfile(fp);
         fclose(fp);
@@ -6106,30 +9697,19 @@ static void log_access(const struct mg_connection *conn)
 
 /* Verify given socket address against the ACL.
    Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed. */
-static int check_acl(struct mg_context *ctx, uint32_t remote_ip)
+static int check_acl(const struct mg_context *ctx, uint32_t remote_ip)
 {
-    int allowed, flag;
-    uint32_t net, mask;
-    struct vec vec;
-    const char *list = ctx->config[ACCESS_CONTROL_LIST];
-
-    /* If any ACL is set, deny by default */
-    allowed = list == NULL ? '+' : '-';
-
-    while ((list = next_option(list, &vec, NULL)) != NULL) {
-        flag = vec.ptr[0];
-        if ((flag != '+' && flag != '-') ||
-            parse_net(&vec.ptr[1], &net, &mask) == 0) {
-            mg_cry(fc(ctx), "%s: subnet must be [+|-]x.x.x.x[/x]", __func__);
-            return -1;
-        }
+    const struct acl_rule *rule = ctx->cfg.acl;
+    const struct acl_rule *end = rule + ctx->cfg.num_acl_rules;
+    int allowed = ctx->cfg.acl_default_allow;
 
-        if (net == (remote_ip & mask)) {
-            allowed = flag;
+    for (; rule < end; rule++) {
+        if (rule->net == (remote_ip & rule->mask)) {
+            allowed = rule->allow;
         }
     }
 
-    return allowed == '+';
+    return allowed;
 }
 
 #if !defined(_WIN32)
@@ -6319,13 +9899,252 @@ static int set_gpass_option(struct mg_context *ctx)
     return 1;
 }
 
+static int count_options(const char *list)
+{
+    struct vec vec;
+    int n = 0;
+
+    while ((list = next_option(list, &vec, NULL)) != NULL) {
+        n++;
+    }
+    return n;
+}
+
 static int set_acl_option(struct mg_context *ctx)
 {
-    return check_acl(ctx, (uint32_t) 0x7f000001UL) != -1;
+    const char *list = ctx->config[ACCESS_CONTROL_LIST];
+    struct acl_rule *rule;
+    struct vec vec;
+
+    /* If any ACL is set, deny by default */
+    ctx->cfg.acl_default_allow = list == NULL;
+    if (list == NULL ||
+        (ctx->cfg.acl = (struct acl_rule *)
+         mg_calloc(count_options(list) + 1, sizeof(*rule))) == NULL) {
+        return list == NULL;
+    }
+
+    while ((list = next_option(list, &vec, NULL)) != NULL) {
+        rule = &ctx->cfg.acl[ctx->cfg.num_acl_rules];
+        if ((vec.ptr[0] != '+' && vec.ptr[0] != '-') ||
+            parse_net(&vec.ptr[1], &rule->net, &rule->mask) == 0) {
+            mg_cry(fc(ctx), "%s: subnet must be [+|-]x.x.x.x[/x]", __func__);
+            return 0;
+        }
+        rule->allow = vec.ptr[0] == '+';
+        ctx->cfg.num_acl_rules++;
+    }
+
+    return 1;
+}
+
+/* Compile access_log_format and access_log_fields */
+static int set_access_log_format_option(struct mg_context *ctx)
+{
+    struct parsed_config *cfg = &ctx->cfg;
+    const char *format = ctx->config[ACCESS_LOG_FORMAT];
+    const char *list = ctx->config[ACCESS_LOG_FIELDS];
+    struct vec vec;
+    int i;
+
+    if (!strcmp(format, "combined")) {
+        cfg->access_log_format = ACCESS_LOG_COMBINED;
+    } else if (!strcmp(format, "json")) {
+        cfg->access_log_format = ACCESS_LOG_JSON;
+    } else if (!strcmp(format, "binary")) {
+        cfg->access_log_format = ACCESS_LOG_BINARY;
+    } else {
+        mg_cry(fc(ctx), "%s: unknown access_log_format %s", __func__, format);
+        return 0;
+    }
+
+    cfg->num_access_log_fields = 0;
+    while ((list = next_option(list, &vec, NULL)) != NULL) {
+        for (i = 0; i < NUM_LOG_FIELDS; i++) {
+            if (strlen(log_fields[i].name) == vec.len &&
+                !memcmp(log_fields[i].name, vec.ptr, vec.len)) {
+                break;
+            }
+        }
+        if (i == NUM_LOG_FIELDS ||
+            cfg->num_access_log_fields == NUM_LOG_FIELDS) {
+            mg_cry(fc(ctx), "%s: bad access_log_fields entry %.*s",
+                   __func__, (int) vec.len, vec.ptr);
+            return 0;
+        }
+        cfg->access_log_fields[cfg->num_access_log_fields++] =
+            (unsigned char) i;
+    }
+    return 1;
+}
+
+static int set_throttle_option(struct mg_context *ctx)
+{
+    const char *spec = ctx->config[THROTTLE];
+    struct throttle_rule *rule;
+    struct vec vec, val;
+    const char *flag;
+    char mult;
+    double v;
+    int shared;
+
+    if (spec == NULL ||
+        (ctx->cfg.throttle = (struct throttle_rule *)
+         mg_calloc(count_options(spec) + 1, sizeof(*rule))) == NULL) {
+        return spec == NULL;
+    }
+
+    /* Entries with a malformed rate are ignored */
+    while ((spec = next_option(spec, &vec, &val)) != NULL) {
+        shared = 0;
+        if ((flag = (const char *) memchr(val.ptr, ':', val.len)) != NULL) {
+            if (val.len - (flag - val.ptr) != 7 ||
+                mg_strncasecmp(flag + 1, "shared", 6) != 0) {
+                continue;
+            }
+            shared = 1;
+        }
+        mult = ',';
+        if (sscanf(val.ptr, "%lf%c", &v, &mult) < 1 || v < 0 ||
+            (lowercase(&mult) != 'k' && lowercase(&mult) != 'm' &&
+             mult != ',' && mult != ':')) {
+            continue;
+        }
+        v *= lowercase(&mult) == 'k' ? 1024 : lowercase(&mult) == 'm' ? 1048576 : 1;
+        rule = &ctx->cfg.throttle[ctx->cfg.num_throttle_rules++];
+        rule->rate = (int) v;
+        if (shared && rule->rate > 0) {
+            if ((rule->bucket = (struct token_bucket *)
+                 mg_calloc(1, sizeof(*rule->bucket))) == NULL) {
+                return 0;
+            }
+            init_token_bucket(rule->bucket, rule->rate);
+            rule->bucket->shared = 1;
+            (void) pthread_mutex_init(&rule->bucket->mutex, NULL);
+        }
+        if (vec.len == 1 && vec.ptr[0] == '*') {
+            rule->net = rule->mask = 0;
+        } else if (parse_net(vec.ptr, &rule->net, &rule->mask) == 0 &&
+                   !compile_pattern(&rule->uri, vec.ptr, (int) vec.len)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int is_option_yes(const struct mg_context *ctx, int index)
+{
+    return ctx->config[index] != NULL &&
+           !mg_strcasecmp(ctx->config[index], "yes");
+}
+
+static int set_pattern_option(struct mg_context *ctx, struct pattern *p,
+                              int index)
+{
+    const char *pattern = ctx->config[index];
+
+    return compile_pattern(p, pattern,
+                           pattern == NULL ? 0 : (int) strlen(pattern));
+}
+
+static int set_rewrite_option(struct mg_context *ctx)
+{
+    const char *list = ctx->config[REWRITE];
+    struct rewrite_rule *rule;
+    struct vec a, b;
+
+    if (list == NULL ||
+        (ctx->cfg.rewrite = (struct rewrite_rule *)
+         mg_calloc(count_options(list) + 1, sizeof(*rule))) == NULL) {
+        return list == NULL;
+    }
+
+    while ((list = next_option(list, &a, &b)) != NULL) {
+        rule = &ctx->cfg.rewrite[ctx->cfg.num_rewrite_rules++];
+        rule->dir = b.ptr;
+        rule->dir_len = (int) b.len;
+        if (!compile_pattern(&rule->uri, a.ptr, (int) a.len)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void free_parsed_config(struct parsed_config *cfg)
+{
+    int i;
+
+    for (i = 0; i < cfg->num_throttle_rules; i++) {
+        free_pattern(&cfg->throttle[i].uri);
+        if (cfg->throttle[i].bucket != NULL) {
+            (void) pthread_mutex_destroy(&cfg->throttle[i].bucket->mutex);
+            mg_free(cfg->throttle[i].bucket);
+        }
+    }
+    for (i = 0; i < cfg->num_rewrite_rules; i++) {
+        free_pattern(&cfg->rewrite[i].uri);
+    }
+    free_pattern(&cfg->cgi_pattern);
+    free_pattern(&cfg->ssi_pattern);
+    free_pattern(&cfg->lua_script_pattern);
+    free_pattern(&cfg->lua_page_pattern);
+    free_pattern(&cfg->lua_websocket_pattern);
+    free_pattern(&cfg->hide_files);
+    free_pattern(&cfg->passwords_file);
+    free_pattern(&cfg->compression_mime_types);
+    mg_free(cfg->acl);
+    mg_free(cfg->throttle);
+    mg_free(cfg->rewrite);
+}
+
+/* Fill ctx->cfg from the option strings, so that requests need not parse
+   them again */
+static int set_parsed_config(struct mg_context *ctx)
+{
+    static const char passwords_file_pattern[] = "**" PASSWORDS_FILE_NAME "$";
+    struct parsed_config *cfg = &ctx->cfg;
+
+    cfg->keep_alive = is_option_yes(ctx, ENABLE_KEEP_ALIVE);
+    cfg->decode_url = is_option_yes(ctx, DECODE_URL);
+    cfg->directory_listing = is_option_yes(ctx, ENABLE_DIRECTORY_LISTING);
+    cfg->access_log_timings = is_option_yes(ctx, ACCESS_LOG_TIMINGS);
+    cfg->request_timeout = atoi(ctx->config[REQUEST_TIMEOUT]);
+
+    if (!set_pattern_option(ctx, &cfg->cgi_pattern, CGI_EXTENSIONS) ||
+        !set_pattern_option(ctx, &cfg->ssi_pattern, SSI_EXTENSIONS) ||
+#if defined(USE_LUA)
+        !set_pattern_option(ctx, &cfg->lua_script_pattern,
+                            LUA_SCRIPT_EXTENSIONS) ||
+        !set_pattern_option(ctx, &cfg->lua_page_pattern,
+                            LUA_SERVER_PAGE_EXTENSIONS) ||
+#endif
+#if defined(USE_LUA) && defined(USE_WEBSOCKET)
+        !set_pattern_option(ctx, &cfg->lua_websocket_pattern,
+                            LUA_WEBSOCKET_EXTENSIONS) ||
+#endif
+        !set_pattern_option(ctx, &cfg->hide_files, HIDE_FILES) ||
+        !set_pattern_option(ctx, &cfg->compression_mime_types,
+                            COMPRESSION_MIME_TYPES) ||
+        !compile_pattern(&cfg->passwords_file, passwords_file_pattern,
+                         (int) sizeof(passwords_file_pattern) - 1) ||
+        !set_rewrite_option(ctx) ||
+        !set_throttle_option(ctx)) {
+        mg_cry(fc(ctx), "%s: out of memory", __func__);
+        return 0;
+    }
+
+    return set_access_log_format_option(ctx);
 }
 
 static void reset_per_request_attributes(struct mg_connection *conn)
 {
+    conn->timings.headers_read = conn->timings.handler_start = 0;
+    conn->timings.handler_end = conn->timings.last_write = 0;
+    conn->dispatch = DISPATCH_OTHER;
+    conn->request_handler = NULL;
+    conn->header_index.valid = 0;
     conn->path_info = NULL;
     conn->num_bytes_sent = conn->consumed_content = 0;
     conn->status_code = -1;
@@ -6473,13 +10292,15 @@ static int is_valid_uri(const char *uri)
 
 static int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len, int *err)
 {
+    struct request_scan scan;
     const char *cl;
 
     ebuf[0] = '\0';
     *err = 0;
     reset_per_request_attributes(conn);
+    conn->timings.request_start = get_monotonic_usec();
     conn->request_len = read_request(NULL, conn, conn->buf, conn->buf_size,
-                                     &conn->data_len);
+                                     &conn->data_len, &scan);
     assert(conn->request_len < 0 || conn->data_len >= conn->request_len);
 
     if (conn->request_len == 0 && conn->data_len == conn->buf_size) {
@@ -6489,17 +10310,18 @@ static int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len, int *
     } else if (conn->request_len <= 0) {
         snprintf(ebuf, ebuf_len, "%s", "Client closed connection");
 	return 0;
-    } else if (parse_http_message(conn->buf, conn->buf_size,
-                                  &conn->request_info) <= 0) {
+    } else if (parse_scanned_message(conn->buf, conn->request_len, &scan,
+                                     &conn->request_info) <= 0) {
         snprintf(ebuf, ebuf_len, "Bad request: [%.*s]", conn->data_len, conn->buf);
 	*err = 400;
 	return 0;
     } else {
         /* Message is a valid request or response */
-        if (( cl = get_header(&conn->request_info, "Transfer-encoding")) != NULL && strcmp(cl,"chunked") == 0) {
+        index_headers(conn);
+        if (( cl = mg_get_header_id(conn, HTTP_HEADER_TRANSFER_ENCODING)) != NULL && strcmp(cl,"chunked") == 0) {
             conn->is_chunked = 1;
             conn->content_len = 0;
-	} else if ((cl = get_header(&conn->request_info, "Content-Length")) != NULL) {
+	} else if ((cl = mg_get_header_id(conn, HTTP_HEADER_CONTENT_LENGTH)) != NULL) {
             /* Request/response has content length set */
 	    char *endptr;
             conn->content_len = strtoll(cl, &endptr, 10);
@@ -6508,9 +10330,9 @@ static int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len, int *
 		*err = 400;
 	        return 0;
 	    }
-        } else if (!mg_strcasecmp(conn->request_info.request_method, "POST") ||
-                   !mg_strcasecmp(conn->request_info.request_method, "PUT")) {
-            /* POST or PUT request without content length set */
+        } else if (http_methods[conn->request_info.method_id].flags &
+                   METHOD_HAS_BODY) {
+            /* POST, PUT or PATCH request without content length set */
             conn->content_len = -1;
         } else if (!mg_strncasecmp(conn->request_info.request_method, "HTTP/", 5)) {
             /* Response without content length set */
@@ -6520,6 +10342,7 @@ static int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len, int *
             conn->content_len = 0;
         }
         conn->birth_time = time(NULL);
+        conn->timings.headers_read = get_monotonic_usec();
     }
     return 1;
 }
@@ -6549,19 +10372,187 @@ struct mg_connection *mg_download(const char *host, int port, int use_ssl,
     return conn;
 }
 
-static void process_new_connection(struct mg_connection *conn)
+#if defined(USE_KEEP_ALIVE_PARKING)
+/* Remove a connection from the parked list. Must be called with
+   ctx->park_mutex held. */
+static void unlink_parked_socket(struct mg_context *ctx,
+                                 struct parked_socket *ps)
+{
+    if (ps->prev != NULL) {
+        ps->prev->next = ps->next;
+    } else {
+        ctx->parked_head = ps->next;
+    }
+    if (ps->next != NULL) {
+        ps->next->prev = ps->prev;
+    } else {
+        ctx->parked_tail = ps->prev;
+    }
+}
+
+/* Hand an idle keep-alive connection over to the master thread, so the
+   worker becomes free for other clients. The socket is put back into the
+   queue once the client sends its next request.
+   Return 1 if the connection has been parked, 0 otherwise. */
+static int park_connection(struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+    struct parked_socket *ps;
+    struct epoll_event ev;
+    int parked = 0;
+
+    if (ctx->park_fd < 0 ||
+        (ps = (struct parked_socket *) mg_malloc(sizeof(*ps))) == NULL) {
+        return 0;
+    }
+    ps->client = conn->client;
+    ps->queue = conn->queue;
+    ps->parked_at = get_monotonic_usec();
+    ps->next = NULL;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = ps;
+
+    /* The list is linked before the socket is added to the epoll set, so the
+       master never sees an event for a connection it does not know about.
+       park_fd is closed by the master on shutdown. */
+    (void) pthread_mutex_lock(&ctx->park_mutex);
+    if (ctx->park_fd >= 0 && ctx->stop_flag == 0) {
+        ps->prev = ctx->parked_tail;
+        if (ctx->parked_tail != NULL) {
+            ctx->parked_tail->next = ps;
+        } else {
+            ctx->parked_head = ps;
+        }
+        ctx->parked_tail = ps;
+        if (epoll_ctl(ctx->park_fd, EPOLL_CTL_ADD, ps->client.sock, &ev) == 0) {
+            parked = 1;
+        } else {
+            mg_cry(conn, "%s: epoll_ctl(EPOLL_CTL_ADD) failed: %s",
+                   __func__, strerror(ERRNO));
+            unlink_parked_socket(ctx, ps);
+        }
+    }
+    (void) pthread_mutex_unlock(&ctx->park_mutex);
+
+    if (!parked) {
+        mg_free(ps);
+    }
+    return parked;
+}
+#endif /* USE_KEEP_ALIVE_PARKING */
+
+static int latency_bucket(int64_t usec)
+{
+    int msb = HIST_SUB_BITS;
+
+    if (usec < (1 << HIST_SUB_BITS)) {
+        return usec < 0 ? 0 : (int) usec;
+    }
+    while (msb < HIST_MAX_BITS - 1 && (usec >> (msb + 1)) != 0) {
+        msb++;
+    }
+    if ((usec >> (msb + 1)) != 0) {
+        return HIST_BUCKETS - 1;
+    }
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           (int) ((usec >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* Highest value counted in a bucket */
+static int64_t latency_bucket_limit(int bucket)
+{
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    int64_t mantissa = (1 << HIST_SUB_BITS) | (bucket & ((1 << HIST_SUB_BITS) - 1));
+
+    if (shift < 0) {
+        return bucket;
+    }
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static void record_latency(struct latency_histogram *hist, int64_t usec)
+{
+    hist->count++;
+    hist->sum += usec;
+    if (usec > hist->max) {
+        hist->max = usec;
+    }
+    hist->buckets[latency_bucket(usec)]++;
+}
+
+static void merge_latency(struct latency_histogram *dst,
+                          const struct latency_histogram *src)
+{
+    int i;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+/* Update the worker's counters after a request has been handled */
+static void count_request(struct mg_connection *conn)
+{
+    const struct mg_request_timings *t = &conn->timings;
+    int status_class = conn->status_code / 100;
+    int64_t start = t->queued ? t->queued : t->request_start;
+    int64_t end = t->last_write > t->handler_end ? t->last_write : t->handler_end;
+
+    conn->stats[STAT_REQUESTS]++;
+    if (conn->client.is_reused) {
+        conn->stats[STAT_KEEP_ALIVE_REQUESTS]++;
+    }
+    conn->stats[status_class >= 1 && status_class <= 5 ?
+                STAT_STATUS_OTHER + status_class : STAT_STATUS_OTHER]++;
+    conn->stats[STAT_BYTES_IN] += conn->request_len + conn->consumed_content;
+    conn->stats[STAT_BYTES_OUT] += conn->num_bytes_sent;
+
+    record_latency(&conn->dispatch_latency[conn->dispatch], end - start);
+    record_latency(&conn->status_latency[status_class >= 1 &&
+                                         status_class <= 5 ?
+                                         status_class : 0], end - start);
+    if (conn->request_handler != NULL) {
+        (void) pthread_mutex_lock(&conn->ctx->latency_mutex);
+        record_latency(&conn->request_handler->latency, end - start);
+        (void) pthread_mutex_unlock(&conn->ctx->latency_mutex);
+    }
+}
+
+/* Done with the request handler, its table may be freed. Must be called
+   after the last use of conn->request_handler, including log_access(). */
+static void release_request_handler(struct mg_connection *conn)
+{
+    if (conn->routes != NULL) {
+        (void) pthread_mutex_lock(&conn->mutex);
+        conn->routes = NULL;
+        (void) pthread_mutex_unlock(&conn->mutex);
+    }
+}
+
+/* Serve requests on a connection until it is closed.
+   Return 1 if the connection has been parked and the socket is no longer
+   owned by the calling worker, 0 if it must be closed. */
+static int process_new_connection(struct mg_connection *conn)
 {
     struct mg_request_info *ri = &conn->request_info;
     int keep_alive_enabled, keep_alive, discard_len;
     char ebuf[100];
 
-    keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
+    keep_alive_enabled = conn->ctx->cfg.keep_alive;
 
     /* Important: on new connection, reset the receiving buffer. Credit goes
        to crule42. */
     conn->data_len = 0;
     do {
 	int err;
+        conn->buffer_output = 1;
         if (!getreq(conn, ebuf, sizeof(ebuf), &err)) {
             if (err > 0) {
               send_http_error(conn, err, "Bad Request", "%s", ebuf);
@@ -6578,10 +10569,16 @@ static void process_new_connection(struct mg_connection *conn)
 
         if (ebuf[0] == '\0') {
             handle_request(conn);
+            end_output_buffering(conn);
+            conn->timings.handler_end = get_monotonic_usec();
+            count_request(conn);
             if (conn->ctx->callbacks.end_request != NULL) {
                 conn->ctx->callbacks.end_request(conn, conn->status_code);
             }
             log_access(conn);
+            release_request_handler(conn);
+        } else {
+            end_output_buffering(conn);
         }
         if (ri->remote_user != NULL) {
             mg_free((void *) ri->remote_user);
@@ -6606,45 +10603,649 @@ static void process_new_connection(struct mg_connection *conn)
         conn->data_len -= discard_len;
         assert(conn->data_len >= 0);
         assert(conn->data_len <= conn->buf_size);
+
+        /* A following request on this connection is not queued */
+        conn->timings.queued = conn->timings.dequeued = 0;
+        conn->client.is_reused = 1;
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+        /* Nothing is pipelined behind this request: do not wait for the next
+           one in recv(), but let the master thread watch the socket. SSL
+           connections keep their worker, since the SSL state lives here. */
+        if (keep_alive && conn->data_len == 0 && !conn->client.is_ssl &&
+            park_connection(conn)) {
+            return 1;
+        }
+#endif
     } while (keep_alive);
+
+    return 0;
+}
+
+/* Create a socket queue of at least size slots. The number of slots is
+   rounded up to a power of two, so positions can wrap around. */
+static struct socket_queue *create_socket_queue(struct mg_context *ctx,
+                                                int size)
+{
+    struct socket_queue *q;
+    unsigned n = 1, i;
+
+    while (n < (unsigned) size) {
+        n <<= 1;
+    }
+    if ((q = (struct socket_queue *) mg_calloc(1, sizeof(*q))) == NULL) {
+        return NULL;
+    }
+    if ((q->slots = (struct sq_slot *) mg_calloc(n, sizeof(q->slots[0]))) ==
+        NULL) {
+        mg_free(q);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        q->slots[i].seq = i;
+    }
+    q->ctx = ctx;
+    q->mask = n - 1;
+#if defined(NO_ATOMICS)
+    (void) pthread_mutex_init(&q->ring_mutex, NULL);
+#endif
+    (void) pthread_mutex_init(&q->mutex, NULL);
+    (void) pthread_cond_init(&q->not_empty, NULL);
+    (void) pthread_cond_init(&q->not_full, NULL);
+    return q;
+}
+
+static void destroy_socket_queue(struct socket_queue *q)
+{
+    if (q != NULL) {
+#if defined(NO_ATOMICS)
+        (void) pthread_mutex_destroy(&q->ring_mutex);
+#endif
+        (void) pthread_mutex_destroy(&q->mutex);
+        (void) pthread_cond_destroy(&q->not_empty);
+        (void) pthread_cond_destroy(&q->not_full);
+        mg_free(q->slots);
+        mg_free(q);
+    }
+}
+
+/* Number of queued sockets. Without a lock this is only a snapshot. */
+static int sq_depth(const struct socket_queue *q)
+{
+    unsigned tail = q->tail;
+
+    return (int) (q->head - tail);
+}
+
+/* Order a store to idle or blocked against the following queue access, or
+   a queue access against the following load of idle or blocked. Without
+   atomics, ring_mutex does that. */
+static void sq_fence(void)
+{
+#if !defined(NO_ATOMICS)
+    mg_memory_barrier();
+#endif
+}
+
+/* Append a socket unless the queue is full. Return 1 if it was queued. */
+static int sq_try_push(struct socket_queue *q, const struct socket *sp)
+{
+    struct sq_slot *slot;
+    unsigned pos;
+#if !defined(NO_ATOMICS)
+    int depth, max_depth;
+#endif
+
+#if defined(NO_ATOMICS)
+    (void) pthread_mutex_lock(&q->ring_mutex);
+    pos = q->head;
+    slot = &q->slots[pos & q->mask];
+    if (pos - q->tail > q->mask) {
+        (void) pthread_mutex_unlock(&q->ring_mutex);
+        return 0;
+    }
+    slot->so = *sp;
+    slot->so.queued = get_monotonic_usec();
+    q->head = pos + 1;
+    if (sq_depth(q) > q->max_depth) {
+        q->max_depth = sq_depth(q);
+    }
+    (void) pthread_mutex_unlock(&q->ring_mutex);
+#else
+    for (pos = q->head;;) {
+        slot = &q->slots[pos & q->mask];
+        depth = (int) (slot->seq - pos);
+        if (depth == 0 && mg_atomic_cas(&q->head, pos, pos + 1)) {
+            break;
+        } else if (depth < 0) {
+            /* The slot still holds the socket of the previous round */
+            return 0;
+        }
+        pos = q->head;
+    }
+    slot->so = *sp;
+    slot->so.queued = get_monotonic_usec();
+    mg_memory_barrier();
+    slot->seq = pos + 1;
+
+    depth = sq_depth(q);
+    while ((max_depth = q->max_depth) < depth &&
+           !mg_atomic_cas(&q->max_depth, max_depth, depth)) {
+    }
+#endif
+    return 1;
+}
+
+/* Take the oldest socket unless the queue is empty. Return 1 if *sp was
+   filled in. */
+static int sq_try_pop(struct socket_queue *q, struct socket *sp)
+{
+    unsigned pos;
+#if !defined(NO_ATOMICS)
+    struct sq_slot *slot;
+    int diff;
+#endif
+
+#if defined(NO_ATOMICS)
+    (void) pthread_mutex_lock(&q->ring_mutex);
+    pos = q->tail;
+    if (pos == q->head) {
+        (void) pthread_mutex_unlock(&q->ring_mutex);
+        return 0;
+    }
+    *sp = q->slots[pos & q->mask].so;
+    q->tail = pos + 1;
+    (void) pthread_mutex_unlock(&q->ring_mutex);
+#else
+    for (pos = q->tail;;) {
+        slot = &q->slots[pos & q->mask];
+        diff = (int) (slot->seq - (pos + 1));
+        if (diff == 0 && mg_atomic_cas(&q->tail, pos, pos + 1)) {
+            break;
+        } else if (diff < 0) {
+            /* Nothing has been produced at this position yet */
+            return 0;
+        }
+        pos = q->tail;
+    }
+    *sp = slot->so;
+    mg_memory_barrier();
+    slot->seq = pos + q->mask + 1;
+#endif
+    return 1;
+}
+
+/* Worker threads take accepted socket from the queue. Additional workers
+   started on demand (is_elastic) give up after thread_idle_timeout_ms
+   without work. Return 0 if the worker should exit. */
+static int consume_socket(struct socket_queue *q, struct socket *sp,
+                          int is_elastic)
+{
+    struct mg_context *ctx = q->ctx;
+    struct timespec abstime;
+    int popped;
+
+    if (!(popped = sq_try_pop(q, sp))) {
+        (void) pthread_mutex_lock(&q->mutex);
+        DEBUG_TRACE("going idle");
+
+        if (is_elastic) {
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            abstime.tv_sec += ctx->thread_idle_timeout / 1000;
+            abstime.tv_nsec += (ctx->thread_idle_timeout % 1000) * 1000000;
+            if (abstime.tv_nsec >= 1000000000) {
+                abstime.tv_sec++;
+                abstime.tv_nsec -= 1000000000;
+            }
+        }
+
+        /* Announce that we are idle before looking at the queue again, so
+           that a producer either sees us waiting or we see its socket */
+        q->idle++;
+        sq_fence();
+        while (!(popped = sq_try_pop(q, sp)) && ctx->stop_flag == 0) {
+            if (!is_elastic) {
+                (void) pthread_cond_wait(&q->not_empty, &q->mutex);
+            } else if (pthread_cond_timedwait(&q->not_empty, &q->mutex,
+                                              &abstime) != 0) {
+                popped = sq_try_pop(q, sp);
+                break;
+            }
+        }
+        q->idle--;
+        (void) pthread_mutex_unlock(&q->mutex);
+
+        if (!popped && ctx->stop_flag == 0) {
+            DEBUG_TRACE("%s", "idle timeout, exiting");
+            return 0;
+        }
+    }
+
+    if (popped) {
+        DEBUG_TRACE("grabbed socket %d, going busy", sp->sock);
+
+        /* Only wake up a producer if one is actually waiting for a free
+           slot */
+        sq_fence();
+        if (q->blocked > 0) {
+            (void) pthread_mutex_lock(&q->mutex);
+            (void) pthread_cond_signal(&q->not_full);
+            (void) pthread_mutex_unlock(&q->mutex);
+        }
+    }
+
+    return !ctx->stop_flag;
+}
+
+/* Remove an exiting worker from ctx->workers, keeping its counters.
+   Must be called with ctx->thread_mutex held. */
+static void remove_worker_stats(struct mg_context *ctx,
+                                struct mg_connection *conn)
+{
+    struct mg_connection **pp;
+    int i;
+
+    for (pp = &ctx->workers; *pp != NULL; pp = &(*pp)->next_worker) {
+        if (*pp == conn) {
+            *pp = conn->next_worker;
+            break;
+        }
+    }
+    for (i = 0; i < NUM_STATS; i++) {
+        ctx->stats[i] += conn->stats[i];
+    }
+    for (i = 0; i < NUM_DISPATCH_CLASSES; i++) {
+        merge_latency(&ctx->dispatch_latency[i], &conn->dispatch_latency[i]);
+    }
+    for (i = 0; i < 6; i++) {
+        merge_latency(&ctx->status_latency[i], &conn->status_latency[i]);
+    }
+}
+
+int mg_get_context_stats(struct mg_context *ctx, struct mg_context_stats *stats)
+{
+    int64_t sum[NUM_STATS];
+    struct mg_connection *conn;
+    struct socket_queue *q;
+    int i;
+
+    if (ctx == NULL || stats == NULL) {
+        return 0;
+    }
+
+    (void) pthread_mutex_lock(&ctx->thread_mutex);
+    memcpy(sum, ctx->stats, sizeof(sum));
+    for (conn = ctx->workers; conn != NULL; conn = conn->next_worker) {
+        for (i = 0; i < NUM_STATS; i++) {
+            sum[i] += conn->stats[i];
+        }
+    }
+    stats->num_threads = ctx->num_threads;
+    stats->rejected = ctx->sq_shed_count;
+    (void) pthread_mutex_unlock(&ctx->thread_mutex);
+
+    /* Sum up the queues of all acceptors */
+    stats->idle_threads = stats->queue_depth = stats->queue_size = 0;
+    stats->queue_max_depth = 0;
+    stats->queue_full = stats->queue_full_usec = 0;
+    for (i = 0; i < ctx->num_queues; i++) {
+        q = ctx->queues[i];
+        (void) pthread_mutex_lock(&q->mutex);
+        stats->idle_threads += q->idle;
+        stats->queue_depth += sq_depth(q);
+        stats->queue_size += (int) q->mask + 1;
+        if (q->max_depth > stats->queue_max_depth) {
+            stats->queue_max_depth = q->max_depth;
+        }
+        stats->queue_full += q->full_count;
+        stats->queue_full_usec += q->wait_usec;
+        (void) pthread_mutex_unlock(&q->mutex);
+    }
+
+    stats->connections = sum[STAT_CONNECTIONS];
+    stats->queued_usec = sum[STAT_QUEUED_USEC];
+    stats->requests = sum[STAT_REQUESTS];
+    stats->keep_alive_requests = sum[STAT_KEEP_ALIVE_REQUESTS];
+    for (i = 0; i < 6; i++) {
+        stats->status_class[i] = sum[STAT_STATUS_OTHER + i];
+    }
+    stats->bytes_in = sum[STAT_BYTES_IN];
+    stats->bytes_out = sum[STAT_BYTES_OUT];
+    stats->websocket_frames_in = sum[STAT_WEBSOCKET_FRAMES_IN];
+    stats->websocket_frames_out = sum[STAT_WEBSOCKET_FRAMES_OUT];
+    stats->ssl_handshakes = sum[STAT_SSL_HANDSHAKES];
+    stats->static_cache_hits = sum[STAT_STATIC_CACHE_HITS];
+    stats->static_cache_misses = sum[STAT_STATIC_CACHE_MISSES];
+    stats->static_cache_evictions = sum[STAT_STATIC_CACHE_EVICTIONS];
+    stats->log_lines_dropped = log_lines_dropped(ctx->access_log) +
+                               log_lines_dropped(ctx->error_log);
+
+    return 1;
+}
+
+static int64_t latency_percentile(const struct latency_histogram *hist,
+                                  int64_t per_mille)
+{
+    int64_t rank = (hist->count * per_mille + 999) / 1000, seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank && seen > 0) {
+            return latency_bucket_limit(i) < hist->max ?
+                   latency_bucket_limit(i) : hist->max;
+        }
+    }
+    return 0;
+}
+
+/* Fill in win with the requests recorded in cur since base was taken, and
+   take a new base if reset is set. The maximum of the window is estimated
+   from its highest bucket, only the overall maximum is exact. */
+static void latency_window(struct latency_histogram *win,
+                           const struct latency_histogram *cur,
+                           struct latency_histogram *base, int reset)
+{
+    int i, top = -1;
+
+    win->count = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        win->buckets[i] = cur->buckets[i] - base->buckets[i];
+        win->count += win->buckets[i];
+        if (win->buckets[i] > 0) {
+            top = i;
+        }
+    }
+    win->sum = cur->sum - base->sum;
+    win->max = top < 0 ? 0 : latency_bucket_limit(top) < cur->max ?
+               latency_bucket_limit(top) : cur->max;
+    if (reset) {
+        *base = *cur;
+    }
+}
+
+/* Count and sum are totals, the percentiles cover the reader's window */
+static void fill_latency_stats(struct mg_latency_stats *ls,
+                               const struct latency_histogram *hist,
+                               struct latency_histogram *base,
+                               const char *group, const char *name, int reset)
+{
+    struct latency_histogram win;
+
+    latency_window(&win, hist, base, reset);
+    ls->group = group;
+    ls->name = name;
+    ls->count = hist->count;
+    ls->sum_usec = hist->sum;
+    ls->max_usec = win.max;
+    ls->p50_usec = latency_percentile(&win, 500);
+    ls->p90_usec = latency_percentile(&win, 900);
+    ls->p99_usec = latency_percentile(&win, 990);
+    ls->p999_usec = latency_percentile(&win, 999);
+}
+
+static int get_latency_stats(struct mg_context *ctx, int reader, int reset,
+                             mg_latency_stats_callback callback, void *cbdata)
+{
+    static const char *status_names[6] = {
+        "other", "1xx", "2xx", "3xx", "4xx", "5xx"
+    };
+    struct mg_latency_stats ls[NUM_DISPATCH_CLASSES + 6];
+    struct latency_histogram *dispatch, *status;
+    struct mg_request_handler_info *rh;
+    struct mg_connection *conn;
+    int i;
+
+    if (ctx == NULL || callback == NULL) {
+        return 0;
+    }
+
+    dispatch = (struct latency_histogram *)
+        mg_malloc(sizeof(ctx->dispatch_latency) + sizeof(ctx->status_latency));
+    if (dispatch == NULL) {
+        return 0;
+    }
+    status = dispatch + NUM_DISPATCH_CLASSES;
+
+    (void) pthread_mutex_lock(&ctx->latency_mutex);
+    for (rh = ctx->request_handlers; rh != NULL; rh = rh->next) {
+        fill_latency_stats(&ls[0], &rh->latency, &rh->latency_base[reader],
+                           "handler", rh->uri, reset);
+        callback(&ls[0], cbdata);
+    }
+    (void) pthread_mutex_unlock(&ctx->latency_mutex);
+
+    /* Workers update their own histograms without locking. Sum them up
+       with those of exited workers. */
+    (void) pthread_mutex_lock(&ctx->thread_mutex);
+    memcpy(dispatch, ctx->dispatch_latency, sizeof(ctx->dispatch_latency));
+    memcpy(status, ctx->status_latency, sizeof(ctx->status_latency));
+    for (conn = ctx->workers; conn != NULL; conn = conn->next_worker) {
+        for (i = 0; i < NUM_DISPATCH_CLASSES; i++) {
+            merge_latency(&dispatch[i], &conn->dispatch_latency[i]);
+        }
+        for (i = 0; i < 6; i++) {
+            merge_latency(&status[i], &conn->status_latency[i]);
+        }
+    }
+    for (i = 0; i < NUM_DISPATCH_CLASSES; i++) {
+        fill_latency_stats(&ls[i], &dispatch[i], &ctx->dispatch_base[reader][i],
+                           "dispatch", dispatch_class_names[i], reset);
+    }
+    for (i = 0; i < 6; i++) {
+        fill_latency_stats(&ls[NUM_DISPATCH_CLASSES + i], &status[i],
+                           &ctx->status_base[reader][i], "status",
+                           status_names[i], reset);
+    }
+    (void) pthread_mutex_unlock(&ctx->thread_mutex);
+    mg_free(dispatch);
+
+    for (i = 0; i < NUM_DISPATCH_CLASSES + 6; i++) {
+        callback(&ls[i], cbdata);
+    }
+
+    return 1;
+}
+
+int mg_get_latency_stats(struct mg_context *ctx, int reset,
+                         mg_latency_stats_callback callback, void *cbdata)
+{
+    return get_latency_stats(ctx, LATENCY_READER_API, reset, callback,
+                             cbdata);
 }
 
-/* Worker threads take accepted socket from the queue */
-static int consume_socket(struct mg_context *ctx, struct socket *sp)
+/* Growing output buffer of the metrics handler */
+struct metrics_buf {
+    char *buf;
+    size_t len;
+    size_t size;
+    int error;
+};
+
+static void metrics_printf(struct metrics_buf *mb,
+                           PRINTF_FORMAT_STRING(const char *fmt), ...)
+PRINTF_ARGS(2, 3);
+
+static void metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
 {
-    (void) pthread_mutex_lock(&ctx->thread_mutex);
-    DEBUG_TRACE("going idle");
+    va_list ap;
+    char *new_buf;
+    int n;
 
-    /* If the queue is empty, wait. We're idle at this point. */
-    while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
-        pthread_cond_wait(&ctx->sq_full, &ctx->thread_mutex);
+    while (!mb->error) {
+        va_start(ap, fmt);
+        n = vsnprintf(mb->buf + mb->len, mb->size - mb->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t) n < mb->size - mb->len) {
+            mb->len += n;
+            return;
+        }
+        new_buf = n < 0 ? NULL : (char *) mg_realloc(mb->buf, mb->size * 2);
+        if (new_buf == NULL) {
+            mb->error = 1;
+        } else {
+            mb->buf = new_buf;
+            mb->size *= 2;
+        }
     }
+}
 
-    /* If we're stopping, sq_head may be equal to sq_tail. */
-    if (ctx->sq_head > ctx->sq_tail) {
-        /* Copy socket from the queue and increment tail */
-        *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
-        ctx->sq_tail++;
-        DEBUG_TRACE("grabbed socket %d, going busy", sp->sock);
-
-        /* Wrap pointers if needed */
-        while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-            ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-            ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+/* Print a Prometheus label value, escaping quotes and backslashes */
+static void metrics_print_label(struct metrics_buf *mb, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            metrics_printf(mb, "\\%c", *s);
+        } else if (*s == '\n') {
+            metrics_printf(mb, "%s", "\\n");
+        } else {
+            metrics_printf(mb, "%c", *s);
         }
     }
+}
 
-    (void) pthread_cond_signal(&ctx->sq_empty);
-    (void) pthread_mutex_unlock(&ctx->thread_mutex);
+static void metrics_latency(const struct mg_latency_stats *ls, void *cbdata)
+{
+    static const struct {
+        const char *quantile;
+        size_t offset;
+    } quantiles[] = {
+        {"0.5", offsetof(struct mg_latency_stats, p50_usec)},
+        {"0.9", offsetof(struct mg_latency_stats, p90_usec)},
+        {"0.99", offsetof(struct mg_latency_stats, p99_usec)},
+        {"0.999", offsetof(struct mg_latency_stats, p999_usec)},
+        {"1", offsetof(struct mg_latency_stats, max_usec)}
+    };
+    struct metrics_buf *mb = (struct metrics_buf *) cbdata;
+    size_t i;
 
-    return !ctx->stop_flag;
+    for (i = 0; i < ARRAY_SIZE(quantiles); i++) {
+        metrics_printf(mb, "civetweb_request_latency_seconds{%s=\"",
+                       ls->group);
+        metrics_print_label(mb, ls->name);
+        metrics_printf(mb, "\",quantile=\"%s\"} %.6f\n", quantiles[i].quantile,
+                       *(const long long *) ((const char *) ls +
+                                             quantiles[i].offset) / 1.0E6);
+    }
+    metrics_printf(mb, "civetweb_request_latency_seconds_count{%s=\"",
+                   ls->group);
+    metrics_print_label(mb, ls->name);
+    metrics_printf(mb, "\"} %lld\n", ls->count);
+    metrics_printf(mb, "civetweb_request_latency_seconds_sum{%s=\"",
+                   ls->group);
+    metrics_print_label(mb, ls->name);
+    metrics_printf(mb, "\"} %.6f\n", ls->sum_usec / 1.0E6);
+}
+
+/* Request handler for the metrics_uri option. Serves the server statistics
+   in the Prometheus text exposition format. Latency percentiles cover the
+   requests since the previous scrape. */
+static int metrics_handler(struct mg_connection *conn, void *cbdata)
+{
+    struct mg_context_stats st;
+    struct metrics_buf mb;
+    int i;
+
+    (void) cbdata;
+    mg_get_context_stats(conn->ctx, &st);
+
+    mb.size = 4096;
+    mb.len = 0;
+    mb.error = (mb.buf = (char *) mg_malloc(mb.size)) == NULL;
+
+    metrics_printf(&mb,
+        "# TYPE civetweb_threads gauge\n"
+        "civetweb_threads %d\n"
+        "# TYPE civetweb_idle_threads gauge\n"
+        "civetweb_idle_threads %d\n"
+        "# TYPE civetweb_queue_depth gauge\n"
+        "civetweb_queue_depth %d\n"
+        "# TYPE civetweb_queue_size gauge\n"
+        "civetweb_queue_size %d\n"
+        "# TYPE civetweb_queue_max_depth gauge\n"
+        "civetweb_queue_max_depth %d\n"
+        "# TYPE civetweb_queue_full_total counter\n"
+        "civetweb_queue_full_total %lld\n"
+        "# TYPE civetweb_queue_full_seconds_total counter\n"
+        "civetweb_queue_full_seconds_total %.6f\n"
+        "# TYPE civetweb_rejected_connections_total counter\n"
+        "civetweb_rejected_connections_total %lld\n"
+        "# TYPE civetweb_connections_total counter\n"
+        "civetweb_connections_total %lld\n"
+        "# TYPE civetweb_queued_seconds_total counter\n"
+        "civetweb_queued_seconds_total %.6f\n"
+        "# TYPE civetweb_requests_total counter\n"
+        "civetweb_requests_total %lld\n"
+        "# TYPE civetweb_keep_alive_requests_total counter\n"
+        "civetweb_keep_alive_requests_total %lld\n"
+        "# TYPE civetweb_received_bytes_total counter\n"
+        "civetweb_received_bytes_total %lld\n"
+        "# TYPE civetweb_sent_bytes_total counter\n"
+        "civetweb_sent_bytes_total %lld\n"
+        "# TYPE civetweb_websocket_frames_received_total counter\n"
+        "civetweb_websocket_frames_received_total %lld\n"
+        "# TYPE civetweb_websocket_frames_sent_total counter\n"
+        "civetweb_websocket_frames_sent_total %lld\n"
+        "# TYPE civetweb_ssl_handshakes_total counter\n"
+        "civetweb_ssl_handshakes_total %lld\n"
+        "# TYPE civetweb_static_cache_hits_total counter\n"
+        "civetweb_static_cache_hits_total %lld\n"
+        "# TYPE civetweb_static_cache_misses_total counter\n"
+        "civetweb_static_cache_misses_total %lld\n"
+        "# TYPE civetweb_static_cache_evictions_total counter\n"
+        "civetweb_static_cache_evictions_total %lld\n"
+        "# TYPE civetweb_log_lines_dropped_total counter\n"
+        "civetweb_log_lines_dropped_total %lld\n"
+        "# TYPE civetweb_responses_total counter\n",
+        st.num_threads, st.idle_threads, st.queue_depth, st.queue_size,
+        st.queue_max_depth, st.queue_full, st.queue_full_usec / 1.0E6,
+        st.rejected, st.connections, st.queued_usec / 1.0E6, st.requests,
+        st.keep_alive_requests, st.bytes_in, st.bytes_out,
+        st.websocket_frames_in, st.websocket_frames_out, st.ssl_handshakes,
+        st.static_cache_hits, st.static_cache_misses,
+        st.static_cache_evictions, st.log_lines_dropped);
+    for (i = 1; i <= 5; i++) {
+        metrics_printf(&mb, "civetweb_responses_total{code=\"%dxx\"} %lld\n",
+                       i, st.status_class[i]);
+    }
+    metrics_printf(&mb, "%s", "# TYPE civetweb_request_latency_seconds summary\n");
+    get_latency_stats(conn->ctx, LATENCY_READER_METRICS, 1, metrics_latency,
+                      &mb);
+
+    if (mb.error) {
+        mg_free(mb.buf);
+        return 0;
+    }
+
+    mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %lu\r\n"
+                    "Connection: %s\r\n\r\n",
+                    (unsigned long) mb.len, suggest_connection_header(conn));
+    mg_write(conn, mb.buf, mb.len);
+    conn->status_code = 200;
+    mg_free(mb.buf);
+
+    return 1;
 }
 
-static void *worker_thread_run(void *thread_func_param)
+/* Fill in the client's address in request_info from conn->client.
+   TODO(lsm): Fix IPv6 case */
+static void set_remote_info(struct mg_connection *conn)
 {
-    struct mg_context *ctx = (struct mg_context *) thread_func_param;
+    conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
+    memcpy(&conn->request_info.remote_ip,
+           &conn->client.rsa.sin.sin_addr.s_addr, 4);
+    conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
+    conn->request_info.is_ssl = conn->client.is_ssl;
+}
+
+static void *worker_thread_run(struct socket_queue *q, int is_elastic)
+{
+    struct mg_context *ctx = q->ctx;
     struct mg_connection *conn;
     struct mg_workerTLS tls;
+    int ready;
 
     tls.is_master = 0;
 #if defined(_WIN32) && !defined(__SYMBIAN32__)
@@ -6659,53 +11260,73 @@ static void *worker_thread_run(void *thread_func_param)
         conn->buf_size = MAX_REQUEST_SIZE;
         conn->buf = (char *) (conn + 1);
         conn->ctx = ctx;
+        conn->queue = q;
         conn->request_info.user_data = ctx->user_data;
         /* Allocate a mutex for this connection to allow communication both
            within the request handler and from elsewhere in the application */
         (void) pthread_mutex_init(&conn->mutex, NULL);
 
+        /* Make the counters of this worker visible to mg_get_context_stats() */
+        (void) pthread_mutex_lock(&ctx->thread_mutex);
+        conn->next_worker = ctx->workers;
+        ctx->workers = conn;
+        (void) pthread_mutex_unlock(&ctx->thread_mutex);
+
         /* Call consume_socket() even when ctx->stop_flag > 0, to let it
-           signal sq_empty condvar to wake up the master waiting in
+           signal not_full condvar to wake up the master waiting in
            produce_socket() */
-        while (consume_socket(ctx, &conn->client)) {
+        while (consume_socket(q, &conn->client, is_elastic)) {
             conn->birth_time = time(NULL);
+            conn->timings.queued = conn->client.queued;
+            conn->timings.dequeued = get_monotonic_usec();
+            conn->stats[STAT_CONNECTIONS]++;
+            conn->stats[STAT_QUEUED_USEC] +=
+                conn->timings.dequeued - conn->timings.queued;
 
             /* Fill in IP, port info early so even if SSL setup below fails,
                error handler would have the corresponding info.
-               Thanks to Johannes Winkelmann for the patch.
-               TODO(lsm): Fix IPv6 case */
-            conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
-            memcpy(&conn->request_info.remote_ip,
-                   &conn->client.rsa.sin.sin_addr.s_addr, 4);
-            conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
-            conn->request_info.is_ssl = conn->client.is_ssl;
-
-            if (!conn->client.is_ssl
+               Thanks to Johannes Winkelmann for the patch. */
+            set_remote_info(conn);
+
+            ready = !conn->client.is_ssl;
 #ifndef NO_SSL
-                || sslize(conn, conn->ctx->ssl_ctx, SSL_accept)
+            if (!ready && sslize(conn, conn->ctx->ssl_ctx, SSL_accept)) {
+                conn->stats[STAT_SSL_HANDSHAKES]++;
+                ready = 1;
+            }
 #endif
-               ) {
-                process_new_connection(conn);
+            if (ready) {
+                if (process_new_connection(conn)) {
+                    /* Parked, the master thread owns the socket now */
+                    conn->client.sock = INVALID_SOCKET;
+                    continue;
+                }
             }
 
             close_connection(conn);
         }
     }
 
-    /* Signal master that we're done with connection and exiting */
+    DEBUG_TRACE("exiting");
+    pthread_setspecific(sTlsKey, NULL);
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+    CloseHandle(tls.pthread_cond_helper_mutex);
+#endif
+
+    /* Signal master that we're done with connection and exiting.
+       Additional workers are not joined, so this must be the last access
+       to ctx: the master waits for num_threads to drop to zero, and
+       mg_stop() frees ctx after that. */
     (void) pthread_mutex_lock(&ctx->thread_mutex);
+    if (conn != NULL) {
+        remove_worker_stats(ctx, conn);
+    }
     ctx->num_threads--;
-    (void) pthread_cond_signal(&ctx->thread_cond);
     assert(ctx->num_threads >= 0);
+    (void) pthread_cond_signal(&ctx->thread_cond);
     (void) pthread_mutex_unlock(&ctx->thread_mutex);
 
-    pthread_setspecific(sTlsKey, NULL);
-#if defined(_WIN32) && !defined(__SYMBIAN32__)
-    CloseHandle(tls.pthread_cond_helper_mutex);
-#endif
     mg_free(conn);
-
-    DEBUG_TRACE("exiting");
     return NULL;
 }
 
@@ -6714,100 +11335,322 @@ static void *worker_thread_run(void *thread_func_param)
 #ifdef _WIN32
 static unsigned __stdcall worker_thread(void *thread_func_param)
 {
-    worker_thread_run(thread_func_param);
+    worker_thread_run((struct socket_queue *) thread_func_param, 0);
     return 0;
 }
 #else
 static void *worker_thread(void *thread_func_param)
 {
-    worker_thread_run(thread_func_param);
+    worker_thread_run((struct socket_queue *) thread_func_param, 0);
     return NULL;
 }
 #endif /* _WIN32 */
 
-/* Master thread adds accepted socket to a queue */
-static void produce_socket(struct mg_context *ctx, const struct socket *sp)
+/* Workers beyond min_threads are detached, since they exit on their own */
+static void *elastic_worker_thread(void *thread_func_param)
 {
-    (void) pthread_mutex_lock(&ctx->thread_mutex);
+    worker_thread_run((struct socket_queue *) thread_func_param, 1);
+    return NULL;
+}
+
+/* Acceptor threads add accepted socket to their queue */
+static void produce_socket(struct socket_queue *q, const struct socket *sp)
+{
+    struct mg_context *ctx = q->ctx;
+    int64_t wait_start;
+    int queued, grow = 0;
 
     /* If the queue is full, wait */
-    while (ctx->stop_flag == 0 &&
-           ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-        (void) pthread_cond_wait(&ctx->sq_empty, &ctx->thread_mutex);
+    if (!(queued = sq_try_push(q, sp))) {
+        (void) pthread_mutex_lock(&q->mutex);
+        q->full_count++;
+        wait_start = get_monotonic_usec();
+        q->blocked++;
+        sq_fence();
+        while (!(queued = sq_try_push(q, sp)) && ctx->stop_flag == 0) {
+            (void) pthread_cond_wait(&q->not_full, &q->mutex);
+        }
+        q->blocked--;
+        q->wait_usec += get_monotonic_usec() - wait_start;
+        (void) pthread_mutex_unlock(&q->mutex);
+    }
+    if (queued) {
+        DEBUG_TRACE("queued socket %d", sp->sock);
     }
 
-    if (ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue)) {
-        /* Copy socket to the queue and increment head */
-        ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-        ctx->sq_head++;
-        DEBUG_TRACE("queued socket %d", sp->sock);
+    /* Busy workers pick up the socket when they call consume_socket() */
+    sq_fence();
+    if (q->idle > 0) {
+        (void) pthread_mutex_lock(&q->mutex);
+        (void) pthread_cond_signal(&q->not_empty);
+        (void) pthread_mutex_unlock(&q->mutex);
     }
 
-    (void) pthread_cond_signal(&ctx->sq_full);
-    (void) pthread_mutex_unlock(&ctx->thread_mutex);
+    /* Start another worker for this queue if there are more queued sockets
+       than idle workers. The thread is counted now, so concurrent producers do not
+       exceed max_threads. A fixed size pool never gets here. */
+    if (ctx->stop_flag == 0 && ctx->num_threads < ctx->max_threads &&
+        sq_depth(q) > q->idle) {
+        (void) pthread_mutex_lock(&ctx->thread_mutex);
+        if (ctx->num_threads < ctx->max_threads) {
+            ctx->num_threads++;
+            grow = 1;
+        }
+        (void) pthread_mutex_unlock(&ctx->thread_mutex);
+    }
+
+    if (grow && mg_start_thread(elastic_worker_thread, q) != 0) {
+        mg_cry(fc(ctx), "Cannot start worker thread: %ld", (long) ERRNO);
+        (void) pthread_mutex_lock(&ctx->thread_mutex);
+        ctx->num_threads--;
+        (void) pthread_cond_signal(&ctx->thread_cond);
+        (void) pthread_mutex_unlock(&ctx->thread_mutex);
+    }
 }
 
-static int set_sock_timeout(SOCKET sock, int milliseconds)
+/* Answer a connection with a canned 503 and close it, without involving a
+   worker thread. Used when the socket queue is above its watermark. */
+static void reject_connection(struct mg_context *ctx, const struct socket *so)
 {
-#ifdef _WIN32
-    DWORD t = milliseconds;
-#else
-    struct timeval t;
-    t.tv_sec = milliseconds / 1000;
-    t.tv_usec = (milliseconds * 1000) % 1000000;
-#endif
-    return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &t, sizeof(t)) ||
-           setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &t, sizeof(t));
+    static const char response[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n\r\n";
+    char buf[MG_BUF_LEN];
+    int i;
+
+    /* A plain text reply cannot be sent on an SSL port */
+    if (!so->is_ssl) {
+        (void) send(so->sock, response, sizeof(response) - 1, 0);
+        shutdown(so->sock, SHUT_WR);
+    }
+
+    /* Discard the request that has already arrived. Closing a socket with
+       unread data resets the connection, and the client may lose the
+       response. This runs on an accepting thread, so only what is already
+       there is read, and no more than a few buffers of it. */
+    set_non_blocking_mode(so->sock);
+    for (i = 0; i < 4 && recv(so->sock, buf, sizeof(buf), 0) > 0; i++) {
+    }
+    closesocket(so->sock);
+
+    /* Several acceptor threads may reject at once */
+    (void) pthread_mutex_lock(&ctx->thread_mutex);
+    ctx->sq_shed_count++;
+    (void) pthread_mutex_unlock(&ctx->thread_mutex);
 }
 
-static void accept_new_connection(const struct socket *listener,
-                                  struct mg_context *ctx)
+/* Accept one connection and put it into the queue.
+   Return 0 if there was no connection to accept. */
+static int accept_new_connection(const struct socket *listener,
+                                 struct socket_queue *q)
 {
+    struct mg_context *ctx = q->ctx;
     struct socket so;
     char src_addr[IP_ADDR_STR_LEN];
     socklen_t len = sizeof(so.rsa);
-    int on = 1;
 
-    if ((so.sock = accept(listener->sock, &so.rsa.sa, &len)) == INVALID_SOCKET) {
-    } else if (!check_acl(ctx, ntohl(* (uint32_t *) &so.rsa.sin.sin_addr))) {
+#if defined(USE_ACCEPT4)
+    so.sock = accept4(listener->sock, &so.rsa.sa, &len, SOCK_CLOEXEC);
+#else
+    so.sock = accept(listener->sock, &so.rsa.sa, &len);
+#endif
+    if (so.sock == INVALID_SOCKET) {
+        return 0;
+    }
+
+    so.is_ssl = listener->is_ssl;
+    so.ssl_redir = listener->ssl_redir;
+    so.is_reused = 0;
+    /* For wildcard listeners this is not the actual local address.
+       Use getsockname() where the address is needed. */
+    so.lsa = listener->lsa;
+
+    if (!check_acl(ctx, ntohl(* (uint32_t *) &so.rsa.sin.sin_addr))) {
         sockaddr_to_string(src_addr, sizeof(src_addr), &so.rsa);
         mg_cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
         closesocket(so.sock);
         so.sock = INVALID_SOCKET;
+    } else if (ctx->sq_watermark > 0 &&
+               sq_depth(q) >= ctx->sq_watermark) {
+        /* A snapshot of the queue depth is good enough here */
+        DEBUG_TRACE("Rejected socket %d, queue is full", (int) so.sock);
+        reject_connection(ctx, &so);
     } else {
         /* Put so socket structure into the queue */
         DEBUG_TRACE("Accepted socket %d", (int) so.sock);
+#if !defined(USE_ACCEPT4)
         set_close_on_exec(so.sock, fc(ctx));
-        so.is_ssl = listener->is_ssl;
-        so.ssl_redir = listener->ssl_redir;
-        if (getsockname(so.sock, &so.lsa.sa, &len) != 0) {
-            mg_cry(fc(ctx), "%s: getsockname() failed: %s",
-                   __func__, strerror(ERRNO));
+        set_client_socket_options(ctx, so.sock);
+#endif
+        produce_socket(q, &so);
+    }
+    return 1;
+}
+
+/* Accept pending connections on a listening socket. Non-blocking listeners
+   are drained until accept() would block; blocking listeners accept one
+   connection per poll() wakeup. */
+static void accept_new_connections(const struct socket *listener,
+                                   struct socket_queue *q)
+{
+#if defined(USE_ACCEPT4)
+    while (q->ctx->stop_flag == 0 && accept_new_connection(listener, q)) {
+    }
+#else
+    (void) accept_new_connection(listener, q);
+#endif
+}
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+/* Put parked connections that became readable back into the queue. Idle
+   connections exceeding request_timeout_ms are queued as well, after their
+   receiving side has been shut down, so a worker closes them and calls the
+   connection_close callback. A request_timeout_ms of 0 means no limit. */
+static void unpark_connections(struct mg_context *ctx, int readable)
+{
+    struct epoll_event events[64];
+    struct parked_socket *ps;
+    int64_t idle_limit, now;
+    int i, n;
+
+    if (readable) {
+        n = epoll_wait(ctx->park_fd, events, (int) ARRAY_SIZE(events), 0);
+        for (i = 0; i < n; i++) {
+            ps = (struct parked_socket *) events[i].data.ptr;
+            (void) pthread_mutex_lock(&ctx->park_mutex);
+            unlink_parked_socket(ctx, ps);
+            (void) epoll_ctl(ctx->park_fd, EPOLL_CTL_DEL, ps->client.sock, NULL);
+            (void) pthread_mutex_unlock(&ctx->park_mutex);
+            produce_socket(ps->queue, &ps->client);
+            mg_free(ps);
         }
-        /* Set TCP keep-alive. This is needed because if HTTP-level keep-alive
-           is enabled, and client resets the connection, server won't get
-           TCP FIN or RST and will keep the connection open forever. With TCP
-           keep-alive, next keep-alive handshake will figure out that the
-           client is down and will close the server end.
-           Thanks to Igor Klopov who suggested the patch. */
-        if (setsockopt(so.sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on,
-                       sizeof(on)) != 0) {
-            mg_cry(fc(ctx),
-                   "%s: setsockopt(SOL_SOCKET SO_KEEPALIVE) failed: %s",
-                   __func__, strerror(ERRNO));
+    }
+
+    if (ctx->cfg.request_timeout <= 0) {
+        return;
+    }
+    idle_limit = (int64_t) ctx->cfg.request_timeout * 1000;
+    now = get_monotonic_usec();
+    for (;;) {
+        (void) pthread_mutex_lock(&ctx->park_mutex);
+        ps = ctx->parked_head;
+        if (ps != NULL && now - ps->parked_at >= idle_limit) {
+            unlink_parked_socket(ctx, ps);
+            (void) epoll_ctl(ctx->park_fd, EPOLL_CTL_DEL, ps->client.sock, NULL);
+        } else {
+            ps = NULL;
+        }
+        (void) pthread_mutex_unlock(&ctx->park_mutex);
+        if (ps == NULL) {
+            break;
+        }
+        DEBUG_TRACE("idle timeout on parked socket %d", ps->client.sock);
+        shutdown(ps->client.sock, SHUT_RD);
+        produce_socket(ps->queue, &ps->client);
+        mg_free(ps);
+    }
+}
+
+/* Close the epoll set and all connections still parked in it, calling the
+   connection_close callback for each of them as a worker would. */
+static void close_parked_connections(struct mg_context *ctx)
+{
+    struct parked_socket *ps, *next;
+    struct mg_connection *conn;
+
+    (void) pthread_mutex_lock(&ctx->park_mutex);
+    if (ctx->park_fd >= 0) {
+        close(ctx->park_fd);
+        ctx->park_fd = -1;
+    }
+    ps = ctx->parked_head;
+    ctx->parked_head = ctx->parked_tail = NULL;
+    (void) pthread_mutex_unlock(&ctx->park_mutex);
+
+    conn = ctx->callbacks.connection_close == NULL ? NULL :
+           (struct mg_connection *) mg_calloc(1, sizeof(*conn));
+    for (; ps != NULL; ps = next) {
+        next = ps->next;
+        if (conn != NULL) {
+            conn->ctx = ctx;
+            conn->client = ps->client;
+            conn->request_info.user_data = ctx->user_data;
+            set_remote_info(conn);
+            ctx->callbacks.connection_close(conn);
+        }
+        closesocket(ps->client.sock);
+        mg_free(ps);
+    }
+    mg_free(conn);
+}
+#endif /* USE_KEEP_ALIVE_PARKING */
+
+/* Additional acceptor threads only accept connections on their own
+   listening sockets. Everything else is left to the master thread. */
+static void acceptor_thread_run(void *thread_func_param)
+{
+    struct mg_acceptor *acc = (struct mg_acceptor *) thread_func_param;
+    struct mg_context *ctx = acc->ctx;
+    struct mg_workerTLS tls;
+    struct pollfd *pfd;
+    int i;
+
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+    tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+    tls.is_master = 0;
+    pthread_setspecific(sTlsKey, &tls);
+
+    pfd = (struct pollfd *) mg_calloc(ctx->num_listening_sockets, sizeof(pfd[0]));
+    while (pfd != NULL && ctx->stop_flag == 0) {
+        for (i = 0; i < ctx->num_listening_sockets; i++) {
+            pfd[i].fd = acc->listening_sockets[i].sock;
+            pfd[i].events = POLLIN;
+        }
+
+        if (poll(pfd, ctx->num_listening_sockets, 200) > 0) {
+            for (i = 0; i < ctx->num_listening_sockets; i++) {
+                if (ctx->stop_flag == 0 && (pfd[i].revents & POLLIN)) {
+                    accept_new_connections(&acc->listening_sockets[i],
+                                           acc->queue);
+                }
+            }
         }
-        set_sock_timeout(so.sock, atoi(ctx->config[REQUEST_TIMEOUT]));
-        produce_socket(ctx, &so);
     }
+    mg_free(pfd);
+
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+    CloseHandle(tls.pthread_cond_helper_mutex);
+#endif
+    pthread_setspecific(sTlsKey, NULL);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall acceptor_thread(void *thread_func_param)
+{
+    acceptor_thread_run(thread_func_param);
+    return 0;
+}
+#else
+static void *acceptor_thread(void *thread_func_param)
+{
+    acceptor_thread_run(thread_func_param);
+    return NULL;
 }
+#endif /* _WIN32 */
 
 static void master_thread_run(void *thread_func_param)
 {
     struct mg_context *ctx = (struct mg_context *) thread_func_param;
     struct mg_workerTLS tls;
     struct pollfd *pfd;
-    int i;
+    int i, n;
     int workerthreadcount;
+#if defined(USE_INOTIFY)
+    int inotify_index;
+#endif
 
     /* Increase priority of the master thread */
 #if defined(_WIN32)
@@ -6835,15 +11678,34 @@ static void master_thread_run(void *thread_func_param)
     /* Server starts *now* */
     ctx->start_time = (unsigned long)time(NULL);
 
-    /* Allocate memory for the listening sockets, and start the server */
-    pfd = (struct pollfd *) mg_calloc(ctx->num_listening_sockets, sizeof(pfd[0]));
+    /* Allocate memory for the listening sockets (and the epoll descriptor of
+       the parked connections, and the inotify descriptor of the file cache),
+       and start the server */
+    pfd = (struct pollfd *) mg_calloc(ctx->num_listening_sockets + 2, sizeof(pfd[0]));
     while (pfd != NULL && ctx->stop_flag == 0) {
         for (i = 0; i < ctx->num_listening_sockets; i++) {
             pfd[i].fd = ctx->listening_sockets[i].sock;
             pfd[i].events = POLLIN;
         }
+        n = ctx->num_listening_sockets;
+#if defined(USE_KEEP_ALIVE_PARKING)
+        pfd[n].fd = ctx->park_fd;
+        pfd[n].events = POLLIN;
+        pfd[n].revents = 0;
+        n++;
+#endif
+#if defined(USE_INOTIFY)
+        inotify_index = -1;
+        if (ctx->file_cache != NULL && ctx->file_cache->inotify_fd >= 0) {
+            inotify_index = n;
+            pfd[n].fd = ctx->file_cache->inotify_fd;
+            pfd[n].events = POLLIN;
+            pfd[n].revents = 0;
+            n++;
+        }
+#endif
 
-        if (poll(pfd, ctx->num_listening_sockets, 200) > 0) {
+        if (poll(pfd, n, 200) > 0) {
             for (i = 0; i < ctx->num_listening_sockets; i++) {
                 /* NOTE(lsm): on QNX, poll() returns POLLRDNORM after the
                    successful poll, and POLLIN is defined as
@@ -6851,19 +11713,56 @@ static void master_thread_run(void *thread_func_param)
                    Therefore, we're checking pfd[i].revents & POLLIN, not
                    pfd[i].revents == POLLIN. */
                 if (ctx->stop_flag == 0 && (pfd[i].revents & POLLIN)) {
-                    accept_new_connection(&ctx->listening_sockets[i], ctx);
+                    accept_new_connections(&ctx->listening_sockets[i],
+                                           ctx->queues[0]);
                 }
             }
         }
+#if defined(USE_KEEP_ALIVE_PARKING)
+        if (ctx->stop_flag == 0) {
+            unpark_connections(ctx, pfd[ctx->num_listening_sockets].revents & POLLIN);
+        }
+#endif
+#if defined(USE_INOTIFY)
+        if (inotify_index >= 0 && (pfd[inotify_index].revents & POLLIN)) {
+            read_file_cache_events(ctx);
+        }
+#endif
+        refresh_clock(ctx, time(NULL));
     }
     mg_free(pfd);
     DEBUG_TRACE("stopping workers");
 
+    /* Wake up acceptor threads waiting for a free slot in their queue, and
+       wait until they are done before closing their sockets. */
+    for (i = 0; i < ctx->num_queues; i++) {
+        (void) pthread_mutex_lock(&ctx->queues[i]->mutex);
+        (void) pthread_cond_broadcast(&ctx->queues[i]->not_full);
+        (void) pthread_mutex_unlock(&ctx->queues[i]->mutex);
+    }
+    for (i = 0; i < ctx->num_acceptors; i++) {
+        if (ctx->acceptors[i].thread_started) {
+            mg_join_thread(ctx->acceptors[i].thread_id);
+        }
+    }
+
     /* Stop signal received: somebody called mg_stop. Quit. */
     close_all_listening_sockets(ctx);
+#if defined(USE_KEEP_ALIVE_PARKING)
+    close_parked_connections(ctx);
+#endif
 
     /* Wakeup workers that are waiting for connections to handle. */
-    pthread_cond_broadcast(&ctx->sq_full);
+    for (i = 0; i < ctx->num_queues; i++) {
+        (void) pthread_mutex_lock(&ctx->queues[i]->mutex);
+        (void) pthread_cond_broadcast(&ctx->queues[i]->not_empty);
+        (void) pthread_mutex_unlock(&ctx->queues[i]->mutex);
+    }
+
+    /* And those waiting to send throttled data */
+    (void) pthread_mutex_lock(&ctx->throttle_mutex);
+    pthread_cond_broadcast(&ctx->throttle_cond);
+    (void) pthread_mutex_unlock(&ctx->throttle_mutex);
 
     /* Wait until all threads finish */
     (void) pthread_mutex_lock(&ctx->thread_mutex);
@@ -6913,24 +11812,52 @@ static void free_context(struct mg_context *ctx)
 {
     int i;
     struct mg_request_handler_info *tmp_rh;
+    struct route_table *routes;
 
     if (ctx == NULL)
         return;
 
+    /* Write out what is left in the logs */
+    destroy_log_writer(ctx->access_log);
+    ctx->access_log = NULL;
+    destroy_log_writer(ctx->error_log);
+    ctx->error_log = NULL;
+
     /* All threads exited, no sync is needed. Destroy thread mutex and condvars */
     (void) pthread_mutex_destroy(&ctx->thread_mutex);
     (void) pthread_cond_destroy(&ctx->thread_cond);
-    (void) pthread_cond_destroy(&ctx->sq_empty);
-    (void) pthread_cond_destroy(&ctx->sq_full);
 
     /* Destroy other context global data structures mutex */
     (void) pthread_mutex_destroy(&ctx->nonce_mutex);
+    (void) pthread_mutex_destroy(&ctx->latency_mutex);
+    (void) pthread_mutex_destroy(&ctx->throttle_mutex);
+    (void) pthread_cond_destroy(&ctx->throttle_cond);
+    (void) pthread_mutex_destroy(&ctx->handlers_mutex);
+    (void) pthread_mutex_destroy(&ctx->clock.mutex);
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+    if (ctx->park_fd >= 0) {
+        close(ctx->park_fd);
+    }
+    (void) pthread_mutex_destroy(&ctx->park_mutex);
+#endif
 
 #if defined(USE_TIMERS)
     timers_exit(ctx);
 #endif
 
     /* Deallocate config parameters */
+    free_parsed_config(&ctx->cfg);
+#if defined(USE_FILE_CACHE)
+    if (ctx->file_cache != NULL) {
+        destroy_file_cache(ctx->file_cache);
+    }
+#endif
+#if defined(USE_ZLIB)
+    if (ctx->compression_cache != NULL) {
+        destroy_compression_cache(ctx->compression_cache);
+    }
+#endif
     for (i = 0; i < NUM_OPTIONS; i++) {
         if (ctx->config[i] != NULL)
 #ifdef WIN32
@@ -6940,11 +11867,18 @@ static void free_context(struct mg_context *ctx)
     }
 
     /* Deallocate request handlers */
+    while (ctx->retired_routes != NULL) {
+        routes = ctx->retired_routes;
+        ctx->retired_routes = routes->next_retired;
+        free_route_table(routes);
+    }
+    if (ctx->routes != NULL) {
+        free_route_table(ctx->routes);
+    }
     while (ctx->request_handlers) {
         tmp_rh = ctx->request_handlers;
         ctx->request_handlers = tmp_rh->next;
-        mg_free(tmp_rh->uri);
-        mg_free(tmp_rh);
+        free_request_handler(tmp_rh);
     }
 
 #ifndef NO_SSL
@@ -6963,6 +11897,21 @@ static void free_context(struct mg_context *ctx)
         mg_free(ctx->workerthreadids);
     }
 
+    /* Deallocate the socket queues */
+    if (ctx->queues != NULL) {
+        for (i = 0; i < ctx->num_queues; i++) {
+            destroy_socket_queue(ctx->queues[i]);
+        }
+        mg_free(ctx->queues);
+    }
+
+    /* Deallocate acceptors. Their sockets are still open if the server
+       failed to start. */
+    if (ctx->acceptors != NULL) {
+        close_acceptor_sockets(ctx);
+        mg_free(ctx->acceptors);
+    }
+
     /* Deallocate the tls variable */
     sTlsInit--;
     if (sTlsInit==0) {
@@ -7027,7 +11976,7 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
 {
     struct mg_context *ctx;
     const char *name, *value, *default_value;
-    int i, ok;
+    int i, j, ok;
     int workerthreadcount;
 
 #if defined(_WIN32) && !defined(__SYMBIAN32__)
@@ -7059,9 +12008,16 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
 
     ok =  0==pthread_mutex_init(&ctx->thread_mutex, NULL);
     ok &= 0==pthread_cond_init(&ctx->thread_cond, NULL);
-    ok &= 0==pthread_cond_init(&ctx->sq_empty, NULL);
-    ok &= 0==pthread_cond_init(&ctx->sq_full, NULL);
     ok &= 0==pthread_mutex_init(&ctx->nonce_mutex, NULL);
+    ok &= 0==pthread_mutex_init(&ctx->latency_mutex, NULL);
+    ok &= 0==pthread_mutex_init(&ctx->throttle_mutex, NULL);
+    ok &= 0==pthread_cond_init(&ctx->throttle_cond, NULL);
+    ok &= 0==pthread_mutex_init(&ctx->handlers_mutex, NULL);
+    ok &= 0==pthread_mutex_init(&ctx->clock.mutex, NULL);
+#if defined(USE_KEEP_ALIVE_PARKING)
+    ok &= 0==pthread_mutex_init(&ctx->park_mutex, NULL);
+    ctx->park_fd = -1;
+#endif
     if (!ok) {
         /* Fatal error - abort start. However, this situation should never occur in practice. */
         mg_cry(fc(ctx), "Cannot initialize thread synchronization objects");
@@ -7108,12 +12064,16 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
     get_system_name(&ctx->systemName);
 
     /* NOTE(lsm): order is important here. SSL certificates must
-       be initialized before listening ports. UID must be set last. */
-    if (!set_gpass_option(ctx) ||
+       be initialized before listening ports. UID must be set last.
+       Listening sockets pass cfg.request_timeout on to accepted sockets,
+       so the parsed options come first. */
+    if (!set_parsed_config(ctx) ||
+        !set_gpass_option(ctx) ||
 #if !defined(NO_SSL)
         !set_ssl_option(ctx) ||
 #endif
         !set_ports_option(ctx) ||
+        !set_acceptors_option(ctx) ||
 #if !defined(_WIN32)
         !set_uid_option(ctx) ||
 #endif
@@ -7122,20 +12082,109 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
         return NULL;
     }
 
+#if defined(USE_FILE_CACHE)
+    if (atoi(ctx->config[STATIC_CACHE_SIZE]) > 0 &&
+        atoi(ctx->config[FILE_CACHE_SIZE]) <= 0) {
+        mg_cry(fc(ctx), "%s: static_cache_size needs file_cache_size",
+               __func__);
+        free_context(ctx);
+        return NULL;
+    }
+    if (atoi(ctx->config[FILE_CACHE_SIZE]) > 0 &&
+        (ctx->file_cache = create_file_cache(ctx)) == NULL) {
+        mg_cry(fc(ctx), "%s: cannot allocate file cache", __func__);
+        free_context(ctx);
+        return NULL;
+    }
+#endif
+#if defined(USE_ZLIB)
+    if (atoi(ctx->config[COMPRESSION_CACHE_SIZE]) > 0 &&
+        (ctx->compression_cache = create_compression_cache(ctx)) == NULL) {
+        mg_cry(fc(ctx), "%s: cannot allocate compression cache", __func__);
+        free_context(ctx);
+        return NULL;
+    }
+#endif
+
+    if (strcmp(ctx->config[LOG_BUFFER_FULL], "block") &&
+        strcmp(ctx->config[LOG_BUFFER_FULL], "drop")) {
+        mg_cry(fc(ctx), "%s: log_buffer_full must be block or drop",
+               __func__);
+        free_context(ctx);
+        return NULL;
+    }
+    if (atoi(ctx->config[LOG_BUFFER_SIZE]) > 0 &&
+        ((ctx->config[ACCESS_LOG_FILE] != NULL &&
+          (ctx->access_log = create_log_writer(
+               ctx, ctx->config[ACCESS_LOG_FILE])) == NULL) ||
+         (ctx->config[ERROR_LOG_FILE] != NULL &&
+          (ctx->error_log = create_log_writer(
+               ctx, ctx->config[ERROR_LOG_FILE])) == NULL))) {
+        mg_cry(fc(ctx), "%s: cannot start log writer", __func__);
+        free_context(ctx);
+        return NULL;
+    }
+
 #if !defined(_WIN32) && !defined(__SYMBIAN32__)
     /* Ignore SIGPIPE signal, so if browser cancels the request, it
        won't kill the whole process. */
     (void) signal(SIGPIPE, SIG_IGN);
 #endif /* !_WIN32 && !__SYMBIAN32__ */
 
+    i = atoi(ctx->config[CONNECTION_QUEUE_SIZE]);
+    if (i <= 0) {
+        mg_cry(fc(ctx), "Invalid connection queue size: %s",
+               ctx->config[CONNECTION_QUEUE_SIZE]);
+        free_context(ctx);
+        return NULL;
+    }
+    ctx->sq_watermark = atoi(ctx->config[CONNECTION_QUEUE_WATERMARK]);
+    if ((ctx->queues = (struct socket_queue **)
+         mg_calloc(ctx->num_acceptors + 1, sizeof(ctx->queues[0]))) == NULL) {
+        mg_cry(fc(ctx), "Not enough memory for the socket queue");
+        free_context(ctx);
+        return NULL;
+    }
+    for (j = 0; j <= ctx->num_acceptors; j++) {
+        if ((ctx->queues[j] = create_socket_queue(ctx, i)) == NULL) {
+            mg_cry(fc(ctx), "Not enough memory for the socket queue");
+            free_context(ctx);
+            return NULL;
+        }
+        ctx->num_queues++;
+    }
+    for (j = 0; j < ctx->num_acceptors; j++) {
+        ctx->acceptors[j].queue = ctx->queues[j + 1];
+    }
+
+    /* Without min_threads and max_threads, the pool has a fixed size of
+       num_threads workers */
     workerthreadcount = atoi(ctx->config[NUM_THREADS]);
+    if (ctx->config[MIN_THREADS] != NULL) {
+        workerthreadcount = atoi(ctx->config[MIN_THREADS]);
+    }
+    ctx->min_threads = workerthreadcount;
+    ctx->max_threads = workerthreadcount;
+    if (ctx->config[MAX_THREADS] != NULL &&
+        atoi(ctx->config[MAX_THREADS]) > workerthreadcount) {
+        ctx->max_threads = atoi(ctx->config[MAX_THREADS]);
+    }
+    ctx->thread_idle_timeout = atoi(ctx->config[THREAD_IDLE_TIMEOUT]);
 
-    if (workerthreadcount > MAX_WORKER_THREADS) {
+    if (ctx->max_threads > MAX_WORKER_THREADS) {
         mg_cry(fc(ctx), "Too many worker threads");
         free_context(ctx);
         return NULL;
     }
 
+    /* Every acceptor needs workers of its own */
+    if (workerthreadcount < ctx->num_queues) {
+        mg_cry(fc(ctx), "%d acceptors need at least as many worker threads",
+               ctx->num_queues);
+        free_context(ctx);
+        return NULL;
+    }
+
     if (workerthreadcount > 0) {
         ctx->workerthreadcount = workerthreadcount;
         ctx->workerthreadids = (pthread_t *)mg_calloc(workerthreadcount, sizeof(pthread_t));
@@ -7146,6 +12195,23 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
         }
     }
 
+#if defined(USE_KEEP_ALIVE_PARKING)
+    /* Without an epoll set, keep-alive connections simply stay with their
+       worker thread. */
+    if (ctx->cfg.keep_alive &&
+        (ctx->park_fd = epoll_create(64)) < 0) {
+        mg_cry(fc(ctx), "%s: epoll_create failed: %s",
+               __func__, strerror(ERRNO));
+    } else if (ctx->park_fd >= 0) {
+        set_close_on_exec(ctx->park_fd, fc(ctx));
+    }
+#endif
+
+    if (ctx->config[METRICS_URI] != NULL) {
+        mg_set_request_handler(ctx, ctx->config[METRICS_URI],
+                               metrics_handler, NULL);
+    }
+
 #if defined(USE_TIMERS)
     if (timers_init(ctx) != 0) {
         mg_cry(fc(ctx), "Error creating timers");
@@ -7157,12 +12223,28 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
     /* Start master (listening) thread */
     mg_start_thread_with_id(master_thread, ctx, &ctx->masterthreadid);
 
+    /* Start additional acceptor threads. If one cannot be started, its
+       sockets are closed, so the kernel does not route connections there. */
+    for (i = 0; i < ctx->num_acceptors; i++) {
+        if (mg_start_thread_with_id(acceptor_thread, &ctx->acceptors[i],
+                                    &ctx->acceptors[i].thread_id) == 0) {
+            ctx->acceptors[i].thread_started = 1;
+        } else {
+            mg_cry(fc(ctx), "Cannot start acceptor thread: %ld", (long) ERRNO);
+            for (j = 0; j < ctx->num_listening_sockets; j++) {
+                closesocket(ctx->acceptors[i].listening_sockets[j].sock);
+                ctx->acceptors[i].listening_sockets[j].sock = INVALID_SOCKET;
+            }
+        }
+    }
+
     /* Start worker threads */
     for (i = 0; i < workerthreadcount; i++) {
         (void) pthread_mutex_lock(&ctx->thread_mutex);
         ctx->num_threads++;
         (void) pthread_mutex_unlock(&ctx->thread_mutex);
-        if (mg_start_thread_with_id(worker_thread, ctx,
+        if (mg_start_thread_with_id(worker_thread,
+                                    ctx->queues[i % ctx->num_queues],
                                     &ctx->workerthreadids[i]) != 0) {
             (void) pthread_mutex_lock(&ctx->thread_mutex);
             ctx->num_threads--;
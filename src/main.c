@@ -79,6 +79,7 @@ static int guard = 0;                   /* test if any dialog is already open */
 #define MAX_CONF_FILE_LINE_SIZE (8 * 1024)
 
 static int exit_flag = 0;               /* Main loop should exit */
+static volatile int reopen_logs = 0;    /* SIGHUP received */
 static char server_base_name[40];       /* Set by init_server_name() */
 static char *server_name;               /* Set by init_server_name() */
 static char *icon_name;                 /* Set by init_server_name() */
@@ -115,6 +116,14 @@ static void WINCDECL signal_handler(int sig_num)
     exit_flag = sig_num;
 }
 
+#if !defined(_WIN32)
+static void hup_handler(int sig_num)
+{
+    (void) sig_num;
+    reopen_logs = 1;
+}
+#endif
+
 static void die(const char *fmt, ...)
 {
     va_list ap;
@@ -564,6 +573,10 @@ static void start_civetweb(int argc, char *argv[])
     /* Setup signal handler: quit on Ctrl-C */
     signal(SIGTERM, signal_handler);
     signal(SIGINT, signal_handler);
+#if !defined(_WIN32)
+    /* Reopen the log files after rotation */
+    signal(SIGHUP, hup_handler);
+#endif
 
     /* Start Civetweb */
     memset(&callbacks, 0, sizeof(callbacks));
@@ -1585,6 +1598,10 @@ int main(int argc, char *argv[])
            mg_get_option(ctx, "document_root"));
     while (exit_flag == 0) {
         sleep(1);
+        if (reopen_logs) {
+            reopen_logs = 0;
+            mg_reopen_logs(ctx);
+        }
     }
     printf("Exiting on signal %d, waiting for all threads to finish...",
            exit_flag);
@@ -0,0 +1,133 @@
+/* Copyright (c) 2013-2014 the Civetweb developers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Microbenchmark for URI pattern matching, match_prefix() against the
+ * compiled patterns of match_pattern().
+ *
+ * Build and run from the test directory:
+ *   cc -O2 -DNO_SSL -I../include -I../src pattern_benchmark.c -lpthread -ldl
+ *
+ * Random patterns and strings are cross-checked first, so a compiled pattern
+ * that disagrees with match_prefix() shows up as a failure.
+ */
+
+#include "civetweb.c"
+
+static double now(void)
+{
+    return get_monotonic_usec() / 1.0E6;
+}
+
+static int s_failed = 0;
+
+static void random_string(char *buf, int len, const char *alphabet)
+{
+    int i, n = (int) strlen(alphabet);
+
+    for (i = 0; i < len; i++) {
+        buf[i] = alphabet[rand() % n];
+    }
+    buf[len] = '\0';
+}
+
+static void check_random(int count)
+{
+    char pattern[16], str[16];
+    struct pattern p;
+    int i, len;
+
+    srand(1);
+    for (i = 0; i < count; i++) {
+        len = rand() % (int) sizeof(pattern);
+        random_string(pattern, len, "ab/.*?$|");
+        random_string(str, rand() % (int) sizeof(str), "aAb/.");
+        if (!compile_pattern(&p, pattern, len)) {
+            abort();
+        }
+        if (match_pattern(&p, str) != match_prefix(pattern, len, str)) {
+            printf("Mismatch: [%s] [%s]\n", pattern, str);
+            s_failed++;
+        }
+        free_pattern(&p);
+    }
+}
+
+static void bench(const char *name, const char *pattern, const char **paths)
+{
+    struct pattern p;
+    int i, len = (int) strlen(pattern), n = 0, iterations = 0, result = 0;
+    double start, t_old, t_new;
+
+    while (paths[n] != NULL) {
+        n++;
+    }
+    if (!compile_pattern(&p, pattern, len)) {
+        abort();
+    }
+
+    start = now();
+    while (now() - start < 0.5) {
+        for (i = 0; i < n; i++) {
+            result += match_prefix(pattern, len, paths[i]) > 0;
+        }
+        iterations++;
+    }
+    t_old = (now() - start) / iterations / n;
+
+    iterations = 0;
+    start = now();
+    while (now() - start < 0.5) {
+        for (i = 0; i < n; i++) {
+            result += match_pattern(&p, paths[i]) > 0;
+        }
+        iterations++;
+    }
+    t_new = (now() - start) / iterations / n;
+
+    printf("%-28s %8.1f ns  %8.1f ns  %6.1fx  (%d)\n", name, t_old * 1.0E9,
+           t_new * 1.0E9, t_old / t_new, result != 0);
+    free_pattern(&p);
+}
+
+int main(void)
+{
+    static const char *paths[] = {
+        "/index.html",
+        "/bucket/object-0001",
+        "/static/js/vendor/jquery-1.11.2.min.js",
+        "/images/2014/06/very/deeply/nested/directory/photo.jpeg",
+        "/cgi-bin/form.cgi",
+        "/docs/a.shtml",
+        NULL
+    };
+
+    check_random(500000);
+
+    printf("%-28s %11s  %11s\n", "", "match_prefix", "compiled");
+    bench("cgi_pattern", "**.cgi$|**.pl$|**.php$", paths);
+    bench("ssi_pattern", "**.shtml$|**.shtm$", paths);
+    bench("hide_files_patterns", "**.htpasswd$|**/.git/**|**~$", paths);
+    bench("handler prefix", "/metrics", paths);
+    bench("handler exact", "/favicon.ico$", paths);
+
+    printf("%s\n", s_failed ? "FAILED" : "OK");
+    return s_failed != 0;
+}
@@ -67,6 +67,14 @@ static int s_failed_tests = 0;
 #define LISTENING_ADDR "127.0.0.1:" HTTP_PORT ",127.0.0.1:" HTTPS_PORT "s"
 #endif
 
+/* Parse a complete request in one go */
+static int parse_http_message(char *buf, int len, struct mg_request_info *ri) {
+    struct request_scan st;
+
+    init_request_scan(&st);
+    return parse_scanned_message(buf, scan_request(buf, len, &st), &st, ri);
+}
+
 static void test_parse_http_message() {
     struct mg_request_info ri;
     char req1[] = "GET / HTTP/1.1\r\n\r\n";
@@ -101,12 +109,75 @@ static void test_parse_http_message() {
     ASSERT(strcmp(ri.http_headers[0].value, "foo bar") == 0);
     ASSERT(strcmp(ri.http_headers[1].name, "B") == 0);
     ASSERT(strcmp(ri.http_headers[1].value, "bar") == 0);
-    ASSERT(strcmp(ri.http_headers[2].name, "baz\r\n\r") == 0);
+    ASSERT(strcmp(ri.http_headers[2].name, "baz") == 0);
     ASSERT(strcmp(ri.http_headers[2].value, "") == 0);
 
     ASSERT(parse_http_message(req5, sizeof(req5), &ri) == sizeof(req5) - 1);
     ASSERT(strcmp(ri.request_method, "GET") == 0);
+    ASSERT(ri.method_id == HTTP_METHOD_GET);
     ASSERT(strcmp(ri.http_version, "1.1") == 0);
+
+    ASSERT(get_method_id("PROPFIND") == HTTP_METHOD_PROPFIND);
+    ASSERT(get_method_id("PATCH") == HTTP_METHOD_PATCH);
+    ASSERT(get_method_id("UNLOCK") == HTTP_METHOD_UNLOCK);
+    ASSERT(get_method_id("get") == HTTP_METHOD_OTHER);
+    ASSERT(get_method_id("") == HTTP_METHOD_OTHER);
+}
+
+static void test_scan_request(void) {
+    char req[] = "\r\nPOST /x HTTP/1.1\r\nHost: a:80\r\nX-Y:  z\r\n\r\nbody";
+    int req_len = (int) sizeof(req) - 5;
+    struct request_scan st;
+    struct mg_request_info ri;
+    int i, len = 0;
+
+    /* Scanning byte by byte gives the same result as in one go */
+    init_request_scan(&st);
+    for (i = 1; i <= (int) sizeof(req) && len == 0; i++) {
+        len = scan_request(req, i, &st);
+        ASSERT(len == 0 || i == req_len);
+    }
+    ASSERT(len == req_len);
+    ASSERT(get_request_len(req, sizeof(req)) == req_len);
+    ASSERT(parse_scanned_message(req, len, &st, &ri) == req_len);
+    ASSERT(strcmp(ri.request_method, "POST") == 0);
+    ASSERT(strcmp(ri.uri, "/x") == 0);
+    ASSERT(ri.num_headers == 2);
+    ASSERT(strcmp(ri.http_headers[0].name, "Host") == 0);
+    ASSERT(strcmp(ri.http_headers[0].value, "a:80") == 0);
+    ASSERT(strcmp(ri.http_headers[1].name, "X-Y") == 0);
+    ASSERT(strcmp(ri.http_headers[1].value, "z") == 0);
+
+    ASSERT(get_request_len("GET / HTTP/1.1\r\nA\001: b\r\n\r\n", 25) == -1);
+    ASSERT(get_request_len("GET / HTTP/1.1\r\nA: b\001\r\n\r\n", 25) == 25);
+}
+
+static void test_header_index(void) {
+    struct mg_connection conn;
+    char req[] = "GET / HTTP/1.1\r\nhost: a\r\nX-Foo: 1\r\n"
+                 "HOST: b\r\nCONTENT-length: 3\r\n\r\n";
+    int i;
+
+    /* The precomputed hashes and slots match the names */
+    for (i = 0; i < NUM_KNOWN_HEADERS; i++) {
+        ASSERT(header_hash(known_headers[i].name) == known_headers[i].hash);
+        ASSERT(known_header_slots[KNOWN_HEADER_SLOT(known_headers[i].hash)] == i);
+    }
+
+    memset(&conn, 0, sizeof(conn));
+    ASSERT(parse_http_message(req, sizeof(req), &conn.request_info) > 0);
+    ASSERT(strcmp(mg_get_header(&conn, "Host"), "a") == 0);
+    ASSERT(strcmp(mg_get_header_id(&conn, HTTP_HEADER_HOST), "a") == 0);
+
+    index_headers(&conn);
+    ASSERT(strcmp(mg_get_header(&conn, "Host"), "a") == 0);
+    ASSERT(strcmp(mg_get_header(&conn, "x-foo"), "1") == 0);
+    ASSERT(mg_get_header(&conn, "X-Fo") == NULL);
+    ASSERT(strcmp(mg_get_header_id(&conn, HTTP_HEADER_HOST), "a") == 0);
+    ASSERT(strcmp(mg_get_header_id(&conn, HTTP_HEADER_CONTENT_LENGTH), "3") == 0);
+    ASSERT(mg_get_header_id(&conn, HTTP_HEADER_RANGE) == NULL);
+    ASSERT(mg_get_header_id(&conn, -1) == NULL);
+    ASSERT(mg_get_header_id(&conn, NUM_KNOWN_HEADERS) == NULL);
 }
 
 static void test_should_keep_alive(void) {
@@ -118,14 +189,15 @@ static void test_should_keep_alive(void) {
     char req4[] = "GET / HTTP/1.1\r\nConnection: keep-alive\r\n\r\n";
 
     memset(&conn, 0, sizeof(conn));
+    memset(&ctx, 0, sizeof(ctx));
     conn.ctx = &ctx;
     ASSERT(parse_http_message(req1, sizeof(req1), &conn.request_info) ==
         sizeof(req1) - 1);
 
-    ctx.config[ENABLE_KEEP_ALIVE] = "no";
+    ctx.cfg.keep_alive = 0;
     ASSERT(should_keep_alive(&conn) == 0);
 
-    ctx.config[ENABLE_KEEP_ALIVE] = "yes";
+    ctx.cfg.keep_alive = 1;
     ASSERT(should_keep_alive(&conn) == 1);
 
     conn.must_close = 1;
@@ -180,6 +252,39 @@ static void test_match_prefix(void) {
     ASSERT(match_prefix("**o$", 4, "HELLO") == 5);
 }
 
+static void test_match_pattern(void) {
+    static const char *patterns[] = {
+        "/api", "/api$", "**.cgi$|**.pl$|**.php$", "**.a$|**.b$", "**o$",
+        "/a/**.cgi", "a|b|cd", "a|?|cd", "**/$", "$", "", "a||b", "**$",
+        "/a/|**.B$|/c$"
+    };
+    static const char *strs[] = {
+        "", "/", "/api", "/api/x", "/API", "/x.cgi", "/x.CGI", "/x.cgi/",
+        "/a/b.php", "HELLO", "/a/b.b", "/a/B.A", "cdef", "/a/b/", "b", "/c"
+    };
+    struct pattern p;
+    size_t i, j;
+
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        ASSERT(compile_pattern(&p, patterns[i], (int) strlen(patterns[i])));
+        for (j = 0; j < ARRAY_SIZE(strs); j++) {
+            ASSERT(match_pattern(&p, strs[j]) ==
+                   match_prefix(patterns[i], (int) strlen(patterns[i]), strs[j]));
+        }
+        free_pattern(&p);
+    }
+
+    ASSERT(compile_pattern(&p, "**.cgi$|/api|/x$", 16));
+    ASSERT(p.num_alts == 3);
+    ASSERT(p.alts[0].kind == PATTERN_SUFFIX);
+    ASSERT(p.alts[1].kind == PATTERN_PREFIX);
+    ASSERT(p.alts[2].kind == PATTERN_EXACT);
+    free_pattern(&p);
+
+    ASSERT(compile_pattern(&p, NULL, 0));
+    ASSERT(match_pattern(&p, "/") == -1);
+}
+
 static void test_remove_double_dots() {
     struct { char before[20], after[20]; } data[] = {
         {"////a", "/a"},
@@ -420,6 +525,35 @@ static void test_mg_download(int use_ssl) {
     mg_stop(ctx);
 }
 
+static void test_request_timeout(void) {
+    const char *options[] = {
+        "listening_ports", "127.0.0.1:8082",
+        "request_timeout_ms", "1000",
+        NULL
+    };
+    struct mg_context *ctx;
+    struct mg_connection *conn;
+    char ebuf[100], buf[16];
+    time_t start;
+
+    ASSERT((ctx = mg_start(NULL, NULL, options)) != NULL);
+
+    /* Accepted sockets must have the timeout of the listening socket */
+    ASSERT((conn = mg_connect("127.0.0.1", 8082, 0, ebuf, sizeof(ebuf))) != NULL);
+    if (conn != NULL) {
+        set_sock_timeout(conn->client.sock, 5000);
+        ASSERT(mg_printf(conn, "%s", "GET / HTTP/1.1\r\n") > 0);
+
+        /* The server must give up on the partial request */
+        start = time(NULL);
+        ASSERT(recv(conn->client.sock, buf, sizeof(buf), 0) <= 0);
+        ASSERT(time(NULL) - start < 4);
+        mg_close_connection(conn);
+    }
+
+    mg_stop(ctx);
+}
+
 static int alloc_printf(char **buf, size_t size, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -545,17 +679,388 @@ static void test_mg_get_var(void) {
     ASSERT(mg_get_var(post[1], strlen(post[1]), "st", buf, 17) == 16);
 }
 
+static int throttle(const char *spec, uint32_t remote_ip, const char *uri) {
+    struct mg_context ctx;
+    struct token_bucket *bucket;
+    int rate;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.config[THROTTLE] = (char *) spec;
+    ASSERT(set_throttle_option(&ctx));
+    rate = set_throttle(&ctx, remote_ip, uri, &bucket);
+    if (bucket != NULL) {
+        /* Shared buckets are reported as a negative rate */
+        ASSERT(bucket->shared && bucket->rate == rate);
+        ASSERT(set_throttle(&ctx, remote_ip, uri, NULL) == rate);
+        rate = -rate;
+    }
+    free_parsed_config(&ctx.cfg);
+    return rate;
+}
+
 static void test_set_throttle(void) {
-    ASSERT(set_throttle(NULL, 0x0a000001, "/") == 0);
-    ASSERT(set_throttle("10.0.0.0/8=20", 0x0a000001, "/") == 20);
-    ASSERT(set_throttle("10.0.0.0/8=0.5k", 0x0a000001, "/") == 512);
-    ASSERT(set_throttle("10.0.0.0/8=17m", 0x0a000001, "/") == 1048576 * 17);
-    ASSERT(set_throttle("10.0.0.0/8=1x", 0x0a000001, "/") == 0);
-    ASSERT(set_throttle("10.0.0.0/8=5,0.0.0.0/0=10", 0x0a000001, "/") == 10);
-    ASSERT(set_throttle("10.0.0.0/8=5,/foo/**=7", 0x0a000001, "/index") == 5);
-    ASSERT(set_throttle("10.0.0.0/8=5,/foo/**=7", 0x0a000001, "/foo/x") == 7);
-    ASSERT(set_throttle("10.0.0.0/8=5,/foo/**=7", 0x0b000001, "/foxo/x") == 0);
-    ASSERT(set_throttle("10.0.0.0/8=5,*=1", 0x0b000001, "/foxo/x") == 1);
+    ASSERT(throttle(NULL, 0x0a000001, "/") == 0);
+    ASSERT(throttle("10.0.0.0/8=20", 0x0a000001, "/") == 20);
+    ASSERT(throttle("10.0.0.0/8=0.5k", 0x0a000001, "/") == 512);
+    ASSERT(throttle("10.0.0.0/8=17m", 0x0a000001, "/") == 1048576 * 17);
+    ASSERT(throttle("10.0.0.0/8=1x", 0x0a000001, "/") == 0);
+    ASSERT(throttle("10.0.0.0/8=5,0.0.0.0/0=10", 0x0a000001, "/") == 10);
+    ASSERT(throttle("10.0.0.0/8=5,/foo/**=7", 0x0a000001, "/index") == 5);
+    ASSERT(throttle("10.0.0.0/8=5,/foo/**=7", 0x0a000001, "/foo/x") == 7);
+    ASSERT(throttle("10.0.0.0/8=5,/foo/**=7", 0x0b000001, "/foxo/x") == 0);
+    ASSERT(throttle("10.0.0.0/8=5,*=1", 0x0b000001, "/foxo/x") == 1);
+    ASSERT(throttle("10.0.0.0/8=5:shared", 0x0a000001, "/") == -5);
+    ASSERT(throttle("10.0.0.0/8=1k:Shared", 0x0a000001, "/") == -1024);
+    ASSERT(throttle("10.0.0.0/8=0:shared", 0x0a000001, "/") == 0);
+    ASSERT(throttle("10.0.0.0/8=1k:sharedx", 0x0a000001, "/") == 0);
+    ASSERT(throttle("/foo/**=1k:shared,*=7", 0x0a000001, "/foo/x") == 7);
+    ASSERT(throttle("*=7,/foo/**=1k:shared", 0x0a000001, "/foo/x") == -1024);
+}
+
+static void test_token_bucket(void) {
+    struct token_bucket b;
+    int64_t wait = -1;
+
+    /* A full burst right away, then a wait for a quarter of it */
+    memset(&b, 0, sizeof(b));
+    init_token_bucket(&b, 10000);
+    ASSERT(b.burst == 1024);
+    ASSERT(take_tokens(&b, 5000, &wait) == 1024);
+    ASSERT(take_tokens(&b, 5000, &wait) == 0);
+    ASSERT(wait > 0 && wait <= 25700);
+
+    /* Small writes need not wait for a quarter burst */
+    b.tokens = 100 * 1000000;
+    ASSERT(take_tokens(&b, 10, &wait) == 10);
+
+    /* Idle time refills up to the burst only */
+    b.updated -= 1000000;
+    ASSERT(take_tokens(&b, 5000, &wait) == 1024);
+
+    init_token_bucket(&b, 100 * 1048576);
+    ASSERT(b.burst == 10 * 1048576);
+    init_token_bucket(&b, 100);
+    ASSERT(b.burst == 100);
+}
+
+static int acl(const char *list, uint32_t remote_ip) {
+    struct mg_context ctx;
+    int allowed = -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.config[ACCESS_CONTROL_LIST] = (char *) list;
+    if (set_acl_option(&ctx)) {
+        allowed = check_acl(&ctx, remote_ip);
+    }
+    mg_free(ctx.cfg.acl);
+    return allowed;
+}
+
+static void test_check_acl(void) {
+    ASSERT(acl(NULL, 0x0a000001) == 1);
+    ASSERT(acl("", 0x0a000001) == 0);
+    ASSERT(acl("+10.0.0.0/8", 0x0a000001) == 1);
+    ASSERT(acl("+10.0.0.0/8", 0x0b000001) == 0);
+    ASSERT(acl("+0.0.0.0/0,-10.1.0.0/16", 0x0a010001) == 0);
+    ASSERT(acl("+0.0.0.0/0,-10.1.0.0/16", 0x0a020001) == 1);
+    ASSERT(acl("+10.0.0.0/8,10.1.0.0/16", 0x0a000001) == -1);
+    ASSERT(acl("+10.0.0.0/33", 0x0a000001) == -1);
+}
+
+static int route_handler(struct mg_connection *conn, void *cbdata) {
+    conn->request_info.user_data = cbdata;
+    return 1;
+}
+
+static const char *route(struct mg_context *ctx, const char *uri) {
+    struct mg_connection conn;
+    int handled;
+
+    memset(&conn, 0, sizeof(conn));
+    (void) pthread_mutex_init(&conn.mutex, NULL);
+    conn.ctx = ctx;
+    conn.request_info.uri = uri;
+    handled = use_request_handler(&conn);
+    ASSERT(conn.routes == ctx->routes);
+    (void) pthread_mutex_destroy(&conn.mutex);
+    return handled ? (const char *) conn.request_info.user_data : NULL;
+}
+
+static void test_request_routes(void) {
+    struct mg_context ctx;
+    struct mg_request_handler_info *rh;
+
+    memset(&ctx, 0, sizeof(ctx));
+    (void) pthread_mutex_init(&ctx.thread_mutex, NULL);
+    (void) pthread_mutex_init(&ctx.latency_mutex, NULL);
+    (void) pthread_mutex_init(&ctx.handlers_mutex, NULL);
+
+    mg_set_request_handler(&ctx, "/api", route_handler, "api");
+    ASSERT(route(&ctx, "/") == NULL);
+    mg_set_request_handler(&ctx, "/", route_handler, "root");
+    mg_set_request_handler(&ctx, "/api/v1/users", route_handler, "users");
+    mg_set_request_handler(&ctx, "/api/*/items", route_handler, "items");
+    mg_set_request_handler(&ctx, "**.php$", route_handler, "php");
+
+    ASSERT(strcmp(route(&ctx, "/"), "root") == 0);
+    ASSERT(strcmp(route(&ctx, "/apix"), "root") == 0);
+    ASSERT(strcmp(route(&ctx, "/api"), "api") == 0);
+    ASSERT(strcmp(route(&ctx, "/api/"), "api") == 0);
+    ASSERT(strcmp(route(&ctx, "/api/v1"), "api") == 0);
+    ASSERT(strcmp(route(&ctx, "/api/v1/users/42"), "users") == 0);
+    ASSERT(strcmp(route(&ctx, "/api/v2/items"), "items") == 0);
+    ASSERT(strcmp(route(&ctx, "/x/y.php"), "php") == 0);
+    ASSERT(strcmp(route(&ctx, "/api/v1/users/y.php"), "users") == 0);
+
+    /* Replacing or removing a handler retires the previous table */
+    mg_set_request_handler(&ctx, "/api", route_handler, "api2");
+    ASSERT(strcmp(route(&ctx, "/api/v1"), "api2") == 0);
+    mg_set_request_handler(&ctx, "/api/v1/users", NULL, NULL);
+    ASSERT(strcmp(route(&ctx, "/api/v1/users/42"), "api2") == 0);
+    mg_set_request_handler(&ctx, "/nothing", NULL, NULL);
+    ASSERT(ctx.retired_routes == NULL);
+
+    free_route_table(ctx.routes);
+    while ((rh = ctx.request_handlers) != NULL) {
+        ctx.request_handlers = rh->next;
+        free_request_handler(rh);
+    }
+    (void) pthread_mutex_destroy(&ctx.thread_mutex);
+    (void) pthread_mutex_destroy(&ctx.latency_mutex);
+    (void) pthread_mutex_destroy(&ctx.handlers_mutex);
+}
+
+#if defined(USE_FILE_CACHE)
+static void test_file_cache(void) {
+    struct mg_context ctx;
+    struct mg_connection conn;
+    struct file file = STRUCT_FILE_INITIALIZER;
+    const char *path = "file_cache.txt";
+    FILE *fp;
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&conn, 0, sizeof(conn));
+    conn.ctx = &ctx;
+    ctx.config[FILE_CACHE_SIZE] = "4";
+    ctx.config[FILE_CACHE_TTL] = "60000";
+    ctx.config[STATIC_CACHE_SIZE] = "65536";
+    ctx.file_cache = create_file_cache(&ctx);
+    ASSERT(ctx.file_cache != NULL);
+
+    ASSERT(!mg_stat(&conn, path, &file));
+    fp = fopen(path, "w");
+    fputs("hello", fp);
+    fclose(fp);
+    /* The missing file is cached until invalidated */
+    ASSERT(!mg_stat(&conn, path, &file));
+    file_changed(&conn, path);
+    ASSERT(mg_stat(&conn, path, &file) && file.size == 5);
+
+    ASSERT(file_cache_open(&conn, path, &file) && file.cached != NULL);
+    ASSERT(file.cached->refs == 2);
+    ASSERT(file.cached->mime.len == 10);
+    ASSERT(file.membuf == NULL);
+    mg_fclose(&file);
+
+    /* The second request keeps the content in memory */
+    ASSERT(file_cache_open(&conn, path, &file) && file.membuf != NULL);
+    ASSERT(memcmp(file.membuf, "hello", 5) == 0);
+    ASSERT(conn.stats[STAT_STATIC_CACHE_EVICTIONS] == 0);
+    file_changed(&conn, path);
+    /* Still usable by the request that opened it */
+    ASSERT(file.cached->refs == 1 && file.cached->fd >= 0);
+    mg_fclose(&file);
+    ASSERT(file.cached == NULL);
+    remove(path);
+
+    /* Removing a directory forgets everything below it, and only that */
+    ASSERT(!mg_stat(&conn, "fc_dir/a", &file));
+    ASSERT(!mg_stat(&conn, "fc_dirx/a", &file));
+    mkdir("fc_dir", 0755);
+    mkdir("fc_dirx", 0755);
+    fclose(fopen("fc_dir/a", "w"));
+    fclose(fopen("fc_dirx/a", "w"));
+    directory_removed(&conn, "fc_dir/");
+    ASSERT(mg_stat(&conn, "fc_dir/a", &file));
+    ASSERT(!mg_stat(&conn, "fc_dirx/a", &file));
+    remove("fc_dir/a");
+    remove("fc_dirx/a");
+    rmdir("fc_dir");
+    rmdir("fc_dirx");
+
+#if defined(USE_INOTIFY)
+    /* Creating a file in a watched directory also refreshes the directory.
+       Use a fresh cache, so that no earlier event flushes it. */
+    {
+        struct timeval tv[2] = {{1000000000, 0}, {1000000000, 0}};
+
+        destroy_file_cache(ctx.file_cache);
+        ctx.config[FILE_CACHE_SIZE] = "64";
+        ctx.file_cache = create_file_cache(&ctx);
+        ASSERT(ctx.file_cache != NULL);
+        mkdir("fc_dir", 0755);
+        utimes("fc_dir", tv);
+        ASSERT(mg_stat(&conn, "fc_dir", &file));
+        ASSERT(file.modification_time == 1000000000);
+        ASSERT(!mg_stat(&conn, "fc_dir/a", &file));
+        fclose(fopen("fc_dir/a", "w"));
+        read_file_cache_events(&ctx);
+        ASSERT(mg_stat(&conn, "fc_dir", &file));
+        ASSERT(file.modification_time != 1000000000);
+        ASSERT(mg_stat(&conn, "fc_dir/a", &file));
+        remove("fc_dir/a");
+        rmdir("fc_dir");
+    }
+#endif
+
+    destroy_file_cache(ctx.file_cache);
+}
+#endif
+
+static void test_get_encoding_quality(void) {
+    ASSERT(get_encoding_quality("gzip", "gzip") == 1000);
+    ASSERT(get_encoding_quality("deflate, GZIP;q=0.5", "gzip") == 500);
+    ASSERT(get_encoding_quality("x-gzip", "gzip") == 0);
+    ASSERT(get_encoding_quality("gzip;q=0", "gzip") == 0);
+    ASSERT(get_encoding_quality("br ; q=0.8 , *;q=0.1", "gzip") == 100);
+    ASSERT(get_encoding_quality("*;q=0.1, gzip;q=0", "gzip") == 0);
+    ASSERT(get_encoding_quality("", "gzip") == 0);
+}
+
+static void test_clock(void) {
+    struct mg_context ctx;
+    char buf[64], expected[64];
+    time_t now = time(NULL), then = now - 3600;
+
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_mutex_init(&ctx.clock.mutex, NULL);
+
+    ASSERT(!read_clock(&ctx, now, 0, buf, sizeof(buf)));
+    refresh_clock(&ctx, now);
+    gmt_time_string(expected, sizeof(expected), &now);
+    ASSERT(read_clock(&ctx, now, 0, buf, sizeof(buf)) &&
+           strcmp(buf, expected) == 0);
+
+    /* Other times are formatted without touching the clock */
+    log_date_string(&ctx, buf, sizeof(buf), then);
+    log_time_string(expected, sizeof(expected), &then);
+    ASSERT(strcmp(buf, expected) == 0);
+    ASSERT(!read_clock(&ctx, then, 1, buf, sizeof(buf)));
+    ASSERT(read_clock(&ctx, now, 1, buf, sizeof(buf)));
+
+    pthread_mutex_destroy(&ctx.clock.mutex);
+}
+
+static void test_log_writer(void) {
+    struct mg_context ctx;
+    struct log_writer *w;
+    const char *path = "log_writer.txt";
+    char buf[64];
+    FILE *fp;
+    int i;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.config[LOG_BUFFER_SIZE] = "16";
+    ctx.config[LOG_BUFFER_FULL] = "block";
+    remove(path);
+
+    /* Everything is written, in order, by the time the writer is gone */
+    ASSERT((w = create_log_writer(&ctx, path)) != NULL);
+    for (i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "%d\n", i);
+        log_write(w, buf, strlen(buf));
+    }
+    log_write(w, "a line longer than the buffer\n", 30);
+    ASSERT(log_lines_dropped(w) == 1);
+    log_write(w, "end\n", 4);
+    destroy_log_writer(w);
+    ASSERT((fp = fopen(path, "r")) != NULL);
+    for (i = 0; i < 100; i++) {
+        ASSERT(fgets(buf, sizeof(buf), fp) != NULL && atoi(buf) == i);
+    }
+    ASSERT(fgets(buf, sizeof(buf), fp) != NULL && strcmp(buf, "end\n") == 0);
+    ASSERT(fgets(buf, sizeof(buf), fp) == NULL);
+    fclose(fp);
+
+    /* Lines that do not fit are dropped and counted, without waiting */
+    ctx.config[LOG_BUFFER_FULL] = "drop";
+    ASSERT((w = create_log_writer(&ctx, path)) != NULL);
+    (void) pthread_mutex_lock(&w->mutex);
+    memset(w->buf, '\n', w->size);
+    w->len = w->size;
+    (void) pthread_mutex_unlock(&w->mutex);
+    log_write(w, "x\n", 2);
+    ASSERT(log_lines_dropped(w) == 1);
+    destroy_log_writer(w);
+    remove(path);
+}
+
+static void test_access_log_format(void) {
+    struct mg_context ctx;
+    struct mg_connection conn;
+    char buf[256];
+    int len;
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&conn, 0, sizeof(conn));
+    conn.ctx = &ctx;
+    conn.request_info.request_method = "GET";
+    conn.request_info.uri = "/a\"b";
+    conn.status_code = 200;
+    conn.num_bytes_sent = 1234;
+
+    ctx.config[ACCESS_LOG_FORMAT] = "xml";
+    ctx.config[ACCESS_LOG_FIELDS] = "uri";
+    ASSERT(!set_access_log_format_option(&ctx));
+    ctx.config[ACCESS_LOG_FORMAT] = "json";
+    ctx.config[ACCESS_LOG_FIELDS] = "uri,bogus";
+    ASSERT(!set_access_log_format_option(&ctx));
+
+    ctx.config[ACCESS_LOG_FIELDS] = "method,uri,query,status,bytes_sent";
+    ASSERT(set_access_log_format_option(&ctx));
+    ASSERT(ctx.cfg.access_log_format == ACCESS_LOG_JSON);
+    len = print_json_record(&conn, buf, sizeof(buf));
+    ASSERT(len > 0 && !memcmp(buf, "{\"method\":\"GET\",\"uri\":\"/a\\\"b\","
+                              "\"query\":null,\"status\":200,"
+                              "\"bytes_sent\":1234}\n", (size_t) len));
+
+    /* Fields that do not fit are left out, the record stays valid */
+    len = print_json_record(&conn, buf, 40);
+    ASSERT(len > 0 && !memcmp(buf, "{\"method\":\"GET\",\"uri\":\"/a\\\"b\"}\n",
+                              (size_t) len));
+
+    ctx.config[ACCESS_LOG_FORMAT] = "binary";
+    ctx.config[ACCESS_LOG_FIELDS] = "status,uri,query";
+    ASSERT(set_access_log_format_option(&ctx));
+    len = print_binary_record(&conn, buf, sizeof(buf));
+    ASSERT(len == 6 + 9 + 5 + 5 + 4);
+    ASSERT(!memcmp(buf, "\x1d\0\0\0\x03\0", 6));
+    ASSERT(!memcmp(buf + 6, "\x09\xc8\0\0\0\0\0\0\0", 9));
+    ASSERT(!memcmp(buf + 15, "\x05\0\0\x04\0", 5));
+    ASSERT(!memcmp(buf + 20, "\x06\0\0\xff\xff", 5));
+    ASSERT(!memcmp(buf + 25, "/a\"b", 4));
+}
+
+static void test_parse_range_set(void) {
+    struct byte_range r[4];
+
+    ASSERT(parse_range_set("bytes=-500", 1000, r, 4) == 1);
+    ASSERT(r[0].start == 500 && r[0].end == 999);
+    ASSERT(parse_range_set("bytes=-5000", 1000, r, 4) == 1);
+    ASSERT(r[0].start == 0 && r[0].end == 999);
+    ASSERT(parse_range_set("bytes=900-", 1000, r, 4) == 1);
+    ASSERT(r[0].start == 900 && r[0].end == 999);
+    ASSERT(parse_range_set("bytes=500-600, 0-99,550-700", 1000, r, 4) == 2);
+    ASSERT(r[0].start == 0 && r[0].end == 99);
+    ASSERT(r[1].start == 500 && r[1].end == 700);
+    ASSERT(parse_range_set("bytes=0-9,10-19", 1000, r, 4) == 1);
+    ASSERT(r[0].start == 0 && r[0].end == 19);
+    ASSERT(parse_range_set("bytes=1000-", 1000, r, 4) == 0);
+    ASSERT(parse_range_set("bytes=-0", 1000, r, 4) == 0);
+    ASSERT(parse_range_set("bytes=5-1", 1000, r, 4) == -1);
+    ASSERT(parse_range_set("bytes=1-2x", 1000, r, 4) == -1);
+    ASSERT(parse_range_set("lines=1-2", 1000, r, 4) == -1);
+    ASSERT(parse_range_set("bytes=1-1,3-3,5-5,7-7,9-9", 1000, r, 4) == -1);
 }
 
 static void test_next_option(void) {
@@ -847,6 +1352,47 @@ static void test_md5(void) {
     ASSERT(strcmp(md5_str, "95c098bd85b619b24a83d9cea5e8ba54")==0);
 }
 
+static void test_latency_histogram(void) {
+    struct latency_histogram hist, base, win;
+    int64_t v;
+    int i;
+
+    /* Every value falls into a bucket whose limit is within 1/8 above it */
+    for (v = 0; v < 100000; v += 1 + v / 16) {
+        i = latency_bucket(v);
+        ASSERT(i >= 0 && i < HIST_BUCKETS);
+        ASSERT(latency_bucket_limit(i) >= v);
+        ASSERT(latency_bucket_limit(i) <= v + v / 8);
+        ASSERT(i == 0 || latency_bucket_limit(i - 1) < v);
+    }
+    ASSERT(latency_bucket((int64_t) 1 << 50) == HIST_BUCKETS - 1);
+
+    memset(&hist, 0, sizeof(hist));
+    for (v = 1; v <= 1000; v++) {
+        record_latency(&hist, v);
+    }
+    ASSERT(hist.count == 1000 && hist.max == 1000);
+    ASSERT(latency_percentile(&hist, 500) >= 500);
+    ASSERT(latency_percentile(&hist, 500) <= 500 + 500 / 8);
+    ASSERT(latency_percentile(&hist, 999) >= 999);
+    ASSERT(latency_percentile(&hist, 1000) == 1000);
+
+    /* A window covers the requests since the last reset, totals do not */
+    memset(&base, 0, sizeof(base));
+    latency_window(&win, &hist, &base, 1);
+    ASSERT(win.count == 1000 && win.max == 1000);
+    for (v = 1; v <= 10; v++) {
+        record_latency(&hist, v);
+    }
+    latency_window(&win, &hist, &base, 0);
+    ASSERT(win.count == 10 && win.sum == 55 && win.max == 10);
+    ASSERT(latency_percentile(&win, 1000) == 10);
+    ASSERT(hist.count == 1010);
+    latency_window(&win, &hist, &base, 1);
+    latency_window(&win, &hist, &base, 0);
+    ASSERT(win.count == 0 && win.max == 0);
+}
+
 int __cdecl main(void) {
 
     char buffer[512];
@@ -880,11 +1426,25 @@ int __cdecl main(void) {
     test_alloc_vprintf();
     test_base64_encode();
     test_match_prefix();
+    test_match_pattern();
     test_remove_double_dots();
     test_should_keep_alive();
     test_parse_http_message();
+    test_scan_request();
+    test_header_index();
     test_mg_get_var();
     test_set_throttle();
+    test_token_bucket();
+    test_check_acl();
+    test_request_routes();
+#if defined(USE_FILE_CACHE)
+    test_file_cache();
+#endif
+    test_get_encoding_quality();
+    test_parse_range_set();
+    test_clock();
+    test_log_writer();
+    test_access_log_format();
     test_next_option();
     test_mg_stat();
     test_skip_quoted();
@@ -892,6 +1452,7 @@ int __cdecl main(void) {
     test_mg_get_cookie();
     test_strtoll();
     test_md5();
+    test_latency_histogram();
 
     /* start stop server */
     ctx = mg_start(NULL, NULL, OPTIONS);
@@ -900,6 +1461,7 @@ int __cdecl main(void) {
     mg_stop(ctx);
 
     /* tests with network access */
+    test_request_timeout();
     test_mg_download(0);
 #ifndef NO_SSL
     test_mg_download(1);